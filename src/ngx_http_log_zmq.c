@@ -23,6 +23,131 @@
 
 #include "ngx_http_log_zmq.h"
 
+/* names used by the status handler, in the ngx_log_zmq_stat_e order */
+ngx_str_t log_zmq_stat_names[] = {
+    ngx_string("sent"),
+    ngx_string("failed"),
+    ngx_string("offload_queued"),
+    ngx_string("offload_batches"),
+    ngx_string("offload_usec"),
+    ngx_string("rate_limited"),
+    ngx_string("sampled_out"),
+    ngx_string("queue_full"),
+    ngx_string("queued_bytes"),
+    ngx_string("not_ready"),
+    ngx_string("unsubscribed"),
+    ngx_string("truncated"),
+    ngx_string("oversized"),
+    ngx_string("low_priority"),
+    ngx_string("not_writable"),
+    ngx_null_string
+};
+
+/* names used by the status handler, in the ngx_log_zmq_timing_e order */
+ngx_str_t log_zmq_timing_names[] = {
+    ngx_string("script"),
+    ngx_string("serialize"),
+    ngx_string("setup"),
+    ngx_string("send"),
+    ngx_string("handler"),
+    ngx_null_string
+};
+
+/* timing histograms of this worker, NULL if log_zmq_timing is off */
+ngx_http_log_zmq_timing_t *log_zmq_timing;
+
+/* bytes of all definitions of this worker given to ZMQ and not freed yet */
+static ngx_atomic_t log_zmq_queued_bytes;
+
+/**
+ * @brief header of a message with a byte limit, before the message data
+ */
+typedef struct {
+    ngx_http_log_zmq_ctx_t *ctx;            /**< Context of the definition */
+    size_t                  size;           /**< Message size */
+} log_zmq_msg_hint_t;
+
+/**
+ * @brief kinds of socket option values
+ */
+typedef enum {
+    LOG_ZMQ_SOCKOPT_NUMBER = 0,     /**< Plain number */
+    LOG_ZMQ_SOCKOPT_FLAG,           /**< on (1) or off (0) */
+    LOG_ZMQ_SOCKOPT_SIZE,           /**< Size in bytes, with k or m */
+    LOG_ZMQ_SOCKOPT_MSEC,           /**< Time in milliseconds, with s, m, ... */
+    LOG_ZMQ_SOCKOPT_SEC             /**< Time in seconds, with m, h, ... */
+} log_zmq_sockopt_kind_e;
+
+/**
+ * @brief socket options known by log_zmq_socket_option
+ *
+ * An option is only listed if the libzmq headers define it, and it is
+ * refused at configuration time if the linked libzmq is older than the
+ * version that added it.
+ */
+typedef struct {
+    ngx_str_t               name;           /**< Name used in the directive */
+    int                     option;         /**< ZMQ_* option */
+    log_zmq_sockopt_kind_e  kind;           /**< Kind of value */
+    int                     version;        /**< First libzmq version with the option */
+} log_zmq_sockopt_def_t;
+
+static log_zmq_sockopt_def_t log_zmq_sockopts[] = {
+    { ngx_string("sndbuf"), ZMQ_SNDBUF, LOG_ZMQ_SOCKOPT_SIZE, ZMQ_MAKE_VERSION(3, 0, 0) },
+    { ngx_string("sndtimeo"), ZMQ_SNDTIMEO, LOG_ZMQ_SOCKOPT_MSEC, ZMQ_MAKE_VERSION(3, 0, 0) },
+    { ngx_string("reconnect_ivl"), ZMQ_RECONNECT_IVL, LOG_ZMQ_SOCKOPT_MSEC, ZMQ_MAKE_VERSION(3, 0, 0) },
+    { ngx_string("reconnect_ivl_max"), ZMQ_RECONNECT_IVL_MAX, LOG_ZMQ_SOCKOPT_MSEC, ZMQ_MAKE_VERSION(3, 0, 0) },
+#ifdef ZMQ_TCP_KEEPALIVE
+    { ngx_string("tcp_keepalive"), ZMQ_TCP_KEEPALIVE, LOG_ZMQ_SOCKOPT_FLAG, ZMQ_MAKE_VERSION(3, 2, 0) },
+    { ngx_string("tcp_keepalive_idle"), ZMQ_TCP_KEEPALIVE_IDLE, LOG_ZMQ_SOCKOPT_SEC, ZMQ_MAKE_VERSION(3, 2, 0) },
+    { ngx_string("tcp_keepalive_intvl"), ZMQ_TCP_KEEPALIVE_INTVL, LOG_ZMQ_SOCKOPT_SEC, ZMQ_MAKE_VERSION(3, 2, 0) },
+    { ngx_string("tcp_keepalive_cnt"), ZMQ_TCP_KEEPALIVE_CNT, LOG_ZMQ_SOCKOPT_NUMBER, ZMQ_MAKE_VERSION(3, 2, 0) },
+#endif
+#ifdef ZMQ_IMMEDIATE
+    { ngx_string("immediate"), ZMQ_IMMEDIATE, LOG_ZMQ_SOCKOPT_FLAG, ZMQ_MAKE_VERSION(4, 0, 0) },
+#endif
+#ifdef ZMQ_TOS
+    { ngx_string("tos"), ZMQ_TOS, LOG_ZMQ_SOCKOPT_NUMBER, ZMQ_MAKE_VERSION(4, 1, 0) },
+#endif
+#ifdef ZMQ_XPUB_NODROP
+    { ngx_string("xpub_nodrop"), ZMQ_XPUB_NODROP, LOG_ZMQ_SOCKOPT_FLAG, ZMQ_MAKE_VERSION(4, 1, 0) },
+#endif
+#ifdef ZMQ_OUT_BATCH_SIZE
+    { ngx_string("out_batch_size"), ZMQ_OUT_BATCH_SIZE, LOG_ZMQ_SOCKOPT_SIZE, ZMQ_MAKE_VERSION(4, 3, 3) },
+#endif
+    { ngx_null_string, 0, 0, 0 }
+};
+
+#if (NGX_THREADS)
+static ngx_int_t log_zmq_batch_add(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log,
+    ngx_str_t *endpoint, ngx_str_t *data, ngx_str_t *fields);
+#endif
+
+static void log_zmq_trie_clear(ngx_http_log_zmq_trie_t *node);
+#ifdef ZMQ_XPUB
+static void log_zmq_subscriptions_read(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log);
+#endif
+
+/**
+ * @brief get default port for the input type of protocol
+ *
+ * @param kind A ngx_log_zmq_server_kind with the value TCP|IPC|INPROC
+ * @return A in_port_t with an integer with the port
+ */
+static in_port_t __get_default_port(const ngx_log_zmq_server_kind kind){
+    static const in_port_t DEFAULT_PORT = 0;
+
+    switch(kind){
+        case TCP:
+            return 5555;
+        case IPC:
+        case INPROC:
+            return 0;
+    }
+
+    return DEFAULT_PORT;
+}
+
 /**
  * @brief initialize ZMQ context
  *
@@ -51,6 +176,99 @@ zmq_init_ctx(ngx_http_log_zmq_ctx_t *ctx)
     return 0;
 }
 
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+
+/**
+ * @brief place the I/O threads of a definition context
+ *
+ * Without a CPU list the threads get the CPUs that no worker is bound to
+ * by worker_cpu_affinity. If the workers are not bound, or use all the
+ * CPUs, the threads are left where the kernel puts them. A failure is only
+ * logged, the messages are sent anyway.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ */
+static void
+log_zmq_io_threads_init(ngx_http_log_zmq_element_conf_t *cf)
+{
+    ngx_uint_t       i, n;
+    int             *cpu;
+#if (NGX_HAVE_CPU_AFFINITY && nginx_version >= 1009010)
+    ngx_core_conf_t *ccf;
+    ngx_cpuset_t     used, *mask;
+    ngx_uint_t       w;
+#endif
+
+    n = 0;
+
+    if (cf->io_cpus) {
+        cpu = cf->io_cpus->elts;
+        for (i = 0; i < cf->io_cpus->nelts; i++) {
+            if (zmq_ctx_set(cf->ctx->zmq_context, ZMQ_THREAD_AFFINITY_CPU_ADD, cpu[i]) != 0) {
+                ngx_log_error(NGX_LOG_WARN, cf->ctx->log, 0, "ZMQ: error adding cpu %d to the I/O threads: %s",
+                              cpu[i], strerror(errno));
+                continue;
+            }
+            n++;
+        }
+
+    } else {
+#if (NGX_HAVE_CPU_AFFINITY && nginx_version >= 1009010)
+        ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx, ngx_core_module);
+
+        if (ccf->cpu_affinity) {
+            CPU_ZERO(&used);
+
+            for (w = 0; w < (ngx_uint_t) ccf->worker_processes; w++) {
+                mask = ngx_get_cpu_affinity(w);
+                if (NULL == mask) {
+                    continue;
+                }
+                for (i = 0; i < ngx_ncpu && i < CPU_SETSIZE; i++) {
+                    if (CPU_ISSET(i, mask)) {
+                        CPU_SET(i, &used);
+                    }
+                }
+            }
+
+            for (i = 0; i < ngx_ncpu && i < CPU_SETSIZE; i++) {
+                if (CPU_ISSET(i, &used)) {
+                    continue;
+                }
+                if (zmq_ctx_set(cf->ctx->zmq_context, ZMQ_THREAD_AFFINITY_CPU_ADD, (int) i) != 0) {
+                    ngx_log_error(NGX_LOG_WARN, cf->ctx->log, 0, "ZMQ: error adding cpu %ui to the I/O threads: %s",
+                                  i, strerror(errno));
+                    continue;
+                }
+                n++;
+            }
+
+            if (0 == n) {
+                ngx_log_error(NGX_LOG_WARN, cf->ctx->log, 0,
+                              "ZMQ: all the cpus have workers, the I/O threads of \"%V\" are not bound", cf->name);
+            }
+        }
+#endif
+    }
+
+    if (cf->io_policy != -1
+        && zmq_ctx_set(cf->ctx->zmq_context, ZMQ_THREAD_SCHED_POLICY, (int) cf->io_policy) != 0)
+    {
+        ngx_log_error(NGX_LOG_WARN, cf->ctx->log, 0, "ZMQ: error setting the I/O threads policy: %s", strerror(errno));
+    }
+
+    if (cf->io_priority != -1
+        && zmq_ctx_set(cf->ctx->zmq_context, ZMQ_THREAD_PRIORITY, (int) cf->io_priority) != 0)
+    {
+        ngx_log_error(NGX_LOG_WARN, cf->ctx->log, 0, "ZMQ: error setting the I/O threads priority: %s", strerror(errno));
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, cf->ctx->log, 0, "ZMQ: io_threads_init() \"%V\" cpus=%ui policy=%i priority=%i",
+                   cf->name, n, cf->io_policy, cf->io_priority);
+}
+
+#endif
+
 /**
  * @brief create ZMQ Context
  *
@@ -87,6 +305,13 @@ zmq_create_ctx(ngx_http_log_zmq_element_conf_t *cf)
         return rc;
     }
 
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+    /* the I/O threads start with the first socket, so they can still be placed */
+    if (cf->io_set) {
+        log_zmq_io_threads_init(cf);
+    }
+#endif
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->ctx->log, 0, "ZMQ: zmq_create_ctx() success");
     return 0;
 }
@@ -116,6 +341,17 @@ zmq_term_ctx(ngx_http_log_zmq_ctx_t *ctx)
         ctx->zmq_context = NULL;
     }
 
+    if (ctx->retry.timer_set) {
+        ngx_del_timer(&ctx->retry);
+    }
+    ctx->state = LOG_ZMQ_STATE_IDLE;
+
+    if (ctx->subscriptions) {
+        log_zmq_trie_clear(ctx->subscriptions);
+        ngx_free(ctx->subscriptions);
+        ctx->subscriptions = NULL;
+    }
+
     /* nullify log */
     if (ctx->log) {
         ctx->log = NULL;
@@ -140,6 +376,8 @@ zmq_create_socket(ngx_pool_t *pool, ngx_http_log_zmq_element_conf_t *cf)
     int linger = ZMQ_NGINX_LINGER, rc = 0;
     zmq_hwm_t qlen = cf->qlen < 0 ? ZMQ_NGINX_QUEUE_LENGTH : cf->qlen;
     char *connection;
+    ngx_http_log_zmq_sockopt_t *opt;
+    ngx_uint_t i;
 
     /* verify if we have a context created */
     if (NULL == cf->ctx->zmq_context) {
@@ -150,7 +388,11 @@ zmq_create_socket(ngx_pool_t *pool, ngx_http_log_zmq_element_conf_t *cf)
     /* verify if we have already a socket associated */
     if (0 == cf->ctx->screated) {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->ctx->log, 0, "ZMQ: zmq_create_socket() create socket");
+#ifdef ZMQ_XPUB
+        cf->ctx->zmq_socket = zmq_socket(cf->ctx->zmq_context, cf->subscriptions ? ZMQ_XPUB : ZMQ_PUB);
+#else
         cf->ctx->zmq_socket = zmq_socket(cf->ctx->zmq_context, ZMQ_PUB);
+#endif
         /* verify if it was created */
         if (NULL == cf->ctx->zmq_socket) {
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->ctx->log, 0, "ZMQ: zmq_create_socket() socket not created");
@@ -176,6 +418,21 @@ zmq_create_socket(ngx_pool_t *pool, ngx_http_log_zmq_element_conf_t *cf)
         return -1;
     }
 
+    /* set the options of log_zmq_socket_option, they must be set before connecting */
+    if (cf->sockopts) {
+        opt = cf->sockopts->elts;
+        for (i = 0; i < cf->sockopts->nelts; i++) {
+            rc = zmq_setsockopt(cf->ctx->zmq_socket, opt[i].option, &opt[i].value, sizeof(int));
+            if (rc != 0) {
+                ngx_log_error(NGX_LOG_ERR, cf->ctx->log, 0, "ZMQ error setting option %s: %s",
+                              opt[i].name, strerror(errno));
+                return -1;
+            }
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->ctx->log, 0, "ZMQ: zmq_create_socket() %s=%d",
+                           opt[i].name, opt[i].value);
+        }
+    }
+
     /* create a simple char * to the connection name */
     connection = ngx_pcalloc(pool, cf->server->connection->len + 1);
     ngx_memcpy(connection, cf->server->connection->data, cf->server->connection->len);
@@ -228,3 +485,4311 @@ log_zmq_serialize(ngx_pool_t *pool, ngx_str_t *endpoint, ngx_str_t *data, ngx_st
 
     return NGX_OK;
 }
+
+/**
+ * @brief end of the backoff of a definition
+ *
+ * @param ev A ngx_event_t pointer with the definition as data
+ */
+static void
+log_zmq_retry(ngx_event_t *ev)
+{
+    ngx_http_log_zmq_element_conf_t *cf = ev->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "log_zmq: retry(): \"%V\" idle", cf->name);
+
+    if (LOG_ZMQ_STATE_BACKOFF == cf->ctx->state) {
+        cf->ctx->state = LOG_ZMQ_STATE_IDLE;
+    }
+}
+
+/**
+ * @brief the ZMQ_FD of the definition socket is readable
+ *
+ * ZMQ signals its descriptor when the socket state changes, so the cached
+ * state and the subscriptions of a XPUB socket are only read here, not for
+ * each message. The descriptor is not signaled again for the messages
+ * already there, so all the subscription messages are read.
+ *
+ * @param ev A ngx_event_t pointer to the read event of the watch
+ */
+static void
+log_zmq_watch_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                *c = ev->data;
+    ngx_http_log_zmq_element_conf_t *cf = c->data;
+    int                              events;
+    size_t                           len;
+
+    for ( ;; ) {
+        len = sizeof(int);
+        if (zmq_getsockopt(cf->ctx->zmq_socket, ZMQ_EVENTS, &events, &len) != 0) {
+            return;
+        }
+
+#ifdef ZMQ_XPUB
+        if (cf->subscriptions && (events & ZMQ_POLLIN)) {
+            log_zmq_subscriptions_read(cf, ev->log);
+            continue;
+        }
+#endif
+
+        break;
+    }
+
+    if (!cf->writable) {
+        return;
+    }
+
+    if (events & ZMQ_POLLOUT) {
+        cf->ctx->blocked &= ~LOG_ZMQ_BLOCKED_FULL;
+    } else {
+        cf->ctx->blocked |= LOG_ZMQ_BLOCKED_FULL;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0, "log_zmq: watch(): \"%V\" blocked=%ui",
+                   cf->name, cf->ctx->blocked);
+}
+
+#if (ZMQ_VERSION_MAJOR >= 4)
+
+/**
+ * @brief the ZMQ_FD of the monitor socket is readable
+ *
+ * Each monitor event is a frame with the event (16 bits) and its value (32
+ * bits), in the host byte order, and a frame with the endpoint. A PUB
+ * socket always takes the messages, without a collector they are dropped
+ * once the queue is full, so the connection is part of the socket state.
+ *
+ * @param ev A ngx_event_t pointer to the read event of the monitor
+ */
+static void
+log_zmq_monitor_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                *c = ev->data;
+    ngx_http_log_zmq_element_conf_t *cf = c->data;
+    zmq_msg_t                        msg;
+    uint16_t                         event;
+    int                              more;
+
+    for ( ;; ) {
+        zmq_msg_init(&msg);
+
+        if (zmq_msg_recv(&msg, cf->ctx->monitor, ZMQ_DONTWAIT) < 0) {
+            zmq_msg_close(&msg);
+            break;
+        }
+
+        event = 0;
+        if (zmq_msg_size(&msg) >= sizeof(uint16_t)) {
+            ngx_memcpy(&event, zmq_msg_data(&msg), sizeof(uint16_t));
+        }
+
+        more = zmq_msg_more(&msg);
+        zmq_msg_close(&msg);
+
+        /* the endpoint frame, it is sent with the event frame */
+        if (more) {
+            zmq_msg_init(&msg);
+            (void) zmq_msg_recv(&msg, cf->ctx->monitor, ZMQ_DONTWAIT);
+            zmq_msg_close(&msg);
+        }
+
+        switch (event) {
+
+        case ZMQ_EVENT_CONNECTED:
+            cf->ctx->blocked &= ~LOG_ZMQ_BLOCKED_PEER;
+            break;
+
+        case ZMQ_EVENT_CONNECT_RETRIED:
+        case ZMQ_EVENT_DISCONNECTED:
+        case ZMQ_EVENT_CLOSED:
+            cf->ctx->blocked |= LOG_ZMQ_BLOCKED_PEER;
+            break;
+
+        default:
+            break;
+        }
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ev->log, 0, "log_zmq: monitor(): \"%V\" event=%ui blocked=%ui",
+                       cf->name, (ngx_uint_t) event, cf->ctx->blocked);
+    }
+}
+
+#endif
+
+/**
+ * @brief add the ZMQ_FD of a socket to the event loop
+ *
+ * The descriptor belongs to ZMQ, it only gets a connection for its read
+ * event and it is never closed by nginx.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param socket The ZMQ socket
+ * @param handler The read event handler
+ * @param log A ngx_log_t pointer to the logger
+ * @return A ngx_connection_t pointer, NULL on error
+ */
+static ngx_connection_t *
+log_zmq_watch_fd(ngx_http_log_zmq_element_conf_t *cf, void *socket, ngx_event_handler_pt handler,
+    ngx_log_t *log)
+{
+    ngx_connection_t  *c;
+    ngx_socket_t       fd;
+    size_t             len = sizeof(ngx_socket_t);
+
+    if (zmq_getsockopt(socket, ZMQ_FD, &fd, &len) != 0) {
+        return NULL;
+    }
+
+    c = ngx_get_connection(fd, log);
+    if (NULL == c) {
+        return NULL;
+    }
+
+    c->data = cf;
+    c->log = log;
+    c->read->log = log;
+    c->write->log = log;
+    c->read->handler = handler;
+
+    if (ngx_add_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
+        c->fd = (ngx_socket_t) -1;
+        ngx_free_connection(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+/**
+ * @brief remove a ZMQ_FD from the event loop
+ *
+ * Like ngx_close_connection, without closing the descriptor: the worker
+ * exit looks for connections with a descriptor left.
+ */
+static void
+log_zmq_watch_close(ngx_connection_t *c)
+{
+    if (c->read->active) {
+        (void) ngx_del_event(c->read, NGX_READ_EVENT, 0);
+    }
+
+    if (c->read->posted) {
+        ngx_delete_posted_event(c->read);
+    }
+
+    c->fd = (ngx_socket_t) -1;
+    ngx_free_connection(c);
+}
+
+/**
+ * @brief watch the socket of a definition from the event loop
+ *
+ * With log_zmq_writable the handler skips the messages the socket can not
+ * take, with log_zmq_subscriptions the topics nobody wants. The state is
+ * kept from the descriptors in the event loop: the ZMQ_FD of the socket,
+ * for ZMQ_POLLOUT and the subscriptions, and for log_zmq_writable the
+ * ZMQ_FD of a monitor socket, for the connection to the collector. A
+ * failure only logs, the messages are then always built.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param log A ngx_log_t pointer to the logger
+ * @return An ngx_int_t with NGX_OK | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_watch_start(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log)
+{
+    ngx_http_log_zmq_ctx_t *ctx = cf->ctx;
+#if (ZMQ_VERSION_MAJOR >= 4)
+    u_char                  addr[64];
+#endif
+
+    ctx->blocked = 0;
+
+    ctx->watch = log_zmq_watch_fd(cf, ctx->zmq_socket, log_zmq_watch_handler, ngx_cycle->log);
+    if (NULL == ctx->watch) {
+        goto failed;
+    }
+
+    if (!cf->writable) {
+        return NGX_OK;
+    }
+
+#if (ZMQ_VERSION_MAJOR >= 4)
+    /* the inproc endpoints are private to the context of the definition */
+    ngx_sprintf(addr, "inproc://log_zmq_monitor_%p%Z", ctx);
+
+    if (zmq_socket_monitor(ctx->zmq_socket, (char *) addr, ZMQ_EVENT_CONNECTED | ZMQ_EVENT_CONNECT_RETRIED
+                                                        | ZMQ_EVENT_DISCONNECTED | ZMQ_EVENT_CLOSED) != 0)
+    {
+        goto failed;
+    }
+
+    ctx->monitor = zmq_socket(ctx->zmq_context, ZMQ_PAIR);
+    if (NULL == ctx->monitor || zmq_connect(ctx->monitor, (char *) addr) != 0) {
+        goto failed;
+    }
+
+    ctx->monitor_watch = log_zmq_watch_fd(cf, ctx->monitor, log_zmq_monitor_handler, ngx_cycle->log);
+    if (NULL == ctx->monitor_watch) {
+        goto failed;
+    }
+
+    return NGX_OK;
+#endif
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: watch_start(): \"%V\" error watching the socket: %s",
+                  cf->name, zmq_strerror(errno));
+    log_zmq_watch_stop(cf);
+
+    /* without the subscriptions every topic is sent, ZMQ filters them */
+    if (ctx->subscriptions) {
+        ctx->subscriptions->count++;
+    }
+
+    return NGX_ERROR;
+}
+
+/**
+ * @brief stop watching the socket of a definition
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ */
+void
+log_zmq_watch_stop(ngx_http_log_zmq_element_conf_t *cf)
+{
+    ngx_http_log_zmq_ctx_t *ctx = cf->ctx;
+
+    if (ctx->watch) {
+        log_zmq_watch_close(ctx->watch);
+        ctx->watch = NULL;
+    }
+
+#if (ZMQ_VERSION_MAJOR >= 4)
+    if (ctx->monitor_watch) {
+        log_zmq_watch_close(ctx->monitor_watch);
+        ctx->monitor_watch = NULL;
+    }
+
+    if (ctx->monitor) {
+        if (ctx->zmq_socket) {
+            (void) zmq_socket_monitor(ctx->zmq_socket, NULL, 0);
+        }
+        zmq_close(ctx->monitor);
+        ctx->monitor = NULL;
+    }
+#endif
+
+    ctx->blocked = 0;
+}
+
+/**
+ * @brief check the cached state of the socket before building a message
+ *
+ * A definition that is not connected yet is writable, the message creates
+ * the socket.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @return An ngx_int_t with 1 if the socket can take a message, 0 if not
+ */
+ngx_int_t
+log_zmq_writable(ngx_http_log_zmq_element_conf_t *cf)
+{
+    if (LOG_ZMQ_STATE_READY != cf->ctx->state || 0 == cf->ctx->blocked) {
+        return 1;
+    }
+
+    log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_NOT_WRITABLE, 1);
+
+    return 0;
+}
+
+/**
+ * @brief create the ZMQ context and socket of a definition if needed
+ *
+ * Only an idle definition tries the setup. On a failure the socket is
+ * closed, so the next try starts again from zmq_socket, and the definition
+ * goes to backoff: the messages are skipped, without any syscall, until the
+ * retry timer fires.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param pool A ngx_pool_t pointer to the nginx memory manager
+ * @param log A ngx_log_t pointer to the current logger
+ * @return An ngx_int_t with NGX_OK | NGX_DECLINED (not ready) | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_connect(ngx_http_log_zmq_element_conf_t *cf, ngx_pool_t *pool, ngx_log_t *log)
+{
+    int  rc;
+
+    if (LOG_ZMQ_STATE_READY == cf->ctx->state) {
+        return NGX_OK;
+    }
+
+    if (LOG_ZMQ_STATE_IDLE != cf->ctx->state) {
+        log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_NOT_READY, 1);
+        return NGX_DECLINED;
+    }
+
+    cf->ctx->state = LOG_ZMQ_STATE_CONNECTING;
+    cf->ctx->log = log;
+
+    /* create zmq context if needed */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: connect(): verify ZMQ context");
+    if ((NULL == cf->ctx->zmq_context) && (0 == cf->ctx->ccreated)) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: connect(): creating context");
+        rc = zmq_create_ctx(cf);
+        if (rc != 0) {
+            ngx_log_error(NGX_LOG_INFO, log, 0, "log_zmq: connect(): error creating context");
+            goto failed;
+        }
+    }
+
+    /* open zmq socket if needed */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: connect(): verify ZMQ socket");
+    if (NULL == cf->ctx->zmq_socket && 0 == cf->ctx->screated) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: connect(): creating socket");
+        rc = zmq_create_socket(pool, cf);
+        if (rc != 0) {
+            ngx_log_error(NGX_LOG_INFO, log, 0, "log_zmq: connect(): error creating socket");
+            goto failed;
+        }
+    }
+
+    cf->ctx->state = LOG_ZMQ_STATE_READY;
+    cf->ctx->backoff = 0;
+
+    /* the subscribers of a new socket get the topic ids before the next message */
+    if (cf->topics) {
+        cf->topics->dirty = 1;
+    }
+
+    if (cf->subscriptions && NULL == cf->ctx->subscriptions) {
+        cf->ctx->subscriptions = ngx_calloc(sizeof(ngx_http_log_zmq_trie_t), log);
+        if (NULL == cf->ctx->subscriptions) {
+            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: connect(): error creating subscriptions");
+            goto failed;
+        }
+    }
+
+    if (cf->writable || cf->subscriptions) {
+        (void) log_zmq_watch_start(cf, log);
+    }
+
+    return NGX_OK;
+
+failed:
+
+    /* a socket that failed in setsockopt or connect is not reused */
+    if (cf->ctx->zmq_socket) {
+        zmq_close(cf->ctx->zmq_socket);
+        cf->ctx->zmq_socket = NULL;
+    }
+    cf->ctx->screated = 0;
+
+    /* the subscriptions of the closed socket are gone, the next one gets them again */
+    if (cf->ctx->subscriptions) {
+        log_zmq_trie_clear(cf->ctx->subscriptions);
+    }
+
+    cf->ctx->backoff = cf->ctx->backoff ? ngx_min(cf->ctx->backoff * 2, ZMQ_NGINX_BACKOFF_MAX)
+                                        : ZMQ_NGINX_BACKOFF_MIN;
+    cf->ctx->state = LOG_ZMQ_STATE_BACKOFF;
+
+    ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: connect(): \"%V\" setup failed, next try in %M ms",
+                  cf->name, cf->ctx->backoff);
+
+    cf->ctx->retry.handler = log_zmq_retry;
+    cf->ctx->retry.data = cf;
+    cf->ctx->retry.log = ngx_cycle->log;
+#if (nginx_version >= 1011003)
+    cf->ctx->retry.cancelable = 1;
+#endif
+    ngx_add_timer(&cf->ctx->retry, cf->ctx->backoff);
+
+    return NGX_ERROR;
+}
+
+/**
+ * @brief free a message with a byte limit
+ *
+ * Called by ZMQ, maybe from an I/O thread, when the message was written to
+ * the network or dropped.
+ *
+ * @param data The message data
+ * @param hint A log_zmq_msg_hint_t pointer to the message header
+ */
+static void
+log_zmq_msg_free(void *data, void *hint)
+{
+    log_zmq_msg_hint_t *h = hint;
+
+    (void) ngx_atomic_fetch_add(&h->ctx->queued_bytes, -(ngx_atomic_int_t) h->size);
+    (void) ngx_atomic_fetch_add(&log_zmq_queued_bytes, -(ngx_atomic_int_t) h->size);
+    log_zmq_stat_add(h->ctx, LOG_ZMQ_STAT_QUEUED_BYTES, -(ngx_atomic_int_t) h->size);
+
+    ngx_free(h);
+}
+
+/**
+ * @brief initialize a ZMQ message of a definition
+ *
+ * Without a byte limit ZMQ allocates the message. With one, we allocate it
+ * and count its bytes until ZMQ frees it, so the limit is the memory really
+ * held by the queues, whatever the size of the messages. This can run in a
+ * batch thread.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param msg A zmq_msg_t pointer to initialize
+ * @param size The message size
+ * @return An ngx_int_t with NGX_OK | NGX_DECLINED (over the limit) | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_msg_init(ngx_http_log_zmq_element_conf_t *cf, zmq_msg_t *msg, size_t size)
+{
+    log_zmq_msg_hint_t *h;
+
+    if (0 == cf->max_queue_bytes && 0 == cf->worker_max_queue_bytes) {
+        return zmq_msg_init_size(msg, size) == 0 ? NGX_OK : NGX_ERROR;
+    }
+
+    if ((cf->max_queue_bytes && cf->ctx->queued_bytes + size > cf->max_queue_bytes)
+        || (cf->worker_max_queue_bytes && log_zmq_queued_bytes + size > cf->worker_max_queue_bytes))
+    {
+        log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_QUEUE_FULL, 1);
+        cf->ctx->pressure = 1;
+        return NGX_DECLINED;
+    }
+
+    h = ngx_alloc(sizeof(log_zmq_msg_hint_t) + size, ngx_cycle->log);
+    if (NULL == h) {
+        return NGX_ERROR;
+    }
+
+    h->ctx = cf->ctx;
+    h->size = size;
+
+    (void) ngx_atomic_fetch_add(&cf->ctx->queued_bytes, size);
+    (void) ngx_atomic_fetch_add(&log_zmq_queued_bytes, size);
+    log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_QUEUED_BYTES, size);
+
+    if (zmq_msg_init_data(msg, h + 1, size, log_zmq_msg_free, h) != 0) {
+        log_zmq_msg_free(h + 1, h);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * @brief write a 64 bits integer in network byte order
+ */
+static u_char *
+log_zmq_write_uint64(u_char *p, uint64_t v)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < 8; i++) {
+        p[i] = (u_char) (v >> (56 - 8 * i));
+    }
+
+    return p + 8;
+}
+
+/**
+ * @brief write a 32 bits integer in network byte order
+ */
+static u_char *
+log_zmq_write_uint32(u_char *p, uint32_t v)
+{
+    p[0] = (u_char) (v >> 24);
+    p[1] = (u_char) (v >> 16);
+    p[2] = (u_char) (v >> 8);
+    p[3] = (u_char) v;
+
+    return p + 4;
+}
+
+/**
+ * @brief write a 16 bits integer in network byte order
+ */
+static u_char *
+log_zmq_write_uint16(u_char *p, uint16_t v)
+{
+    p[0] = (u_char) (v >> 8);
+    p[1] = (u_char) v;
+
+    return p + 2;
+}
+
+/**
+ * @brief escape a string for a JSON value
+ *
+ * The same as ngx_escape_json, which nginx only has since 1.11.8: with a
+ * NULL dst it returns the bytes the escaping adds, else the end of dst.
+ *
+ * @param dst A u_char pointer to the destination, or NULL
+ * @param src A u_char pointer to the string
+ * @param size The string length
+ * @return An uintptr_t with the added length or the end of dst
+ */
+static uintptr_t
+log_zmq_escape_json(u_char *dst, u_char *src, size_t size)
+{
+    static u_char  hex[] = "0123456789abcdef";
+    u_char         ch;
+    ngx_uint_t     len;
+
+    if (NULL == dst) {
+        len = 0;
+
+        while (size--) {
+            ch = *src++;
+
+            if ('\\' == ch || '"' == ch) {
+                len++;
+
+            } else if (ch <= 0x1f) {
+                switch (ch) {
+                case '\n':
+                case '\r':
+                case '\t':
+                case '\b':
+                case '\f':
+                    len++;
+                    break;
+
+                default:
+                    len += sizeof("\\u001f") - 2;
+                }
+            }
+        }
+
+        return (uintptr_t) len;
+    }
+
+    while (size--) {
+        ch = *src++;
+
+        if (ch > 0x1f) {
+            if ('\\' == ch || '"' == ch) {
+                *dst++ = '\\';
+            }
+
+            *dst++ = ch;
+            continue;
+        }
+
+        *dst++ = '\\';
+
+        switch (ch) {
+        case '\n':
+            *dst++ = 'n';
+            break;
+
+        case '\r':
+            *dst++ = 'r';
+            break;
+
+        case '\t':
+            *dst++ = 't';
+            break;
+
+        case '\b':
+            *dst++ = 'b';
+            break;
+
+        case '\f':
+            *dst++ = 'f';
+            break;
+
+        default:
+            *dst++ = 'u';
+            *dst++ = '0';
+            *dst++ = '0';
+            *dst++ = hex[ch >> 4];
+            *dst++ = hex[ch & 0xf];
+        }
+    }
+
+    return (uintptr_t) dst;
+}
+
+/**
+ * @brief build the envelope frame of this worker
+ *
+ * Everything but the sequence and the timestamp is the same for all the
+ * messages of the worker, so we build it once.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param log A ngx_log_t pointer to the logger
+ * @return An ngx_int_t with NGX_OK | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_envelope_init(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log)
+{
+    u_char     *p;
+    size_t      hlen;
+    uint32_t    id;
+    ngx_uint_t  slot, pid;
+
+    hlen = ngx_min(ngx_cycle->hostname.len, 255);
+
+    p = ngx_alloc(ZMQ_NGINX_ENVELOPE_HOST + hlen, log);
+    if (NULL == p) {
+        return NGX_ERROR;
+    }
+
+    id = ngx_crc32_short(cf->name->data, cf->name->len);
+    slot = ngx_process_slot < 0 ? 0 : (ngx_uint_t) ngx_process_slot;
+    pid = (ngx_uint_t) ngx_pid;
+
+    p[0] = ZMQ_NGINX_ENVELOPE_VERSION;
+    p[1] = (u_char) hlen;
+    p[2] = (u_char) (slot >> 8);
+    p[3] = (u_char) slot;
+    p[4] = (u_char) (pid >> 24);
+    p[5] = (u_char) (pid >> 16);
+    p[6] = (u_char) (pid >> 8);
+    p[7] = (u_char) pid;
+    p[8] = (u_char) (id >> 24);
+    p[9] = (u_char) (id >> 16);
+    p[10] = (u_char) (id >> 8);
+    p[11] = (u_char) id;
+    ngx_memzero(p + ZMQ_NGINX_ENVELOPE_SEQUENCE, 16);
+    ngx_memcpy(p + ZMQ_NGINX_ENVELOPE_HOST, ngx_cycle->hostname.data, hlen);
+
+    cf->ctx->envelope = p;
+    cf->ctx->envelope_len = ZMQ_NGINX_ENVELOPE_HOST + hlen;
+
+    return NGX_OK;
+}
+
+/**
+ * @brief send the frames of a final message, with its envelope if the definition has one
+ *
+ * The envelope goes as a second frame, the first one keeps the topic so
+ * the subscriptions still work. The envelope frame is allocated before the
+ * first frame is sent: once a frame went with ZMQ_SNDMORE the socket waits
+ * for the rest of the message, and ZMQ sends the last frame of a message it
+ * took the first one of.
+ *
+ * The timestamp is read at send time, not from the nginx cached time: a
+ * batch is sent after its thread is done, and the cache only has ms.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param msg A zmq_msg_t pointer with the message, closed by the caller
+ * @param log A ngx_log_t pointer to the logger
+ * @return An int with the zmq_msg_send result
+ */
+static int
+log_zmq_msg_send_frames(ngx_http_log_zmq_element_conf_t *cf, zmq_msg_t *msg, ngx_log_t *log)
+{
+    zmq_msg_t       envelope;
+    struct timeval  tv;
+    int             rc, flags;
+
+    /* a watched socket never waits, it is skipped until it can take messages */
+    flags = cf->writable ? ZMQ_DONTWAIT : 0;
+
+    if (0 == cf->envelope
+        || (NULL == cf->ctx->envelope && log_zmq_envelope_init(cf, log) != NGX_OK))
+    {
+        return zmq_msg_send(msg, cf->ctx->zmq_socket, flags);
+    }
+
+    /* a sequence is used even if the message is dropped, so the gap is seen */
+    ngx_gettimeofday(&tv);
+    log_zmq_write_uint64(cf->ctx->envelope + ZMQ_NGINX_ENVELOPE_SEQUENCE, ++cf->ctx->sequence);
+    log_zmq_write_uint64(cf->ctx->envelope + ZMQ_NGINX_ENVELOPE_TIMESTAMP,
+                         (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec);
+
+    if (zmq_msg_init_size(&envelope, cf->ctx->envelope_len) != 0) {
+        return -1;
+    }
+
+    ngx_memcpy(zmq_msg_data(&envelope), cf->ctx->envelope, cf->ctx->envelope_len);
+
+    rc = zmq_msg_send(msg, cf->ctx->zmq_socket, ZMQ_SNDMORE | flags);
+    if (rc >= 0) {
+        rc = zmq_msg_send(&envelope, cf->ctx->zmq_socket, flags);
+    }
+
+    zmq_msg_close(&envelope);
+
+    return rc;
+}
+
+/**
+ * @brief send a final message
+ *
+ * A failed send (EAGAIN from a socket that does not drop) is backpressure
+ * for the adaptive sample rate, and blocks a watched socket until ZMQ
+ * signals it can take messages again.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param msg A zmq_msg_t pointer with the message, closed by the caller
+ * @param log A ngx_log_t pointer to the logger
+ * @return An int with the zmq_msg_send result
+ */
+static int
+log_zmq_msg_send(ngx_http_log_zmq_element_conf_t *cf, zmq_msg_t *msg, ngx_log_t *log)
+{
+    int  rc;
+
+    rc = log_zmq_msg_send_frames(cf, msg, log);
+    if (rc < 0) {
+        cf->ctx->pressure = 1;
+
+        if (EAGAIN == errno && cf->ctx->watch && cf->writable) {
+            cf->ctx->blocked |= LOG_ZMQ_BLOCKED_FULL;
+        }
+    }
+
+    /* a send can take the ZMQ_FD signal of the pending commands, so the
+     * watch reads the state again once the event loop is done */
+    if (cf->ctx->watch) {
+        ngx_post_event(cf->ctx->watch->read, &ngx_posted_events);
+    }
+
+    return rc;
+}
+
+#if (NGX_HAVE_ZSTD)
+
+/**
+ * @brief create the zstd contexts of this worker
+ *
+ * The dictionary is digested once per worker, the compression context of
+ * the worker is reused for all its messages.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param log A ngx_log_t pointer to the logger
+ * @return An ngx_int_t with NGX_OK | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_zstd_init(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log)
+{
+    if (cf->compress_dict.len && NULL == cf->ctx->zstd_cdict) {
+        cf->ctx->zstd_cdict = ZSTD_createCDict(cf->compress_dict.data, cf->compress_dict.len, cf->compress_level);
+        if (NULL == cf->ctx->zstd_cdict) {
+            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: zstd_init(): \"%V\" error creating dictionary", cf->name);
+            return NGX_ERROR;
+        }
+    }
+
+    if (NULL == cf->ctx->zstd_cctx) {
+        cf->ctx->zstd_cctx = ZSTD_createCCtx();
+        if (NULL == cf->ctx->zstd_cctx) {
+            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: zstd_init(): \"%V\" error creating context", cf->name);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * @brief size needed to compress a message
+ */
+static size_t
+log_zmq_zstd_bound(ngx_str_t *endpoint, ngx_str_t *data)
+{
+    return endpoint->len + ZMQ_NGINX_ZSTD_HEADER + ZSTD_compressBound(data->len);
+}
+
+/**
+ * @brief compress a message into a ZMQ message
+ *
+ * The endpoint stays in clear so the subscriptions still work. This can
+ * run in a thread, with a context only used by that thread.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param cctx A ZSTD_CCtx pointer
+ * @param endpoint A ngx_str_t pointer with the compiled endpoint
+ * @param data A ngx_str_t pointer with the compiled message
+ * @param buf A buffer of at least log_zmq_zstd_bound() bytes
+ * @param out A zmq_msg_t pointer initialized with the final message
+ * @return An ngx_int_t with NGX_OK | NGX_DECLINED (over the byte limit) | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_zstd_msg(ngx_http_log_zmq_element_conf_t *cf, ZSTD_CCtx *cctx, ngx_str_t *endpoint,
+                 ngx_str_t *data, u_char *buf, zmq_msg_t *out)
+{
+    u_char     *p;
+    size_t      n, size;
+    ngx_int_t   rc;
+
+    size = ZSTD_compressBound(data->len);
+
+    p = ngx_cpymem(buf, endpoint->data, endpoint->len);
+    *p++ = '\0';
+    p = log_zmq_write_uint32(p, cf->compress_dict_id);
+
+    if (cf->ctx->zstd_cdict) {
+        n = ZSTD_compress_usingCDict(cctx, p, size, data->data, data->len, cf->ctx->zstd_cdict);
+    } else {
+        n = ZSTD_compressCCtx(cctx, p, size, data->data, data->len, cf->compress_level);
+    }
+
+    if (ZSTD_isError(n)) {
+        return NGX_ERROR;
+    }
+
+    n += p - buf;
+
+    rc = log_zmq_msg_init(cf, out, n);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_memcpy(zmq_msg_data(out), buf, n);
+
+    return NGX_OK;
+}
+
+/**
+ * @brief compress and send a message to the definition server
+ *
+ * The message is compressed in a buffer of the worker, which only grows,
+ * and copied to a ZMQ message of its compressed size: a message sized for
+ * the bound would hold more than it needs in the queues and the byte limit.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param pool A ngx_pool_t pointer to the nginx memory manager
+ * @param log A ngx_log_t pointer to the current connection logger
+ * @param endpoint A ngx_str_t pointer with the compiled endpoint
+ * @param data A ngx_str_t pointer with the compiled message
+ * @return An ngx_int_t with NGX_OK | NGX_DECLINED (over the byte limit) | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_send_zstd(ngx_http_log_zmq_element_conf_t *cf, ngx_pool_t *pool, ngx_log_t *log,
+                  ngx_str_t *endpoint, ngx_str_t *data)
+{
+    zmq_msg_t  query;
+    size_t     size;
+    ngx_int_t  rc;
+    uint64_t   t = 0;
+
+    log_zmq_timing_start(&t);
+
+    if (NGX_OK != log_zmq_zstd_init(cf, log)) {
+        log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+        return NGX_ERROR;
+    }
+
+    rc = log_zmq_connect(cf, pool, log);
+    if (NGX_OK != rc) {
+        if (NGX_DECLINED != rc) {
+            log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+        }
+        return NGX_ERROR;
+    }
+
+    log_zmq_timing_mark(LOG_ZMQ_TIMING_SETUP, &t);
+
+    size = log_zmq_zstd_bound(endpoint, data);
+    if (size > cf->ctx->zstd_size) {
+        if (cf->ctx->zstd_buf) {
+            ngx_free(cf->ctx->zstd_buf);
+        }
+
+        cf->ctx->zstd_size = 0;
+        cf->ctx->zstd_buf = ngx_alloc(size, log);
+        if (NULL == cf->ctx->zstd_buf) {
+            log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+            return NGX_ERROR;
+        }
+        cf->ctx->zstd_size = size;
+    }
+
+    rc = log_zmq_zstd_msg(cf, cf->ctx->zstd_cctx, endpoint, data, cf->ctx->zstd_buf, &query);
+    log_zmq_timing_mark(LOG_ZMQ_TIMING_SERIALIZE, &t);
+
+    /* already counted in queue_full */
+    if (NGX_DECLINED == rc) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: send_zstd(): message not queued");
+        return NGX_DECLINED;
+    }
+
+    if (NGX_OK != rc) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: send_zstd(): error compressing message");
+        log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+        return NGX_ERROR;
+    }
+
+    rc = log_zmq_msg_send(cf, &query, log);
+    log_zmq_timing_mark(LOG_ZMQ_TIMING_SEND, &t);
+
+    if (rc >= 0) {
+        log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_SENT, 1);
+    } else {
+        log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+    }
+
+    zmq_msg_close(&query);
+
+    return NGX_OK;
+}
+
+/**
+ * @brief free the zstd contexts and buffer of this worker, on its exit
+ *
+ * The batches are done by then, their contexts are in the free list.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ */
+void
+log_zmq_zstd_exit(ngx_http_log_zmq_element_conf_t *cf)
+{
+    void       **cctx;
+    ngx_uint_t   i;
+
+    if (cf->ctx->zstd_cctxs) {
+        cctx = cf->ctx->zstd_cctxs->elts;
+        for (i = 0; i < cf->ctx->zstd_cctxs->nelts; i++) {
+            ZSTD_freeCCtx(cctx[i]);
+        }
+        cf->ctx->zstd_cctxs->nelts = 0;
+    }
+
+    if (cf->ctx->zstd_cctx) {
+        ZSTD_freeCCtx(cf->ctx->zstd_cctx);
+        cf->ctx->zstd_cctx = NULL;
+    }
+
+    if (cf->ctx->zstd_cdict) {
+        ZSTD_freeCDict(cf->ctx->zstd_cdict);
+        cf->ctx->zstd_cdict = NULL;
+    }
+
+    if (cf->ctx->zstd_buf) {
+        ngx_free(cf->ctx->zstd_buf);
+        cf->ctx->zstd_buf = NULL;
+        cf->ctx->zstd_size = 0;
+    }
+}
+
+#endif
+
+/**
+ * @brief send a message to the definition server
+ *
+ * Serialize the endpoint and the data, create the ZMQ context and socket if
+ * they don't exist yet and send the final message. This is shared by the
+ * http and stream modules, each one is responsible to run its own scripts.
+ * If the definition has a thread pool, the message is only added to a batch.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param pool A ngx_pool_t pointer to the nginx memory manager
+ * @param log A ngx_log_t pointer to the current connection logger
+ * @param endpoint A ngx_str_t pointer with the compiled endpoint
+ * @param data A ngx_str_t pointer with the compiled message
+ * @return An ngx_int_t with NGX_OK | NGX_DECLINED (over the byte limit) | NGX_ERROR
+ */
+ngx_int_t
+log_zmq_send(ngx_http_log_zmq_element_conf_t *cf, ngx_pool_t *pool, ngx_log_t *log,
+             ngx_str_t *endpoint, ngx_str_t *data)
+{
+    return log_zmq_send_fields(cf, pool, log, endpoint, data, NULL);
+}
+
+/**
+ * @brief send a message with the values of its dictionary fields
+ *
+ * Like log_zmq_send, the fields are only used by the batches of a
+ * definition with log_zmq_dictionary.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param pool A ngx_pool_t pointer to the nginx memory manager
+ * @param log A ngx_log_t pointer to the current connection logger
+ * @param endpoint A ngx_str_t pointer with the compiled endpoint
+ * @param data A ngx_str_t pointer with the compiled message
+ * @param fields A ngx_str_t array with a value for each field, or NULL
+ * @return An ngx_int_t with NGX_OK | NGX_DECLINED (over the byte limit) | NGX_ERROR
+ */
+ngx_int_t
+log_zmq_send_fields(ngx_http_log_zmq_element_conf_t *cf, ngx_pool_t *pool, ngx_log_t *log,
+                    ngx_str_t *endpoint, ngx_str_t *data, ngx_str_t *fields)
+{
+    ngx_str_t  zmq_data;
+    zmq_msg_t  query;
+    ngx_int_t  rc;
+    uint64_t   t = 0;
+
+    /* no context? we dont create any */
+    if (NULL == cf->ctx) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: send(): no context");
+        return NGX_ERROR;
+    }
+
+    log_zmq_timing_start(&t);
+
+#if (NGX_THREADS)
+    /* the final message is built by a thread, we only keep a copy */
+    if (cf->thread_pool && (fields || !cf->arrow)) {
+        rc = log_zmq_batch_add(cf, log, endpoint, data, fields);
+        log_zmq_timing_mark(LOG_ZMQ_TIMING_SERIALIZE, &t);
+        return rc;
+    }
+#endif
+
+#if (NGX_HAVE_ZSTD)
+    if (cf->compress) {
+        return log_zmq_send_zstd(cf, pool, log, endpoint, data);
+    }
+#endif
+
+    /* serialize to the final message format */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: send(): serializing message");
+    rc = log_zmq_serialize(pool, endpoint, data, &zmq_data);
+    log_zmq_timing_mark(LOG_ZMQ_TIMING_SERIALIZE, &t);
+    if (NGX_ERROR == rc) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: send(): error serializing message");
+        log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+        return NGX_ERROR;
+    }
+
+    rc = log_zmq_connect(cf, pool, log);
+    log_zmq_timing_mark(LOG_ZMQ_TIMING_SETUP, &t);
+    if (NGX_OK != rc) {
+        if (NGX_DECLINED != rc) {
+            log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+        }
+        ngx_pfree(pool, zmq_data.data);
+        return NGX_ERROR;
+    }
+
+    /* initialize zmq message, a message over the byte limit is already counted in queue_full */
+    rc = log_zmq_msg_init(cf, &query, zmq_data.len);
+    if (NGX_OK != rc) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: send(): message not queued");
+        if (NGX_DECLINED != rc) {
+            log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+        }
+        ngx_pfree(pool, zmq_data.data);
+        return rc;
+    }
+
+    ngx_memcpy(zmq_msg_data(&query), zmq_data.data, zmq_data.len);
+
+    rc = log_zmq_msg_send(cf, &query, log);
+    log_zmq_timing_mark(LOG_ZMQ_TIMING_SEND, &t);
+
+    if (rc >= 0) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: send(): message sent: %V", &zmq_data);
+        log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_SENT, 1);
+    } else {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: send(): message not sent: %V", &zmq_data);
+        log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+    }
+
+    /* free all for the next iteration */
+    zmq_msg_close(&query);
+
+    ngx_pfree(pool, zmq_data.data);
+
+    return NGX_OK;
+}
+
+#if (NGX_THREADS)
+
+static void log_zmq_batch_thread(void *data, ngx_log_t *log);
+static void log_zmq_batch_done(ngx_event_t *ev);
+static void log_zmq_batch_flush(ngx_event_t *ev);
+
+#if (NGX_HAVE_ZSTD)
+
+/**
+ * @brief lend a compression context and a buffer to a batch
+ *
+ * A context can't be used by two threads at once, so each batch takes one
+ * from the free contexts of the definition and gives it back when done.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param batch A ngx_http_log_zmq_batch_t pointer
+ * @param log A ngx_log_t pointer to the logger
+ * @return An ngx_int_t with NGX_OK | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_batch_zstd(ngx_http_log_zmq_element_conf_t *cf, ngx_http_log_zmq_batch_t *batch, ngx_log_t *log)
+{
+    ngx_http_log_zmq_batch_msg_t *msg;
+    ngx_array_t                  *free;
+    ngx_uint_t                    i;
+    size_t                        size;
+
+    /* the dictionary is digested in the worker, the threads only read it */
+    if (log_zmq_zstd_init(cf, log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    msg = batch->messages.elts;
+    for (i = 0; i < batch->messages.nelts; i++) {
+        size = log_zmq_zstd_bound(&msg[i].endpoint, &msg[i].data);
+        if (size > batch->zstd_size) {
+            batch->zstd_size = size;
+        }
+    }
+
+    batch->zstd_buf = ngx_pnalloc(batch->pool, batch->zstd_size);
+    if (NULL == batch->zstd_buf) {
+        return NGX_ERROR;
+    }
+
+    free = cf->ctx->zstd_cctxs;
+
+    if (free && free->nelts) {
+        free->nelts--;
+        batch->zstd_cctx = ((void **) free->elts)[free->nelts];
+        return NGX_OK;
+    }
+
+    batch->zstd_cctx = ZSTD_createCCtx();
+    if (NULL == batch->zstd_cctx) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * @brief give back the compression context of a batch
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param batch A ngx_http_log_zmq_batch_t pointer
+ */
+static void
+log_zmq_zstd_release(ngx_http_log_zmq_element_conf_t *cf, ngx_http_log_zmq_batch_t *batch)
+{
+    void  **cctx;
+
+    if (NULL == batch->zstd_cctx) {
+        return;
+    }
+
+    if (NULL == cf->ctx->zstd_cctxs) {
+        cf->ctx->zstd_cctxs = ngx_array_create(ngx_cycle->pool, 4, sizeof(void *));
+    }
+
+    cctx = cf->ctx->zstd_cctxs ? ngx_array_push(cf->ctx->zstd_cctxs) : NULL;
+    if (NULL == cctx) {
+        ZSTD_freeCCtx(batch->zstd_cctx);
+    } else {
+        *cctx = batch->zstd_cctx;
+    }
+
+    batch->zstd_cctx = NULL;
+}
+
+#endif
+
+/**
+ * @brief create an empty batch for a definition
+ *
+ * Each batch has its own pool, destroyed after the batch is sent. The task
+ * is allocated with the batch itself as the task context.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param log A ngx_log_t pointer to the logger
+ * @return A ngx_http_log_zmq_batch_t pointer or NULL on error
+ */
+static ngx_http_log_zmq_batch_t *
+log_zmq_batch_create(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log)
+{
+    ngx_pool_t               *pool;
+    ngx_thread_task_t        *task;
+    ngx_http_log_zmq_batch_t *batch;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (NULL == pool) {
+        return NULL;
+    }
+
+    task = ngx_thread_task_alloc(pool, sizeof(ngx_http_log_zmq_batch_t));
+    if (NULL == task) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    batch = task->ctx;
+    batch->pool = pool;
+    batch->task = task;
+    batch->element = cf;
+
+    if (ngx_array_init(&batch->messages, pool, cf->batch, sizeof(ngx_http_log_zmq_batch_msg_t)) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    task->handler = log_zmq_batch_thread;
+    task->event.handler = log_zmq_batch_done;
+    task->event.data = batch;
+    task->event.log = ngx_cycle->log;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: batch_create(): \"%V\"", cf->name);
+
+    return batch;
+}
+
+/**
+ * @brief hand the current batch of a definition to the thread pool
+ *
+ * When the worker exits the thread pools are gone, the batch is then built
+ * and sent right away.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param log A ngx_log_t pointer to the logger
+ * @param sync Build and send the batch in the worker?
+ * @return An ngx_int_t with NGX_OK | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_batch_post(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log, ngx_uint_t sync)
+{
+    ngx_http_log_zmq_batch_t *batch = cf->ctx->batch;
+    ngx_uint_t                n, m, size;
+
+    if (cf->ctx->flush.timer_set) {
+        ngx_del_timer(&cf->ctx->flush);
+    }
+
+    if (NULL == batch) {
+        return NGX_OK;
+    }
+
+    cf->ctx->batch = NULL;
+    n = batch->messages.nelts;
+
+    /* the pool is not thread safe, the thread only uses what we allocate here */
+    batch->output = ngx_palloc(batch->pool, n * sizeof(zmq_msg_t));
+    if (NULL == batch->output) {
+        goto failed;
+    }
+
+    if (cf->ndict && !cf->arrow) {
+        /* each message has its endpoint and fields in the dictionary */
+        m = n * (cf->ndict + 1);
+
+        size = 2;
+        while (size < 2 * m) {
+            size <<= 1;
+        }
+
+        batch->mask = size - 1;
+        batch->refs = ngx_palloc(batch->pool, m * sizeof(uint32_t));
+        batch->table = ngx_pcalloc(batch->pool, size * sizeof(uint32_t));
+        batch->strings = ngx_palloc(batch->pool, m * sizeof(ngx_str_t *));
+
+        if (NULL == batch->refs || NULL == batch->table || NULL == batch->strings) {
+            goto failed;
+        }
+    }
+
+#if (NGX_HAVE_ZSTD)
+    /* dictionary encoded batches are sent as they are */
+    if (cf->compress && 0 == cf->ndict) {
+        if (log_zmq_batch_zstd(cf, batch, log) != NGX_OK) {
+            goto failed;
+        }
+    }
+#endif
+
+    if (!sync && ngx_thread_task_post(cf->thread_pool, batch->task) != NGX_OK) {
+        goto failed;
+    }
+
+    /* log_zmq_batch_done takes it back */
+    ngx_queue_insert_tail(&cf->ctx->batches, &batch->queue);
+    log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_OFFLOAD_QUEUED, 1);
+
+    if (sync) {
+        log_zmq_batch_thread(batch, log);
+        log_zmq_batch_done(&batch->task->event);
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: batch_post(): \"%V\" %ui messages", cf->name, n);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: batch_post(): \"%V\" %ui messages dropped", cf->name, n);
+    log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, n);
+#if (NGX_HAVE_ZSTD)
+    log_zmq_zstd_release(cf, batch);
+#endif
+    ngx_destroy_pool(batch->pool);
+
+    return NGX_ERROR;
+}
+
+/**
+ * @brief copy a message to the batch of the definition
+ *
+ * The batch is posted when it is full, or when the flush timer expires.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param log A ngx_log_t pointer to the logger
+ * @param endpoint A ngx_str_t pointer with the compiled endpoint
+ * @param data A ngx_str_t pointer with the compiled message
+ * @param fields A ngx_str_t array with the dictionary fields, or NULL
+ * @return An ngx_int_t with NGX_OK | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_batch_add(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log,
+    ngx_str_t *endpoint, ngx_str_t *data, ngx_str_t *fields)
+{
+    ngx_http_log_zmq_batch_t     *batch;
+    ngx_http_log_zmq_batch_msg_t *msg;
+    ngx_uint_t                    i;
+    size_t                        len;
+    u_char                       *p;
+
+    batch = cf->ctx->batch;
+
+    if (NULL == batch) {
+        batch = log_zmq_batch_create(cf, log);
+        if (NULL == batch) {
+            log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+            return NGX_ERROR;
+        }
+        cf->ctx->batch = batch;
+    }
+
+    msg = ngx_array_push(&batch->messages);
+    if (NULL == msg) {
+        log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+        return NGX_ERROR;
+    }
+
+    msg->endpoint.len = endpoint->len;
+    msg->endpoint.data = ngx_pnalloc(batch->pool, endpoint->len + data->len);
+    if (NULL == msg->endpoint.data) {
+        batch->messages.nelts--;
+        log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+        return NGX_ERROR;
+    }
+    msg->data.len = data->len;
+    msg->data.data = ngx_cpymem(msg->endpoint.data, endpoint->data, endpoint->len);
+    ngx_memcpy(msg->data.data, data->data, data->len);
+    msg->fields = NULL;
+
+    if (cf->ndict) {
+        len = cf->ndict * sizeof(ngx_str_t);
+        for (i = 0; fields && i < cf->ndict; i++) {
+            len += fields[i].len;
+        }
+
+        msg->fields = ngx_palloc(batch->pool, len);
+        if (NULL == msg->fields) {
+            batch->messages.nelts--;
+            log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+            return NGX_ERROR;
+        }
+
+        /* messages without fields (like the rate summary) have empty ones */
+        p = (u_char *) (msg->fields + cf->ndict);
+        for (i = 0; i < cf->ndict; i++) {
+            msg->fields[i].len = fields ? fields[i].len : 0;
+            msg->fields[i].data = p;
+
+            /* the Arrow columns keep the missing values as nulls */
+            if (cf->arrow && NULL == fields[i].data) {
+                msg->fields[i].data = NULL;
+                continue;
+            }
+
+            if (msg->fields[i].len) {
+                p = ngx_cpymem(p, fields[i].data, fields[i].len);
+            }
+        }
+    }
+
+    if (batch->messages.nelts >= cf->batch) {
+        return log_zmq_batch_post(cf, log, 0);
+    }
+
+    if (!cf->ctx->flush.timer_set) {
+        cf->ctx->flush.handler = log_zmq_batch_flush;
+        cf->ctx->flush.data = cf;
+        cf->ctx->flush.log = ngx_cycle->log;
+#if (nginx_version >= 1011003)
+        cf->ctx->flush.cancelable = 1;
+#endif
+        ngx_add_timer(&cf->ctx->flush, cf->flush);
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * @brief flush timer handler, post an incomplete batch
+ *
+ * @param ev A ngx_event_t pointer with the definition as data
+ */
+static void
+log_zmq_batch_flush(ngx_event_t *ev)
+{
+    ngx_http_log_zmq_element_conf_t *cf = ev->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "log_zmq: batch_flush(): \"%V\"", cf->name);
+
+    (void) log_zmq_batch_post(cf, ev->log, 0);
+}
+
+/**
+ * @brief write an unsigned integer as a varint (7 bits per byte, low first)
+ */
+static u_char *
+log_zmq_write_varint(u_char *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (u_char) (v | 0x80);
+        v >>= 7;
+    }
+
+    *p++ = (u_char) v;
+
+    return p;
+}
+
+/**
+ * @brief length of an unsigned integer written as a varint
+ */
+static size_t
+log_zmq_varint_len(uint64_t v)
+{
+    size_t  len;
+
+    for (len = 1; v >= 0x80; len++) {
+        v >>= 7;
+    }
+
+    return len;
+}
+
+/**
+ * @brief number of a string in the dictionary of a batch, added if needed
+ *
+ * @param batch A ngx_http_log_zmq_batch_t pointer
+ * @param s A ngx_str_t pointer to the string, kept in the batch pool
+ * @return An uint32_t with the string number
+ */
+static uint32_t
+log_zmq_dict_ref(ngx_http_log_zmq_batch_t *batch, ngx_str_t *s)
+{
+    ngx_uint_t  i;
+    uint32_t    ref;
+    ngx_str_t  *t;
+
+    for (i = ngx_murmur_hash2(s->data, s->len) & batch->mask; /* void */ ; i = (i + 1) & batch->mask) {
+        ref = batch->table[i];
+
+        if (0 == ref) {
+            batch->strings[batch->nstrings++] = s;
+            batch->table[i] = batch->nstrings;
+            return batch->nstrings - 1;
+        }
+
+        t = batch->strings[ref - 1];
+        if (t->len == s->len && ngx_memcmp(t->data, s->data, s->len) == 0) {
+            return ref - 1;
+        }
+    }
+}
+
+/**
+ * @brief build one message with all the batch, runs in a thread
+ *
+ * The endpoints and the dictionary fields are replaced by their number in
+ * a string table. After the topic, the integers are varints:
+ *
+ * @code
+ * uint8  version (1)
+ * uint8  number of fields (n)
+ * n x    uint8 field length, field
+ * varint number of strings, then (varint length, string) for each one
+ * varint number of messages, then for each one:
+ *        varint endpoint string, n x varint field string, varint data length, data
+ * @endcode
+ *
+ * @param batch A ngx_http_log_zmq_batch_t pointer
+ */
+static void
+log_zmq_batch_encode(ngx_http_log_zmq_batch_t *batch)
+{
+    ngx_http_log_zmq_element_conf_t *cf = batch->element;
+    ngx_http_log_zmq_batch_msg_t    *msg = batch->messages.elts;
+    ngx_uint_t                       i, f, n, nf;
+    ngx_int_t                        rc;
+    uint32_t                        *ref;
+    size_t                           len;
+    u_char                          *p;
+
+    n = batch->messages.nelts;
+    nf = cf->ndict;
+
+    ref = batch->refs;
+    for (i = 0; i < n; i++) {
+        *ref++ = log_zmq_dict_ref(batch, &msg[i].endpoint);
+        for (f = 0; f < nf; f++) {
+            *ref++ = log_zmq_dict_ref(batch, &msg[i].fields[f]);
+        }
+    }
+
+    len = cf->dict_topic.len + 2 + log_zmq_varint_len(batch->nstrings) + log_zmq_varint_len(n);
+
+    for (f = 0; f < nf; f++) {
+        len += 1 + ngx_min(cf->dict_names[f].len, 255);
+    }
+
+    for (i = 0; i < batch->nstrings; i++) {
+        len += log_zmq_varint_len(batch->strings[i]->len) + batch->strings[i]->len;
+    }
+
+    ref = batch->refs;
+    for (i = 0; i < n; i++) {
+        for (f = 0; f <= nf; f++) {
+            len += log_zmq_varint_len(*ref++);
+        }
+        len += log_zmq_varint_len(msg[i].data.len) + msg[i].data.len;
+    }
+
+    rc = log_zmq_msg_init(cf, &batch->output[0], len);
+    if (rc != NGX_OK) {
+        batch->declined = (NGX_DECLINED == rc) ? n : 0;
+        return;
+    }
+
+    p = ngx_cpymem(zmq_msg_data(&batch->output[0]), cf->dict_topic.data, cf->dict_topic.len);
+
+    *p++ = ZMQ_NGINX_DICT_VERSION;
+    *p++ = (u_char) nf;
+
+    for (f = 0; f < nf; f++) {
+        *p++ = (u_char) ngx_min(cf->dict_names[f].len, 255);
+        p = ngx_cpymem(p, cf->dict_names[f].data, ngx_min(cf->dict_names[f].len, 255));
+    }
+
+    p = log_zmq_write_varint(p, batch->nstrings);
+    for (i = 0; i < batch->nstrings; i++) {
+        p = log_zmq_write_varint(p, batch->strings[i]->len);
+        p = ngx_cpymem(p, batch->strings[i]->data, batch->strings[i]->len);
+    }
+
+    p = log_zmq_write_varint(p, n);
+
+    ref = batch->refs;
+    for (i = 0; i < n; i++) {
+        for (f = 0; f <= nf; f++) {
+            p = log_zmq_write_varint(p, *ref++);
+        }
+        p = log_zmq_write_varint(p, msg[i].data.len);
+        p = ngx_cpymem(p, msg[i].data.data, msg[i].data.len);
+    }
+
+    batch->noutput = 1;
+}
+
+/* Arrow IPC constants, from the Message.fbs and Schema.fbs flatbuffers schemas */
+#define LOG_ZMQ_ARROW_V5             4   /**< MetadataVersion */
+#define LOG_ZMQ_ARROW_SCHEMA         1   /**< MessageHeader */
+#define LOG_ZMQ_ARROW_RECORD_BATCH   3   /**< MessageHeader */
+#define LOG_ZMQ_ARROW_TYPE_INT       2   /**< Type */
+#define LOG_ZMQ_ARROW_TYPE_FLOAT     3   /**< Type */
+#define LOG_ZMQ_ARROW_TYPE_UTF8      5   /**< Type */
+#define LOG_ZMQ_ARROW_DOUBLE         2   /**< Precision */
+
+/* record batch metadata of the most columns, 3 buffers for a string column */
+#define LOG_ZMQ_ARROW_BATCH_SIZE     (256 + ZMQ_NGINX_ARROW_FIELDS * 16 * 4)
+
+/**
+ * @brief flatbuffer written from the start
+ *
+ * The flatbuffers are usually built from the end, but the Arrow metadata is
+ * small and fixed, so the objects are written in order: each vtable before
+ * its table, and each child after its parent, the offsets only go forward.
+ */
+typedef struct {
+    u_char                 *start;          /**< Start of the flatbuffer */
+    u_char                 *p;              /**< Write position */
+} log_zmq_fb_t;
+
+/**
+ * @brief write an unsigned integer of n bytes in little endian
+ */
+static u_char *
+log_zmq_write_le(u_char *p, uint64_t v, ngx_uint_t n)
+{
+    while (n--) {
+        *p++ = (u_char) v;
+        v >>= 8;
+    }
+
+    return p;
+}
+
+/**
+ * @brief pad a flatbuffer with zeros up to an offset equal to mod, modulo align
+ */
+static void
+log_zmq_fb_pad(log_zmq_fb_t *fb, ngx_uint_t align, ngx_uint_t mod)
+{
+    while ((ngx_uint_t) (fb->p - fb->start) % align != mod) {
+        *fb->p++ = 0;
+    }
+}
+
+/**
+ * @brief write a vtable and its table, filled with zeros
+ *
+ * The tables are aligned on 8 bytes, so their long fields can be at any
+ * multiple of 8.
+ *
+ * @param fb A log_zmq_fb_t pointer
+ * @param fields The offsets of the fields in the table, 0 for an absent one
+ * @param n The number of fields
+ * @param size The table size, with its vtable offset
+ * @return A u_char pointer to the table
+ */
+static u_char *
+log_zmq_fb_table(log_zmq_fb_t *fb, const uint16_t *fields, ngx_uint_t n, size_t size)
+{
+    u_char      *vt, *t;
+    ngx_uint_t   i;
+
+    log_zmq_fb_pad(fb, 2, 0);
+
+    vt = fb->p;
+    fb->p = log_zmq_write_le(fb->p, 4 + 2 * n, 2);
+    fb->p = log_zmq_write_le(fb->p, size, 2);
+
+    for (i = 0; i < n; i++) {
+        fb->p = log_zmq_write_le(fb->p, fields[i], 2);
+    }
+
+    log_zmq_fb_pad(fb, 8, 0);
+
+    t = fb->p;
+    (void) log_zmq_write_le(t, t - vt, 4);
+    ngx_memzero(t + 4, size - 4);
+    fb->p = t + size;
+
+    return t;
+}
+
+/**
+ * @brief write the offset from a field to a later object
+ */
+static void
+log_zmq_fb_ref(u_char *field, u_char *object)
+{
+    (void) log_zmq_write_le(field, object - field, 4);
+}
+
+/**
+ * @brief write a string
+ */
+static u_char *
+log_zmq_fb_string(log_zmq_fb_t *fb, ngx_str_t *s)
+{
+    u_char  *str;
+
+    log_zmq_fb_pad(fb, 4, 0);
+
+    str = fb->p;
+    fb->p = log_zmq_write_le(fb->p, s->len, 4);
+    fb->p = ngx_cpymem(fb->p, s->data, s->len);
+    *fb->p++ = '\0';
+
+    return str;
+}
+
+/**
+ * @brief write a vector filled with zeros
+ *
+ * The elements are aligned on 8 bytes, for the structs of longs.
+ *
+ * @param fb A log_zmq_fb_t pointer
+ * @param n The number of elements
+ * @param size The size of an element
+ * @return A u_char pointer to the vector, the elements start 4 bytes after
+ */
+static u_char *
+log_zmq_fb_vector(log_zmq_fb_t *fb, ngx_uint_t n, size_t size)
+{
+    u_char  *v;
+
+    log_zmq_fb_pad(fb, 8, 4);
+
+    v = fb->p;
+    fb->p = log_zmq_write_le(fb->p, n, 4);
+    ngx_memzero(fb->p, n * size);
+    fb->p += n * size;
+
+    return v;
+}
+
+/**
+ * @brief start an Arrow message
+ *
+ * The Message table has the version at 4, the header type at 6, the
+ * header at 8 and the body length at 16.
+ *
+ * @param fb A log_zmq_fb_t pointer, empty
+ * @param type The header type
+ * @param body The body length
+ * @return A u_char pointer to the header field, to refer to the header table
+ */
+static u_char *
+log_zmq_arrow_message(log_zmq_fb_t *fb, ngx_uint_t type, uint64_t body)
+{
+    static const uint16_t  fields[] = { 4, 6, 8, 16 };
+    u_char                *root, *t;
+
+    root = fb->p;
+    fb->p += 4;
+
+    t = log_zmq_fb_table(fb, fields, 4, 24);
+    log_zmq_fb_ref(root, t);
+
+    (void) log_zmq_write_le(t + 4, LOG_ZMQ_ARROW_V5, 2);
+    t[6] = (u_char) type;
+    (void) log_zmq_write_le(t + 16, body, 8);
+
+    return t + 8;
+}
+
+/**
+ * @brief end an Arrow message metadata
+ *
+ * The metadata is padded to 8 bytes and prefixed by the continuation
+ * marker and its length.
+ *
+ * @param prefix A u_char pointer to the 8 bytes before the flatbuffer
+ * @param fb A log_zmq_fb_t pointer
+ * @return A u_char pointer to the end of the metadata
+ */
+static u_char *
+log_zmq_arrow_end(u_char *prefix, log_zmq_fb_t *fb)
+{
+    log_zmq_fb_pad(fb, 8, 0);
+
+    (void) log_zmq_write_le(prefix, 0xffffffff, 4);
+    (void) log_zmq_write_le(prefix + 4, fb->p - fb->start, 4);
+
+    return fb->p;
+}
+
+/**
+ * @brief bigger size of the schema message
+ *
+ * @param names A ngx_str_t array with the column names
+ * @param n The number of columns
+ * @return A size_t with the size to allocate
+ */
+size_t
+log_zmq_arrow_schema_size(ngx_str_t *names, ngx_uint_t n)
+{
+    size_t      size;
+    ngx_uint_t  i;
+
+    size = 128;
+
+    for (i = 0; i < n; i++) {
+        size += 128 + names[i].len;
+    }
+
+    return size;
+}
+
+/**
+ * @brief write the schema message of an Arrow definition
+ *
+ * Built once with the configuration, every batch starts with it. The
+ * Schema table has the fields at 4, each Field table has the name at 4,
+ * nullable at 8, the type type at 9, the type at 12 and the children at 16.
+ *
+ * @param p A u_char pointer with log_zmq_arrow_schema_size bytes, aligned on 8
+ * @param names A ngx_str_t array with the column names
+ * @param types A ngx_log_zmq_arrow_type_e array with the column types
+ * @param n The number of columns
+ * @return A u_char pointer to the end of the message
+ */
+u_char *
+log_zmq_arrow_schema(u_char *p, ngx_str_t *names, u_char *types, ngx_uint_t n)
+{
+    static const uint16_t  schema[] = { 0, 4 };
+    static const uint16_t  field[] = { 4, 8, 9, 12, 0, 16 };
+    static const uint16_t  type_int[] = { 4, 8 };
+    static const uint16_t  type_float[] = { 4 };
+    log_zmq_fb_t           fb;
+    ngx_uint_t             i;
+    u_char                *header, *s, *fields, *f, *t;
+
+    fb.start = p + 8;
+    fb.p = fb.start;
+
+    header = log_zmq_arrow_message(&fb, LOG_ZMQ_ARROW_SCHEMA, 0);
+
+    s = log_zmq_fb_table(&fb, schema, 2, 8);
+    log_zmq_fb_ref(header, s);
+
+    fields = log_zmq_fb_vector(&fb, n, 4);
+    log_zmq_fb_ref(s + 4, fields);
+
+    for (i = 0; i < n; i++) {
+        f = log_zmq_fb_table(&fb, field, 6, 20);
+        log_zmq_fb_ref(fields + 4 + 4 * i, f);
+
+        log_zmq_fb_ref(f + 4, log_zmq_fb_string(&fb, &names[i]));
+        f[8] = 1;
+
+        switch (types[i]) {
+
+        case LOG_ZMQ_ARROW_INT:
+            f[9] = LOG_ZMQ_ARROW_TYPE_INT;
+            t = log_zmq_fb_table(&fb, type_int, 2, 12);
+            (void) log_zmq_write_le(t + 4, 64, 4);
+            t[8] = 1;
+            break;
+
+        case LOG_ZMQ_ARROW_FLOAT:
+            f[9] = LOG_ZMQ_ARROW_TYPE_FLOAT;
+            t = log_zmq_fb_table(&fb, type_float, 1, 8);
+            (void) log_zmq_write_le(t + 4, LOG_ZMQ_ARROW_DOUBLE, 2);
+            break;
+
+        default:
+            f[9] = LOG_ZMQ_ARROW_TYPE_UTF8;
+            t = log_zmq_fb_table(&fb, NULL, 0, 4);
+            break;
+        }
+
+        log_zmq_fb_ref(f + 12, t);
+        log_zmq_fb_ref(f + 16, log_zmq_fb_vector(&fb, 0, 4));
+    }
+
+    return log_zmq_arrow_end(p, &fb);
+}
+
+/**
+ * @brief write the record batch metadata
+ *
+ * The RecordBatch table has the nodes at 4, the length at 8 and the
+ * buffers at 16.
+ *
+ * @param p A u_char pointer with LOG_ZMQ_ARROW_BATCH_SIZE bytes, aligned on 8
+ * @param rows The number of rows
+ * @param nodes The length and the null count of each column
+ * @param ncols The number of columns
+ * @param buffers The offset and the length of each buffer in the body
+ * @param nbufs The number of buffers
+ * @param body The body length
+ * @return A u_char pointer to the end of the metadata
+ */
+static u_char *
+log_zmq_arrow_batch(u_char *p, uint64_t rows, uint64_t *nodes, ngx_uint_t ncols,
+    uint64_t *buffers, ngx_uint_t nbufs, uint64_t body)
+{
+    static const uint16_t  batch[] = { 8, 4, 16 };
+    log_zmq_fb_t           fb;
+    ngx_uint_t             i;
+    u_char                *header, *t, *v;
+
+    fb.start = p + 8;
+    fb.p = fb.start;
+
+    header = log_zmq_arrow_message(&fb, LOG_ZMQ_ARROW_RECORD_BATCH, body);
+
+    t = log_zmq_fb_table(&fb, batch, 3, 24);
+    log_zmq_fb_ref(header, t);
+    (void) log_zmq_write_le(t + 8, rows, 8);
+
+    v = log_zmq_fb_vector(&fb, ncols, 16);
+    log_zmq_fb_ref(t + 4, v);
+    for (i = 0, v += 4; i < 2 * ncols; i++, v += 8) {
+        (void) log_zmq_write_le(v, nodes[i], 8);
+    }
+
+    v = log_zmq_fb_vector(&fb, nbufs, 16);
+    log_zmq_fb_ref(t + 16, v);
+    for (i = 0, v += 4; i < 2 * nbufs; i++, v += 8) {
+        (void) log_zmq_write_le(v, buffers[i], 8);
+    }
+
+    return log_zmq_arrow_end(p, &fb);
+}
+
+/**
+ * @brief parse an Arrow integer value
+ *
+ * @param s A ngx_str_t pointer to the value, NULL data for a missing one
+ * @param v An int64_t pointer to the result
+ * @return An ngx_int_t with NGX_OK | NGX_DECLINED (null)
+ */
+static ngx_int_t
+log_zmq_arrow_int(ngx_str_t *s, int64_t *v)
+{
+    u_char    *p, *end;
+    uint64_t   n;
+    ngx_uint_t neg;
+
+    if (NULL == s->data || 0 == s->len) {
+        return NGX_DECLINED;
+    }
+
+    p = s->data;
+    end = p + s->len;
+
+    neg = (*p == '-');
+    if (neg && ++p == end) {
+        return NGX_DECLINED;
+    }
+
+    for (n = 0; p < end; p++) {
+        if (*p < '0' || *p > '9' || n > (INT64_MAX - 9) / 10) {
+            return NGX_DECLINED;
+        }
+        n = n * 10 + (*p - '0');
+    }
+
+    *v = neg ? -(int64_t) n : (int64_t) n;
+
+    return NGX_OK;
+}
+
+/**
+ * @brief parse an Arrow float value, like 200, 0.013 or -1.5
+ *
+ * @param s A ngx_str_t pointer to the value, NULL data for a missing one
+ * @param v A double pointer to the result
+ * @return An ngx_int_t with NGX_OK | NGX_DECLINED (null)
+ */
+static ngx_int_t
+log_zmq_arrow_float(ngx_str_t *s, double *v)
+{
+    u_char     *p, *end;
+    double      n, scale;
+    ngx_uint_t  neg, digits, dot;
+
+    if (NULL == s->data || 0 == s->len) {
+        return NGX_DECLINED;
+    }
+
+    p = s->data;
+    end = p + s->len;
+
+    neg = (*p == '-');
+    if (neg) {
+        p++;
+    }
+
+    n = 0;
+    scale = 1;
+    digits = 0;
+    dot = 0;
+
+    for ( /* void */ ; p < end; p++) {
+        if (*p == '.' && !dot) {
+            dot = 1;
+            continue;
+        }
+
+        if (*p < '0' || *p > '9') {
+            return NGX_DECLINED;
+        }
+
+        n = n * 10 + (*p - '0');
+        if (dot) {
+            scale *= 10;
+        }
+        digits++;
+    }
+
+    if (0 == digits) {
+        return NGX_DECLINED;
+    }
+
+    *v = neg ? -n / scale : n / scale;
+
+    return NGX_OK;
+}
+
+/**
+ * @brief build one Arrow IPC stream with all the batch, runs in a thread
+ *
+ * Each field is a column. The values are counted first, to lay out the
+ * body, then written. A column without nulls has an empty validity buffer.
+ *
+ * @param batch A ngx_http_log_zmq_batch_t pointer
+ */
+static void
+log_zmq_arrow_encode(ngx_http_log_zmq_batch_t *batch)
+{
+    ngx_http_log_zmq_element_conf_t *cf = batch->element;
+    ngx_http_log_zmq_batch_msg_t    *msg = batch->messages.elts;
+    ngx_uint_t                       i, f, n, nf, b, nbufs;
+    uint64_t                         nodes[2 * ZMQ_NGINX_ARROW_FIELDS];
+    uint64_t                         buffers[6 * ZMQ_NGINX_ARROW_FIELDS];
+    size_t                           data[ZMQ_NGINX_ARROW_FIELDS];
+    size_t                           topic, body, len, off;
+    u_char                           meta[LOG_ZMQ_ARROW_BATCH_SIZE], *end, *p, *bits, *values;
+    ngx_str_t                       *s;
+    int64_t                          iv;
+    double                           dv;
+    uint64_t                         u;
+    ngx_int_t                        rc;
+
+    n = batch->messages.nelts;
+    nf = cf->ndict;
+
+    /* count the nulls and the string bytes of each column */
+    for (f = 0; f < nf; f++) {
+        nodes[2 * f] = n;
+        nodes[2 * f + 1] = 0;
+        data[f] = 0;
+
+        for (i = 0; i < n; i++) {
+            s = &msg[i].fields[f];
+
+            switch (cf->arrow_types[f]) {
+
+            case LOG_ZMQ_ARROW_INT:
+                if (log_zmq_arrow_int(s, &iv) != NGX_OK) {
+                    nodes[2 * f + 1]++;
+                }
+                break;
+
+            case LOG_ZMQ_ARROW_FLOAT:
+                if (log_zmq_arrow_float(s, &dv) != NGX_OK) {
+                    nodes[2 * f + 1]++;
+                }
+                break;
+
+            default:
+                if (NULL == s->data) {
+                    nodes[2 * f + 1]++;
+                } else {
+                    data[f] += s->len;
+                }
+                break;
+            }
+        }
+    }
+
+    /* lay out the buffers, each one aligned on 8 bytes */
+    body = 0;
+    nbufs = 0;
+
+    for (f = 0; f < nf; f++) {
+        buffers[2 * nbufs] = body;
+        buffers[2 * nbufs + 1] = nodes[2 * f + 1] ? (n + 7) / 8 : 0;
+        body = ngx_align(body + buffers[2 * nbufs + 1], 8);
+        nbufs++;
+
+        if (LOG_ZMQ_ARROW_STRING == cf->arrow_types[f]) {
+            buffers[2 * nbufs] = body;
+            buffers[2 * nbufs + 1] = (n + 1) * 4;
+            body = ngx_align(body + buffers[2 * nbufs + 1], 8);
+            nbufs++;
+
+            buffers[2 * nbufs] = body;
+            buffers[2 * nbufs + 1] = data[f];
+            body = ngx_align(body + data[f], 8);
+            nbufs++;
+
+        } else {
+            buffers[2 * nbufs] = body;
+            buffers[2 * nbufs + 1] = n * 8;
+            body = ngx_align(body + n * 8, 8);
+            nbufs++;
+        }
+    }
+
+    end = log_zmq_arrow_batch(meta, n, nodes, nf, buffers, nbufs, body);
+
+    /* the stream starts on 8 bytes after the topic, like the Arrow buffers */
+    topic = ngx_align(cf->dict_topic.len + 1, 8);
+    len = topic + cf->arrow_schema.len + (end - meta) + body + 8;
+
+    rc = log_zmq_msg_init(cf, &batch->output[0], len);
+    if (rc != NGX_OK) {
+        batch->declined = (NGX_DECLINED == rc) ? n : 0;
+        return;
+    }
+
+    p = zmq_msg_data(&batch->output[0]);
+    ngx_memzero(p, len);
+
+    ngx_memcpy(p, cf->dict_topic.data, cf->dict_topic.len);
+    p += topic;
+    p = ngx_cpymem(p, cf->arrow_schema.data, cf->arrow_schema.len);
+    p = ngx_cpymem(p, meta, end - meta);
+
+    for (f = 0, b = 0; f < nf; f++) {
+        bits = nodes[2 * f + 1] ? p + buffers[2 * b] : NULL;
+        values = p + buffers[2 * b + 2];
+        off = 0;
+
+        for (i = 0; i < n; i++) {
+            s = &msg[i].fields[f];
+
+            switch (cf->arrow_types[f]) {
+
+            case LOG_ZMQ_ARROW_INT:
+                if (log_zmq_arrow_int(s, &iv) != NGX_OK) {
+                    continue;
+                }
+                (void) log_zmq_write_le(values + 8 * i, (uint64_t) iv, 8);
+                break;
+
+            case LOG_ZMQ_ARROW_FLOAT:
+                if (log_zmq_arrow_float(s, &dv) != NGX_OK) {
+                    continue;
+                }
+                ngx_memcpy(&u, &dv, sizeof(double));
+                (void) log_zmq_write_le(values + 8 * i, u, 8);
+                break;
+
+            default:
+                /* the offsets, then the data in the next buffer */
+                (void) log_zmq_write_le(values + 4 * i, off, 4);
+                if (NULL == s->data) {
+                    continue;
+                }
+                ngx_memcpy(p + buffers[2 * b + 4] + off, s->data, s->len);
+                off += s->len;
+                break;
+            }
+
+            if (bits) {
+                bits[i / 8] |= (u_char) (1 << (i % 8));
+            }
+        }
+
+        if (LOG_ZMQ_ARROW_STRING == cf->arrow_types[f]) {
+            (void) log_zmq_write_le(values + 4 * n, off, 4);
+            b += 3;
+        } else {
+            b += 2;
+        }
+    }
+
+    p += body;
+
+    /* end of stream */
+    (void) log_zmq_write_le(p, 0xffffffff, 4);
+
+    batch->noutput = 1;
+}
+
+/**
+ * @brief build the final messages of a batch, runs in a thread
+ *
+ * Only the batch memory and the ZMQ message allocator are used here.
+ *
+ * @param data A ngx_http_log_zmq_batch_t pointer
+ * @param log A ngx_log_t pointer to the thread logger
+ */
+static void
+log_zmq_batch_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_log_zmq_batch_t     *batch = data;
+    ngx_http_log_zmq_batch_msg_t *msg;
+    struct timespec               start, end;
+    ngx_uint_t                    i = 0;
+    ngx_int_t                     rc;
+    size_t                        len;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    msg = batch->messages.elts;
+
+    if (batch->element->arrow) {
+        log_zmq_arrow_encode(batch);
+        i = batch->messages.nelts;
+
+    } else if (batch->element->ndict) {
+        log_zmq_batch_encode(batch);
+        i = batch->messages.nelts;
+    }
+
+    for ( /* void */ ; i < batch->messages.nelts; i++) {
+#if (NGX_HAVE_ZSTD)
+        if (batch->zstd_cctx) {
+            rc = log_zmq_zstd_msg(batch->element, batch->zstd_cctx, &msg[i].endpoint, &msg[i].data,
+                                  batch->zstd_buf, &batch->output[batch->noutput]);
+            if (NGX_OK == rc) {
+                batch->noutput++;
+            } else if (NGX_DECLINED == rc) {
+                batch->declined++;
+            }
+            continue;
+        }
+#endif
+
+        /* endpoint and data are contiguous in the batch pool */
+        len = msg[i].endpoint.len + msg[i].data.len;
+
+        rc = log_zmq_msg_init(batch->element, &batch->output[batch->noutput], len);
+        if (NGX_OK != rc) {
+            if (NGX_DECLINED == rc) {
+                batch->declined++;
+            }
+            continue;
+        }
+
+        ngx_memcpy(zmq_msg_data(&batch->output[batch->noutput]), msg[i].endpoint.data, len);
+        batch->noutput++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    batch->usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: batch_thread(): %ui messages in %uL usec",
+                   batch->noutput, batch->usec);
+}
+
+/**
+ * @brief completion handler of a batch, runs in the worker
+ *
+ * Send all the messages built by the thread and destroy the batch.
+ *
+ * @param ev A ngx_event_t pointer with the batch as data
+ */
+static void
+log_zmq_batch_done(ngx_event_t *ev)
+{
+    ngx_http_log_zmq_batch_t        *batch = ev->data;
+    ngx_http_log_zmq_element_conf_t *cf = batch->element;
+    ngx_uint_t                       i, sent, per;
+    ngx_int_t                        rc;
+
+    ngx_queue_remove(&batch->queue);
+
+    log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_OFFLOAD_QUEUED, -1);
+    log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_OFFLOAD_BATCHES, 1);
+    log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_OFFLOAD_USEC, (ngx_atomic_int_t) batch->usec);
+
+    rc = log_zmq_connect(cf, batch->pool, ev->log);
+    sent = 0;
+
+    /* an encoded batch has all the messages in one */
+    per = cf->ndict ? batch->messages.nelts : 1;
+
+    for (i = 0; i < batch->noutput; i++) {
+        if (rc == NGX_OK && log_zmq_msg_send(cf, &batch->output[i], ev->log) >= 0) {
+            sent += per;
+        }
+        zmq_msg_close(&batch->output[i]);
+    }
+
+    /* the messages over the byte limit are already counted in queue_full */
+    log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_SENT, sent);
+    log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, batch->messages.nelts - sent - batch->declined);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ev->log, 0, "log_zmq: batch_done(): \"%V\" %ui/%ui messages sent",
+                   cf->name, sent, batch->messages.nelts);
+
+#if (NGX_HAVE_ZSTD)
+    log_zmq_zstd_release(cf, batch);
+#endif
+
+    ngx_destroy_pool(batch->pool);
+}
+
+/**
+ * @brief send the batches of a definition when the worker exits
+ *
+ * The flush timer is cancelable and the completion handlers are not run
+ * any more. The thread pools exit before the http modules, so their
+ * threads are done with the posted batches: those are sent here, and the
+ * batch being filled is built and sent in the worker.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param log A ngx_log_t pointer to the logger
+ */
+void
+log_zmq_batch_exit(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log)
+{
+    ngx_queue_t              *q;
+    ngx_http_log_zmq_batch_t *batch;
+
+    while (!ngx_queue_empty(&cf->ctx->batches)) {
+        q = ngx_queue_head(&cf->ctx->batches);
+        batch = ngx_queue_data(q, ngx_http_log_zmq_batch_t, queue);
+        log_zmq_batch_done(&batch->task->event);
+    }
+
+    if (cf->ctx->batch) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: batch_exit(): \"%V\" %ui messages",
+                       cf->name, cf->ctx->batch->messages.nelts);
+        (void) log_zmq_batch_post(cf, log, 1);
+    }
+}
+
+#endif
+
+/**
+ * @brief send the number of messages suppressed by the rate limit
+ *
+ * Each worker sends its own summary to the definition server, so the
+ * collectors know what was cut:
+ *
+ * @code
+ * /log_zmq/suppressed/{"definition":"main","pid":1234,"suppressed":5120}
+ * @endcode
+ *
+ * @param ev A ngx_event_t pointer with the definition as data
+ */
+static void
+log_zmq_rate_summary(ngx_event_t *ev)
+{
+    ngx_http_log_zmq_element_conf_t *cf = ev->data;
+    ngx_pool_t                      *pool;
+    ngx_str_t                        endpoint = ngx_string(ZMQ_NGINX_RATE_TOPIC);
+    ngx_str_t                        data;
+    u_char                           buf[NGX_INT_T_LEN * 2 + 256];
+
+    if (0 == cf->ctx->suppressed) {
+        return;
+    }
+
+    data.data = buf;
+    data.len = ngx_snprintf(buf, sizeof(buf), "{\"definition\":\"%V\",\"pid\":%P,\"suppressed\":%ui}",
+                            cf->name, ngx_pid, cf->ctx->suppressed) - buf;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0, "log_zmq: rate_summary(): \"%V\" %ui suppressed",
+                   cf->name, cf->ctx->suppressed);
+
+    cf->ctx->suppressed = 0;
+
+    pool = ngx_create_pool(1024, ev->log);
+    if (NULL == pool) {
+        return;
+    }
+
+    (void) log_zmq_send(cf, pool, ev->log, &endpoint, &data);
+
+    ngx_destroy_pool(pool);
+}
+
+/**
+ * @brief take a token from the definition bucket
+ *
+ * This runs before anything is formatted. The bucket is refilled with the
+ * time elapsed since the last call, up to the burst. A suppressed message
+ * is counted and the summary timer is armed.
+ *
+ * A rate set at runtime replaces the configured one. It is a limit for all
+ * workers, so it always uses the shared bucket, with one second of burst.
+ *
+ * Each worker has its own cached time, so a worker may find the shared
+ * bucket updated "in the future": it refills nothing and does not move the
+ * time of the bucket back.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @return An ngx_int_t with 1 if the message can be sent, 0 if not
+ */
+ngx_int_t
+log_zmq_rate_allow(ngx_http_log_zmq_element_conf_t *cf)
+{
+    ngx_http_log_zmq_bucket_t *b = cf->ctx->bucket;
+    ngx_msec_t                 now, elapsed;
+    ngx_msec_int_t             delta;
+    ngx_uint_t                 rate, burst, global, max, tokens, allow;
+
+    rate = cf->rate;
+    burst = cf->burst;
+    global = cf->rate_global;
+
+    if (cf->ctx->stats && (cf->ctx->stats->control.flags & LOG_ZMQ_CONTROL_RATE)) {
+        rate = cf->ctx->stats->control.rate;
+        burst = rate;
+        global = 1;
+        b = &cf->ctx->stats->bucket;
+    }
+
+    if (0 == rate) {
+        return 1;
+    }
+
+    now = ngx_current_msec;
+    max = burst * 1000;
+
+    if (global) {
+        ngx_spinlock(&b->lock, ngx_pid, 1024);
+    }
+
+    if (0 == b->last) {
+        tokens = max;
+        b->last = now;
+    } else {
+        delta = (ngx_msec_int_t) (now - b->last);
+        elapsed = (delta > 0) ? (ngx_msec_t) delta : 0;
+        /* avoid the overflow after a long idle time */
+        tokens = (elapsed >= 1000 * burst) ? max : b->tokens + elapsed * rate;
+
+        if (delta > 0) {
+            b->last = now;
+        }
+    }
+
+    b->tokens = ngx_min(tokens, max);
+
+    allow = 0;
+    if (b->tokens >= 1000) {
+        b->tokens -= 1000;
+        allow = 1;
+    }
+
+    if (global) {
+        ngx_unlock(&b->lock);
+    }
+
+    if (allow) {
+        return 1;
+    }
+
+    log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_RATE_LIMITED, 1);
+
+    if (0 == cf->ctx->suppressed++ && cf->rate_summary && !cf->ctx->summary.timer_set) {
+        cf->ctx->summary.handler = log_zmq_rate_summary;
+        cf->ctx->summary.data = cf;
+        cf->ctx->summary.log = ngx_cycle->log;
+#if (nginx_version >= 1011003)
+        cf->ctx->summary.cancelable = 1;
+#endif
+        ngx_add_timer(&cf->ctx->summary, cf->rate_summary);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief adaptive sample rate of the definition in this worker
+ *
+ * The rate changes at most once per interval, like TCP congestion control:
+ * it is halved, down to the minimum, if there was backpressure during the
+ * interval (a message refused by log_zmq_max_queue_bytes, a failed send,
+ * or the queued bytes over the watermark), and it grows by a step if not.
+ * There is no timer, the change is done by the first message after the
+ * interval.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @return A ngx_uint_t with the rate, in LOG_ZMQ_CONTROL_SCALE parts
+ */
+ngx_uint_t
+log_zmq_sample_adapt(ngx_http_log_zmq_element_conf_t *cf)
+{
+    ngx_http_log_zmq_ctx_t *ctx = cf->ctx;
+    ngx_msec_t              now;
+    ngx_uint_t              sample;
+
+    now = ngx_current_msec;
+
+    if (0 == ctx->sample) {
+        ctx->sample = LOG_ZMQ_CONTROL_SCALE;
+        ctx->sample_adjusted = now;
+        ctx->pressure = 0;
+    }
+
+    if (now - ctx->sample_adjusted < cf->sample_interval) {
+        return ctx->sample;
+    }
+
+    ctx->sample_adjusted = now;
+
+    /* a full queue is seen before the messages are refused */
+    if ((cf->max_queue_bytes
+         && ctx->queued_bytes > cf->max_queue_bytes / 100 * cf->sample_watermark)
+        || (cf->worker_max_queue_bytes
+            && log_zmq_queued_bytes > cf->worker_max_queue_bytes / 100 * cf->sample_watermark))
+    {
+        ctx->pressure = 1;
+    }
+
+    sample = ctx->sample;
+
+    if (ctx->pressure) {
+        ctx->sample = ngx_max(ctx->sample / 2, cf->sample_min);
+    } else {
+        ctx->sample = ngx_min(ctx->sample + cf->sample_step, LOG_ZMQ_CONTROL_SCALE);
+    }
+
+    ctx->pressure = 0;
+
+    if (ctx->sample != sample) {
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0, "log_zmq: sample_adapt(): \"%V\" sample %ui -> %ui",
+                       cf->name, sample, ctx->sample);
+    }
+
+    return ctx->sample;
+}
+
+/**
+ * @brief check the byte limits for a low priority message
+ *
+ * The low priority messages only get a part of the log_zmq_max_queue_bytes
+ * limits, the rest is kept for the high priority ones. This runs before
+ * anything is formatted, a dropped message is backpressure for the
+ * adaptive sample rate. Without byte limits all messages pass.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @return An ngx_int_t with 1 if the message can be sent, 0 if not
+ */
+ngx_int_t
+log_zmq_priority_allow(ngx_http_log_zmq_element_conf_t *cf)
+{
+    if ((cf->max_queue_bytes
+         && cf->ctx->queued_bytes > cf->max_queue_bytes / 100 * cf->priority_low)
+        || (cf->worker_max_queue_bytes
+            && log_zmq_queued_bytes > cf->worker_max_queue_bytes / 100 * cf->priority_low))
+    {
+        log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_LOW_PRIORITY, 1);
+        cf->ctx->pressure = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief length of a value cut to a limit without breaking it
+ *
+ * The values are written in the format as they are, not escaped, so the cut
+ * does not make them safe in a JSON string. It only does not end in the
+ * middle of an UTF-8 character or of a backslash sequence already in the
+ * value (a cut after \u00 of a \u00e9), it goes back to their start.
+ *
+ * @param p The value
+ * @param len The value length
+ * @param max The length limit
+ * @return A size_t with the new length, len if it was under the limit
+ */
+size_t
+log_zmq_truncate(u_char *p, size_t len, size_t max)
+{
+    size_t      n, i, esc;
+    ngx_uint_t  k;
+
+    if (len <= max) {
+        return len;
+    }
+
+    n = max;
+
+    /* p[n] is the first byte left out, it must not be an UTF-8 continuation */
+    for (k = 0; k < 3 && n && (p[n] & 0xc0) == 0x80; k++) {
+        n--;
+    }
+
+    for (i = 0; i < n; /* void */) {
+        if (p[i] != '\\') {
+            i++;
+            continue;
+        }
+
+        esc = (i + 1 < len && p[i + 1] == 'u') ? 6 : 2;
+        if (i + esc > n) {
+            n = i;
+            break;
+        }
+
+        i += esc;
+    }
+
+    return n;
+}
+
+/**
+ * @brief free all the nodes under a trie node
+ *
+ * @param node A ngx_http_log_zmq_trie_t pointer, left without subscriptions
+ */
+static void
+log_zmq_trie_clear(ngx_http_log_zmq_trie_t *node)
+{
+    ngx_http_log_zmq_trie_t *child, *next;
+
+    for (child = node->child; child; child = next) {
+        next = child->next;
+        log_zmq_trie_clear(child);
+        ngx_free(child);
+    }
+
+    node->child = NULL;
+    node->count = 0;
+}
+
+#ifdef ZMQ_XPUB
+
+/**
+ * @brief find the child of a trie node
+ *
+ * @param node A ngx_http_log_zmq_trie_t pointer to the parent
+ * @param c The byte of the child
+ * @return A ngx_http_log_zmq_trie_t pointer to the child, NULL if there is none
+ */
+static ngx_http_log_zmq_trie_t *
+log_zmq_trie_child(ngx_http_log_zmq_trie_t *node, u_char c)
+{
+    for (node = node->child; node; node = node->next) {
+        if (node->c == c) {
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief add a subscription to the trie
+ *
+ * @param root A ngx_http_log_zmq_trie_t pointer to the root
+ * @param p The subscribed prefix
+ * @param len The prefix length
+ * @param log A ngx_log_t pointer to the current logger
+ * @return An ngx_int_t with NGX_OK | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_trie_add(ngx_http_log_zmq_trie_t *root, u_char *p, size_t len, ngx_log_t *log)
+{
+    ngx_http_log_zmq_trie_t *node, *child;
+
+    node = root;
+
+    for ( /* void */ ; len; p++, len--) {
+        child = log_zmq_trie_child(node, *p);
+        if (NULL == child) {
+            child = ngx_calloc(sizeof(ngx_http_log_zmq_trie_t), log);
+            if (NULL == child) {
+                return NGX_ERROR;
+            }
+            child->c = *p;
+            child->next = node->child;
+            node->child = child;
+        }
+        node = child;
+    }
+
+    node->count++;
+
+    return NGX_OK;
+}
+
+/**
+ * @brief remove a subscription from the trie
+ *
+ * The nodes left without subscriptions and children are freed on the way
+ * back. The depth is bounded by ZMQ_NGINX_SUBSCRIPTION_LEN.
+ *
+ * @param node A ngx_http_log_zmq_trie_t pointer to the current node
+ * @param p The rest of the unsubscribed prefix
+ * @param len The rest length
+ * @return A ngx_uint_t, 1 if the node is now empty
+ */
+static ngx_uint_t
+log_zmq_trie_del(ngx_http_log_zmq_trie_t *node, u_char *p, size_t len)
+{
+    ngx_http_log_zmq_trie_t **prev, *child;
+
+    if (0 == len) {
+        if (node->count) {
+            node->count--;
+        }
+
+    } else {
+        for (prev = &node->child; *prev; prev = &(*prev)->next) {
+            child = *prev;
+            if (child->c == *p) {
+                if (log_zmq_trie_del(child, p + 1, len - 1)) {
+                    *prev = child->next;
+                    ngx_free(child);
+                }
+                break;
+            }
+        }
+    }
+
+    return 0 == node->count && NULL == node->child;
+}
+
+/**
+ * @brief can a message of a topic match a subscription?
+ *
+ * ZMQ matches the subscriptions against the start of the message, which is
+ * the topic followed by the data. A subscription ending in the topic
+ * matches, and so can a longer one going on after the whole topic, we
+ * can't know without the data so ZMQ will decide.
+ *
+ * @param root A ngx_http_log_zmq_trie_t pointer to the root
+ * @param p The topic
+ * @param len The topic length
+ * @return A ngx_uint_t, 1 if the message can match
+ */
+static ngx_uint_t
+log_zmq_trie_match(ngx_http_log_zmq_trie_t *root, u_char *p, size_t len)
+{
+    ngx_http_log_zmq_trie_t *node = root;
+
+    for ( ;; ) {
+        if (node->count) {
+            return 1;
+        }
+
+        if (0 == len) {
+            return node->child != NULL;
+        }
+
+        node = log_zmq_trie_child(node, *p);
+        if (NULL == node) {
+            return 0;
+        }
+
+        p++;
+        len--;
+    }
+}
+
+/**
+ * @brief read the pending subscription messages of a XPUB socket
+ *
+ * Called by the watch of the socket when ZMQ_EVENTS has ZMQ_POLLIN. Each
+ * message is a byte, 1 to subscribe or 0 to unsubscribe, and the
+ * prefix. XPUB only passes the first subscription and the last
+ * unsubscription of a prefix, and unsubscribes the prefixes of a peer that
+ * goes away. The prefixes are cut to ZMQ_NGINX_SUBSCRIPTION_LEN bytes, a
+ * shorter prefix only matches more topics.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param log A ngx_log_t pointer to the current logger
+ */
+static void
+log_zmq_subscriptions_read(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log)
+{
+    zmq_msg_t   msg;
+    u_char     *p;
+    size_t      len;
+    ngx_uint_t  i;
+
+    for (i = 0; i < ZMQ_NGINX_SUBSCRIPTION_READ; i++) {
+
+        zmq_msg_init(&msg);
+
+        if (zmq_msg_recv(&msg, cf->ctx->zmq_socket, ZMQ_DONTWAIT) == -1) {
+            if (errno != EAGAIN) {
+                ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: subscriptions_read(): \"%V\" %s",
+                              cf->name, zmq_strerror(errno));
+            }
+            zmq_msg_close(&msg);
+            return;
+        }
+
+        p = zmq_msg_data(&msg);
+        len = zmq_msg_size(&msg);
+
+        if (len) {
+            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: subscriptions_read(): \"%V\" %s \"%*s\"",
+                           cf->name, p[0] ? "subscribe" : "unsubscribe", len - 1, p + 1);
+
+            len = ngx_min(len - 1, ZMQ_NGINX_SUBSCRIPTION_LEN);
+
+            if (1 == p[0]) {
+                if (NGX_OK != log_zmq_trie_add(cf->ctx->subscriptions, p + 1, len, log)) {
+                    ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: subscriptions_read(): \"%V\" no memory, "
+                                  "keeping all the topics", cf->name);
+                    /* an empty prefix matches everything, better than losing messages */
+                    cf->ctx->subscriptions->count++;
+                }
+            } else if (0 == p[0]) {
+                (void) log_zmq_trie_del(cf->ctx->subscriptions, p + 1, len);
+            }
+        }
+
+        zmq_msg_close(&msg);
+    }
+}
+
+#endif
+
+/**
+ * @brief is anybody subscribed to a topic?
+ *
+ * Only for the definitions with log_zmq_subscriptions. The subscriptions
+ * are read by the watch of the socket in the event loop, here the topic is
+ * only looked up, so the handler renders the format only when a subscriber
+ * can get the message. A definition without a socket yet sets it up, as
+ * the subscriptions come through it. A dictionary definition sends its
+ * batches under the batch topic.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param pool A ngx_pool_t pointer to the nginx memory manager
+ * @param log A ngx_log_t pointer to the current logger
+ * @param endpoint A ngx_str_t pointer to the rendered endpoint
+ * @return An ngx_int_t with NGX_OK (render and send) | NGX_DECLINED | NGX_ERROR
+ */
+ngx_int_t
+log_zmq_subscribed(ngx_http_log_zmq_element_conf_t *cf, ngx_pool_t *pool, ngx_log_t *log,
+                   ngx_str_t *endpoint)
+{
+#ifdef ZMQ_XPUB
+    ngx_int_t  rc;
+    ngx_str_t *topic;
+
+    if (LOG_ZMQ_STATE_READY != cf->ctx->state) {
+        rc = log_zmq_connect(cf, pool, log);
+        if (NGX_ERROR == rc) {
+            log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_FAILED, 1);
+        }
+        if (NGX_OK != rc) {
+            return rc;
+        }
+    }
+
+    topic = cf->ndict ? &cf->dict_topic : endpoint;
+
+    if (log_zmq_trie_match(cf->ctx->subscriptions, topic->data, topic->len)) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: subscribed(): \"%V\" nobody wants \"%V\"",
+                   cf->name, topic);
+
+    log_zmq_stat_add(cf->ctx, LOG_ZMQ_STAT_UNSUBSCRIBED, 1);
+
+    return NGX_DECLINED;
+#else
+    return NGX_OK;
+#endif
+}
+
+/**
+ * @brief histogram bucket of a value
+ *
+ * A value v is in the bucket 16 * e + (v >> e), where e is the smallest
+ * shift that leaves v >> e under 32. So a bucket b >= 16 starts at
+ * (b - 16 * e) << e with e = b / 16 - 1, and is 1 << e wide.
+ *
+ * @param v A value in microseconds (nanoseconds for log_zmq_timing)
+ * @return A ngx_uint_t with the bucket index
+ */
+ngx_uint_t
+log_zmq_histogram_bucket(uint64_t v)
+{
+    ngx_uint_t  e;
+
+    if (v >= ((uint64_t) 1 << (ZMQ_NGINX_HISTOGRAM_MAX_SHIFT + ZMQ_NGINX_HISTOGRAM_SUB_BITS + 1))) {
+        return ZMQ_NGINX_HISTOGRAM_BUCKETS - 1;
+    }
+
+    for (e = 0; (v >> e) >= (2 << ZMQ_NGINX_HISTOGRAM_SUB_BITS); e++) { /* void */ }
+
+    return (e << ZMQ_NGINX_HISTOGRAM_SUB_BITS) + (ngx_uint_t) (v >> e);
+}
+
+/**
+ * @brief send the histograms of this worker
+ *
+ * The message is binary, all integers in network byte order, and the same
+ * bucket index means the same range everywhere, so the histograms of all
+ * workers and hosts can be merged by adding their buckets:
+ *
+ * @code
+ * uint8  version (1)
+ * uint8  sub-bucket bits (4)
+ * uint16 number of variables (n)
+ * uint32 pid
+ * uint32 interval in milliseconds
+ * uint32 number of keys
+ * uint8  definition length, definition
+ * n x    uint8 variable length, variable
+ * keys x uint16 key length, key
+ *        uint32 requests
+ *        n x uint16 buckets used, then (uint16 bucket, uint32 count) for each one
+ * @endcode
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param log A ngx_log_t pointer to the logger
+ */
+static void
+log_zmq_histogram_flush(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log)
+{
+    ngx_http_log_zmq_agg_t       *agg = cf->aggregate;
+    ngx_http_log_zmq_agg_entry_t *e;
+    ngx_pool_t                   *pool;
+    ngx_str_t                     data;
+    ngx_uint_t                    i, j, b, used;
+    uint32_t                     *h;
+    size_t                        len;
+    u_char                       *p, *n;
+
+    len = 16 + 1 + ngx_min(cf->name->len, 255);
+
+    for (j = 0; j < agg->nsums; j++) {
+        len += 1 + ngx_min(agg->sum_names[j].len, 255);
+    }
+
+    for (i = 0; i < agg->size; i++) {
+        e = &agg->entries[i];
+        if (e->len) {
+            len += 2 + e->len + 4
+                   + agg->nsums * (2 + 6 * ngx_min(e->count, ZMQ_NGINX_HISTOGRAM_BUCKETS));
+        }
+    }
+
+    pool = ngx_create_pool(len + 1024, log);
+    if (NULL == pool) {
+        return;
+    }
+
+    data.data = ngx_pnalloc(pool, len);
+    if (NULL == data.data) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    p = data.data;
+    *p++ = ZMQ_NGINX_HISTOGRAM_VERSION;
+    *p++ = ZMQ_NGINX_HISTOGRAM_SUB_BITS;
+    p = log_zmq_write_uint16(p, (uint16_t) agg->nsums);
+    p = log_zmq_write_uint32(p, (uint32_t) ngx_pid);
+    p = log_zmq_write_uint32(p, (uint32_t) (ngx_current_msec - agg->start));
+    p = log_zmq_write_uint32(p, (uint32_t) agg->used);
+
+    *p++ = (u_char) ngx_min(cf->name->len, 255);
+    p = ngx_cpymem(p, cf->name->data, ngx_min(cf->name->len, 255));
+
+    for (j = 0; j < agg->nsums; j++) {
+        *p++ = (u_char) ngx_min(agg->sum_names[j].len, 255);
+        p = ngx_cpymem(p, agg->sum_names[j].data, ngx_min(agg->sum_names[j].len, 255));
+    }
+
+    for (i = 0; i < agg->size; i++) {
+        e = &agg->entries[i];
+        if (0 == e->len) {
+            continue;
+        }
+
+        p = log_zmq_write_uint16(p, (uint16_t) e->len);
+        p = ngx_cpymem(p, e->key, e->len);
+        p = log_zmq_write_uint32(p, (uint32_t) e->count);
+
+        for (j = 0; j < agg->nsums; j++) {
+            h = agg->buckets + (i * agg->nsums + j) * ZMQ_NGINX_HISTOGRAM_BUCKETS;
+
+            /* the number of buckets used is written once they are counted */
+            n = p;
+            p += 2;
+
+            for (b = 0, used = 0; b < ZMQ_NGINX_HISTOGRAM_BUCKETS; b++) {
+                if (h[b]) {
+                    p = log_zmq_write_uint16(p, (uint16_t) b);
+                    p = log_zmq_write_uint32(p, h[b]);
+                    used++;
+                }
+            }
+
+            (void) log_zmq_write_uint16(n, (uint16_t) used);
+        }
+
+        e->len = 0;
+    }
+
+    data.len = p - data.data;
+    agg->used = 0;
+
+    (void) log_zmq_send(cf, pool, log, &agg->topic, &data);
+
+    ngx_destroy_pool(pool);
+}
+
+/**
+ * @brief send the aggregation table of this worker and empty it
+ *
+ * All the keys seen in the interval go in one message:
+ *
+ * @code
+ * /log_zmq/aggregate/main{"definition":"main","pid":1234,"interval":1000,"sums":["body_bytes_sent"],
+ *     "entries":[{"key":"example.com:200","count":1520,"sums":[20480130]}]}
+ * @endcode
+ *
+ * @param ev A ngx_event_t pointer with the definition as data
+ */
+static void
+log_zmq_aggregate_flush(ngx_event_t *ev)
+{
+    ngx_http_log_zmq_element_conf_t *cf = ev->data;
+    ngx_http_log_zmq_agg_t          *agg = cf->aggregate;
+    ngx_http_log_zmq_agg_entry_t    *e;
+    ngx_pool_t                      *pool;
+    ngx_str_t                        data;
+    ngx_uint_t                       i, j, n;
+    size_t                           len;
+    u_char                          *p;
+
+    if (agg->timer.timer_set) {
+        ngx_del_timer(&agg->timer);
+    }
+
+    if (0 == agg->used) {
+        return;
+    }
+
+    if (agg->histogram) {
+        log_zmq_histogram_flush(cf, ev->log);
+        return;
+    }
+
+    len = sizeof("{\"definition\":\"\",\"pid\":,\"interval\":,\"sums\":[],\"entries\":[]}")
+          + cf->name->len + NGX_INT64_LEN * 2;
+
+    for (j = 0; j < agg->nsums; j++) {
+        len += agg->sum_names[j].len + sizeof("\"\",");
+    }
+
+    for (i = 0; i < agg->size; i++) {
+        e = &agg->entries[i];
+        if (e->len) {
+            len += sizeof("{\"key\":\"\",\"count\":,\"sums\":[]},") + e->len
+                   + log_zmq_escape_json(NULL, e->key, e->len) + NGX_INT_T_LEN
+                   + agg->nsums * (NGX_OFF_T_LEN + 1);
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0, "log_zmq: aggregate_flush(): \"%V\" %ui keys",
+                   cf->name, agg->used);
+
+    pool = ngx_create_pool(len + 1024, ev->log);
+    if (NULL == pool) {
+        return;
+    }
+
+    data.data = ngx_pnalloc(pool, len);
+    if (NULL == data.data) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    p = ngx_sprintf(data.data, "{\"definition\":\"%V\",\"pid\":%P,\"interval\":%M,\"sums\":[",
+                    cf->name, ngx_pid, ngx_current_msec - agg->start);
+
+    for (j = 0; j < agg->nsums; j++) {
+        p = ngx_sprintf(p, "%s\"%V\"", j ? "," : "", &agg->sum_names[j]);
+    }
+
+    p = ngx_cpymem(p, "],\"entries\":[", sizeof("],\"entries\":[") - 1);
+
+    for (i = 0, n = 0; i < agg->size; i++) {
+        e = &agg->entries[i];
+        if (0 == e->len) {
+            continue;
+        }
+
+        p = ngx_sprintf(p, "%s{\"key\":\"", n++ ? "," : "");
+        p = (u_char *) log_zmq_escape_json(p, e->key, e->len);
+        p = ngx_sprintf(p, "\",\"count\":%ui,\"sums\":[", e->count);
+
+        for (j = 0; j < agg->nsums; j++) {
+            p = ngx_sprintf(p, "%s%O", j ? "," : "", e->sums[j]);
+        }
+
+        *p++ = ']';
+        *p++ = '}';
+
+        e->len = 0;
+    }
+
+    *p++ = ']';
+    *p++ = '}';
+
+    data.len = p - data.data;
+    agg->used = 0;
+
+    (void) log_zmq_send(cf, pool, ev->log, &agg->topic, &data);
+
+    ngx_destroy_pool(pool);
+}
+
+/**
+ * @brief send the aggregation table of this worker when it exits
+ *
+ * The interval timer is cancelable, the last interval is sent here.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ */
+void
+log_zmq_aggregate_exit(ngx_http_log_zmq_element_conf_t *cf)
+{
+    if (cf->aggregate->entries) {
+        log_zmq_aggregate_flush(&cf->aggregate->timer);
+    }
+}
+
+/**
+ * @brief count a request in the aggregation table of this worker
+ *
+ * The table is sent when the interval ends, or before if a new key would
+ * take it over 3/4 of its slots.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param key A ngx_str_t pointer with the evaluated key
+ * @param values An off_t array with the value of each variable to sum, or
+ * in microseconds to record in the histograms (negative if there is none)
+ * @return An ngx_int_t with NGX_OK | NGX_ERROR
+ */
+ngx_int_t
+log_zmq_aggregate_add(ngx_http_log_zmq_element_conf_t *cf, ngx_str_t *key, off_t *values)
+{
+    ngx_http_log_zmq_agg_t       *agg = cf->aggregate;
+    ngx_http_log_zmq_agg_entry_t *e;
+    ngx_str_t                     k = ngx_string("-");
+    ngx_uint_t                    i, j, mask;
+    uint32_t                      hash, *h;
+
+    if (NULL == agg->entries) {
+        agg->entries = ngx_calloc(agg->size * sizeof(ngx_http_log_zmq_agg_entry_t), ngx_cycle->log);
+        if (NULL == agg->entries) {
+            return NGX_ERROR;
+        }
+
+        if (agg->histogram) {
+            agg->buckets = ngx_alloc(agg->size * agg->nsums * ZMQ_NGINX_HISTOGRAM_BUCKETS * sizeof(uint32_t),
+                                     ngx_cycle->log);
+            if (NULL == agg->buckets) {
+                ngx_free(agg->entries);
+                agg->entries = NULL;
+                return NGX_ERROR;
+            }
+        }
+
+        agg->timer.handler = log_zmq_aggregate_flush;
+        agg->timer.data = cf;
+        agg->timer.log = ngx_cycle->log;
+#if (nginx_version >= 1011003)
+        agg->timer.cancelable = 1;
+#endif
+    }
+
+    /* an empty length marks a free slot */
+    if (key->len) {
+        k.data = key->data;
+        k.len = ngx_min(key->len, ZMQ_NGINX_AGGREGATE_KEY_LEN);
+    }
+
+    hash = ngx_murmur_hash2(k.data, k.len);
+    mask = agg->size - 1;
+
+    for (i = hash & mask; /* void */ ; i = (i + 1) & mask) {
+        e = &agg->entries[i];
+
+        if (0 == e->len) {
+            break;
+        }
+
+        if (e->hash == hash && e->len == k.len && ngx_memcmp(e->key, k.data, k.len) == 0) {
+            goto found;
+        }
+    }
+
+    if (4 * (agg->used + 1) > 3 * agg->size) {
+        log_zmq_aggregate_flush(&agg->timer);
+
+        /* a table that could not be sent is dropped, its slots are not reused in place */
+        if (agg->used) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "log_zmq: aggregate_add(): \"%V\" %ui keys lost, the table could not be sent",
+                          cf->name, agg->used);
+            ngx_memzero(agg->entries, agg->size * sizeof(ngx_http_log_zmq_agg_entry_t));
+            agg->used = 0;
+        }
+
+        e = &agg->entries[hash & mask];
+    }
+
+    e->hash = hash;
+    e->len = k.len;
+    ngx_memcpy(e->key, k.data, k.len);
+    e->count = 0;
+    ngx_memzero(e->sums, sizeof(e->sums));
+    agg->used++;
+
+    if (agg->histogram) {
+        ngx_memzero(agg->buckets + (e - agg->entries) * agg->nsums * ZMQ_NGINX_HISTOGRAM_BUCKETS,
+                    agg->nsums * ZMQ_NGINX_HISTOGRAM_BUCKETS * sizeof(uint32_t));
+    }
+
+found:
+
+    e->count++;
+
+    if (agg->histogram) {
+        h = agg->buckets + (e - agg->entries) * agg->nsums * ZMQ_NGINX_HISTOGRAM_BUCKETS;
+
+        for (j = 0; j < agg->nsums; j++, h += ZMQ_NGINX_HISTOGRAM_BUCKETS) {
+            if (values[j] >= 0) {
+                h[log_zmq_histogram_bucket((uint64_t) values[j])]++;
+            }
+        }
+
+    } else {
+        for (j = 0; j < agg->nsums; j++) {
+            e->sums[j] += values[j];
+        }
+    }
+
+    if (!agg->timer.timer_set) {
+        agg->start = ngx_current_msec;
+        ngx_add_timer(&agg->timer, agg->interval);
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * @brief move a heavy hitter down the min-heap
+ */
+static void
+log_zmq_topk_down(ngx_http_log_zmq_topk_t *h, ngx_uint_t n, ngx_uint_t i)
+{
+    ngx_http_log_zmq_topk_t  t;
+    ngx_uint_t               c;
+
+    for ( ;; ) {
+        c = 2 * i + 1;
+        if (c >= n) {
+            return;
+        }
+
+        if (c + 1 < n && h[c + 1].count < h[c].count) {
+            c++;
+        }
+
+        if (h[i].count <= h[c].count) {
+            return;
+        }
+
+        t = h[i];
+        h[i] = h[c];
+        h[c] = t;
+        i = c;
+    }
+}
+
+/**
+ * @brief move a heavy hitter up the min-heap
+ */
+static void
+log_zmq_topk_up(ngx_http_log_zmq_topk_t *h, ngx_uint_t i)
+{
+    ngx_http_log_zmq_topk_t  t;
+    ngx_uint_t               p;
+
+    while (i) {
+        p = (i - 1) / 2;
+
+        if (h[p].count <= h[i].count) {
+            return;
+        }
+
+        t = h[i];
+        h[i] = h[p];
+        h[p] = t;
+        i = p;
+    }
+}
+
+/**
+ * @brief send the sketches of this worker and clear them
+ *
+ * The message is binary, all integers in network byte order. The sketches
+ * of all the workers and hosts with the same width, depth and precision
+ * are merged by adding the counters and keeping the highest registers:
+ *
+ * @code
+ * uint8  version (1)
+ * uint8  HyperLogLog precision (p)
+ * uint16 number of variables
+ * uint32 pid
+ * uint32 interval in milliseconds
+ * uint32 depth
+ * uint32 width
+ * uint8  definition length, definition
+ * for each variable:
+ *        uint8 variable length, variable
+ *        uint32 values seen
+ *        depth x width uint32 counters
+ *        2^p uint8 registers
+ *        uint16 heavy hitters, then (uint16 length, value, uint32 count) for each one
+ * @endcode
+ *
+ * @param ev A ngx_event_t pointer with the definition as data
+ */
+static void
+log_zmq_sketch_flush(ngx_event_t *ev)
+{
+    ngx_http_log_zmq_element_conf_t *cf = ev->data;
+    ngx_http_log_zmq_sketch_t       *sk = cf->sketch;
+    ngx_http_log_zmq_sketch_var_t   *v;
+    ngx_pool_t                      *pool;
+    ngx_str_t                        data;
+    ngx_uint_t                       i, j, ncms;
+    size_t                           len;
+    u_char                          *p;
+
+    if (sk->timer.timer_set) {
+        ngx_del_timer(&sk->timer);
+    }
+
+    ncms = sk->depth * sk->width;
+    len = 20 + 1 + ngx_min(cf->name->len, 255);
+
+    for (j = 0; j < sk->nvars; j++) {
+        v = &sk->vars[j];
+        len += 1 + ngx_min(v->name.len, 255) + 4 + ncms * 4 + ((size_t) 1 << sk->hll_bits) + 2;
+
+        for (i = 0; i < v->ntop; i++) {
+            len += 2 + v->top[i].len + 4;
+        }
+    }
+
+    pool = ngx_create_pool(len + 1024, ev->log);
+    if (NULL == pool) {
+        return;
+    }
+
+    data.data = ngx_pnalloc(pool, len);
+    if (NULL == data.data) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    p = data.data;
+    *p++ = ZMQ_NGINX_SKETCH_VERSION;
+    *p++ = (u_char) sk->hll_bits;
+    p = log_zmq_write_uint16(p, (uint16_t) sk->nvars);
+    p = log_zmq_write_uint32(p, (uint32_t) ngx_pid);
+    p = log_zmq_write_uint32(p, (uint32_t) (ngx_current_msec - sk->start));
+    p = log_zmq_write_uint32(p, (uint32_t) sk->depth);
+    p = log_zmq_write_uint32(p, (uint32_t) sk->width);
+
+    *p++ = (u_char) ngx_min(cf->name->len, 255);
+    p = ngx_cpymem(p, cf->name->data, ngx_min(cf->name->len, 255));
+
+    for (j = 0; j < sk->nvars; j++) {
+        v = &sk->vars[j];
+
+        *p++ = (u_char) ngx_min(v->name.len, 255);
+        p = ngx_cpymem(p, v->name.data, ngx_min(v->name.len, 255));
+        p = log_zmq_write_uint32(p, (uint32_t) v->requests);
+
+        for (i = 0; i < ncms; i++) {
+            p = log_zmq_write_uint32(p, v->cms[i]);
+        }
+
+        p = ngx_cpymem(p, v->hll, (size_t) 1 << sk->hll_bits);
+
+        p = log_zmq_write_uint16(p, (uint16_t) v->ntop);
+        for (i = 0; i < v->ntop; i++) {
+            p = log_zmq_write_uint16(p, (uint16_t) v->top[i].len);
+            p = ngx_cpymem(p, v->top[i].key, v->top[i].len);
+            p = log_zmq_write_uint32(p, v->top[i].count);
+        }
+
+        ngx_memzero(v->cms, ncms * sizeof(uint32_t));
+        ngx_memzero(v->hll, (size_t) 1 << sk->hll_bits);
+        v->ntop = 0;
+        v->requests = 0;
+    }
+
+    data.len = p - data.data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "log_zmq: sketch_flush(): \"%V\"", cf->name);
+
+    (void) log_zmq_send(cf, pool, ev->log, &sk->topic, &data);
+
+    ngx_destroy_pool(pool);
+}
+
+/**
+ * @brief send the sketches of this worker when it exits
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ */
+void
+log_zmq_sketch_exit(ngx_http_log_zmq_element_conf_t *cf)
+{
+    if (cf->sketch->ready) {
+        log_zmq_sketch_flush(&cf->sketch->timer);
+    }
+}
+
+/**
+ * @brief allocate the sketches of this worker
+ *
+ * One block for all the variables: the counters, the heaps and then the
+ * registers of each one.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @return An ngx_int_t with NGX_OK | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_sketch_init(ngx_http_log_zmq_element_conf_t *cf)
+{
+    ngx_http_log_zmq_sketch_t *sk = cf->sketch;
+    ngx_uint_t                 j;
+    size_t                     cms, top, hll;
+    u_char                    *p;
+
+    cms = sk->depth * sk->width * sizeof(uint32_t);
+    top = ngx_align(sk->top * sizeof(ngx_http_log_zmq_topk_t), NGX_ALIGNMENT);
+    hll = ngx_align((size_t) 1 << sk->hll_bits, NGX_ALIGNMENT);
+
+    p = ngx_calloc(sk->nvars * (cms + top + hll), ngx_cycle->log);
+    if (NULL == p) {
+        return NGX_ERROR;
+    }
+
+    for (j = 0; j < sk->nvars; j++) {
+        sk->vars[j].cms = (uint32_t *) p;
+        sk->vars[j].top = (ngx_http_log_zmq_topk_t *) (p + cms);
+        sk->vars[j].hll = p + cms + top;
+        p += cms + top + hll;
+    }
+
+    sk->timer.handler = log_zmq_sketch_flush;
+    sk->timer.data = cf;
+    sk->timer.log = ngx_cycle->log;
+#if (nginx_version >= 1011003)
+    sk->timer.cancelable = 1;
+#endif
+
+    sk->ready = 1;
+
+    return NGX_OK;
+}
+
+/**
+ * @brief count a value in the sketches of a variable
+ *
+ * The count-min rows are indexed with double hashing, the HyperLogLog uses
+ * both hashes as a 64 bits one, and the value goes in the heavy hitters if
+ * its estimated count is higher than the smallest one in the heap.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param var The variable number
+ * @param value A ngx_str_t pointer with the variable value
+ * @return An ngx_int_t with NGX_OK | NGX_ERROR
+ */
+ngx_int_t
+log_zmq_sketch_add(ngx_http_log_zmq_element_conf_t *cf, ngx_uint_t var, ngx_str_t *value)
+{
+    ngx_http_log_zmq_sketch_t     *sk = cf->sketch;
+    ngx_http_log_zmq_sketch_var_t *v;
+    ngx_http_log_zmq_topk_t       *t;
+    ngx_uint_t                     i, reg, rank, bits;
+    uint32_t                       h1, h2, est, *c;
+    uint64_t                       hash, w;
+    size_t                         len;
+
+    if (!sk->ready && log_zmq_sketch_init(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    v = &sk->vars[var];
+
+    h1 = ngx_murmur_hash2(value->data, value->len);
+    h2 = ngx_crc32_short(value->data, value->len);
+
+    est = 0xffffffff;
+    for (i = 0; i < sk->depth; i++) {
+        c = &v->cms[i * sk->width + ((h1 + i * (h2 | 1)) & (sk->width - 1))];
+        if (*c != 0xffffffff) {
+            (*c)++;
+        }
+        est = ngx_min(est, *c);
+    }
+
+    hash = ((uint64_t) h1 << 32) | h2;
+    bits = 64 - sk->hll_bits;
+    reg = (ngx_uint_t) (hash >> bits);
+    w = hash << sk->hll_bits;
+
+    for (rank = 1; rank <= bits && !(w & ((uint64_t) 1 << 63)); rank++) {
+        w <<= 1;
+    }
+
+    if (v->hll[reg] < rank) {
+        v->hll[reg] = (u_char) rank;
+    }
+
+    len = ngx_min(value->len, ZMQ_NGINX_AGGREGATE_KEY_LEN);
+
+    for (i = 0; i < v->ntop; i++) {
+        t = &v->top[i];
+        if (t->len == len && ngx_memcmp(t->key, value->data, len) == 0) {
+            t->count = est;
+            log_zmq_topk_down(v->top, v->ntop, i);
+            goto done;
+        }
+    }
+
+    if (v->ntop < sk->top) {
+        t = &v->top[v->ntop];
+        t->len = len;
+        ngx_memcpy(t->key, value->data, len);
+        t->count = est;
+        log_zmq_topk_up(v->top, v->ntop++);
+
+    } else if (est > v->top[0].count) {
+        t = &v->top[0];
+        t->len = len;
+        ngx_memcpy(t->key, value->data, len);
+        t->count = est;
+        log_zmq_topk_down(v->top, v->ntop, 0);
+    }
+
+done:
+
+    v->requests++;
+
+    if (!sk->timer.timer_set) {
+        sk->start = ngx_current_msec;
+        ngx_add_timer(&sk->timer, sk->interval);
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * @brief send the topic ids table of this worker
+ *
+ * A JSON object with the definition, the pid, the id size and the id (in
+ * hexadecimal) of each topic, sent on the topics topic of the definition.
+ * The timer is set again, so the table also goes out every interval.
+ *
+ * @param ev A ngx_event_t pointer with the definition as data
+ */
+static void
+log_zmq_topics_flush(ngx_event_t *ev)
+{
+    ngx_http_log_zmq_element_conf_t *cf = ev->data;
+    ngx_http_log_zmq_topics_t       *t = cf->topics;
+    ngx_http_log_zmq_topic_t        *e;
+    ngx_pool_t                      *pool;
+    ngx_str_t                        data;
+    ngx_uint_t                       i, n;
+    size_t                           len;
+    u_char                          *p;
+
+    if (t->timer.timer_set) {
+        ngx_del_timer(&t->timer);
+    }
+
+    if (0 == t->used) {
+        return;
+    }
+
+    len = sizeof("{\"definition\":\"\",\"pid\":,\"id_size\":,\"topics\":[]}")
+          + cf->name->len + NGX_INT64_LEN * 2;
+
+    for (i = 0; i < ZMQ_NGINX_TOPICS_SIZE; i++) {
+        e = &t->entries[i];
+        if (e->len) {
+            len += sizeof("{\"id\":\"\",\"topic\":\"\"},") + 2 * t->size
+                   + e->len + log_zmq_escape_json(NULL, e->topic, e->len);
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0, "log_zmq: topics_flush(): \"%V\" %ui topics",
+                   cf->name, t->used);
+
+    pool = ngx_create_pool(len + 1024, ev->log);
+    if (NULL == pool) {
+        return;
+    }
+
+    data.data = ngx_pnalloc(pool, len);
+    if (NULL == data.data) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    p = ngx_sprintf(data.data, "{\"definition\":\"%V\",\"pid\":%P,\"id_size\":%ui,\"topics\":[",
+                    cf->name, ngx_pid, t->size);
+
+    for (i = 0, n = 0; i < ZMQ_NGINX_TOPICS_SIZE; i++) {
+        e = &t->entries[i];
+        if (0 == e->len) {
+            continue;
+        }
+
+        p = ngx_sprintf(p, "%s{\"id\":\"", n++ ? "," : "");
+        p = ngx_hex_dump(p, e->id, t->size);
+        p = ngx_cpymem(p, "\",\"topic\":\"", sizeof("\",\"topic\":\"") - 1);
+        p = (u_char *) log_zmq_escape_json(p, e->topic, e->len);
+        *p++ = '"';
+        *p++ = '}';
+    }
+
+    *p++ = ']';
+    *p++ = '}';
+
+    data.len = p - data.data;
+
+    /* on a failure the table goes out again before the next message */
+    if (NGX_OK == log_zmq_send(cf, pool, ev->log, &t->topic, &data)) {
+        t->dirty = 0;
+    }
+
+    ngx_destroy_pool(pool);
+
+    ngx_add_timer(&t->timer, t->interval);
+}
+
+/**
+ * @brief keep the name of a topic that has no id
+ *
+ * The topic goes after the reserved id 0 and its length, so a subscriber
+ * can't take it for an id.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param pool A ngx_pool_t pointer to the nginx memory manager
+ * @param endpoint A ngx_str_t pointer to the topic, replaced by the marked one
+ * @return An ngx_int_t with NGX_DECLINED | NGX_ERROR
+ */
+static ngx_int_t
+log_zmq_topic_plain(ngx_http_log_zmq_element_conf_t *cf, ngx_pool_t *pool, ngx_str_t *endpoint)
+{
+    size_t   len;
+    u_char  *p;
+
+    len = ngx_min(endpoint->len, 0xffff);
+
+    p = ngx_pnalloc(pool, cf->topics->size + 2 + len);
+    if (NULL == p) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(p, cf->topics->size);
+    p[cf->topics->size] = (u_char) (len >> 8);
+    p[cf->topics->size + 1] = (u_char) len;
+    ngx_memcpy(p + cf->topics->size + 2, endpoint->data, len);
+
+    endpoint->data = p;
+    endpoint->len = cf->topics->size + 2 + len;
+
+    return NGX_DECLINED;
+}
+
+/**
+ * @brief replace a topic by its binary id
+ *
+ * The topic is looked up in the table of this worker, a new topic is added
+ * and the table is sent before the message, so a subscriber always knows
+ * the id of a message it gets. The table is also sent before the first
+ * message of a new socket, once per socket. A topic longer than
+ * ZMQ_NGINX_TOPICS_TOPIC_LEN, a topic whose id is taken by another one (a
+ * hash collision) or a topic that doesn't fit in the table keeps its name,
+ * after the reserved id 0.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param pool A ngx_pool_t pointer to the nginx memory manager
+ * @param log A ngx_log_t pointer to the current logger
+ * @param endpoint A ngx_str_t pointer to the topic, replaced by the id
+ * @return An ngx_int_t with NGX_OK | NGX_DECLINED (topic kept) | NGX_ERROR
+ */
+ngx_int_t
+log_zmq_topic_id(ngx_http_log_zmq_element_conf_t *cf, ngx_pool_t *pool, ngx_log_t *log,
+    ngx_str_t *endpoint)
+{
+    ngx_http_log_zmq_topics_t *t = cf->topics;
+    ngx_http_log_zmq_topic_t  *e;
+    ngx_uint_t                 i, n;
+    uint64_t                   h;
+    u_char                     id[8], *p;
+
+    if (NULL == t->entries) {
+        t->entries = ngx_calloc(ZMQ_NGINX_TOPICS_SIZE * sizeof(ngx_http_log_zmq_topic_t), log);
+        if (NULL == t->entries) {
+            return NGX_ERROR;
+        }
+
+        t->timer.handler = log_zmq_topics_flush;
+        t->timer.data = cf;
+        t->timer.log = ngx_cycle->log;
+#if (nginx_version >= 1011003)
+        t->timer.cancelable = 1;
+#endif
+    }
+
+    if (0 == endpoint->len || endpoint->len > ZMQ_NGINX_TOPICS_TOPIC_LEN) {
+        return log_zmq_topic_plain(cf, pool, endpoint);
+    }
+
+    if (4 == t->size) {
+        h = ngx_crc32_short(endpoint->data, endpoint->len);
+        log_zmq_write_uint32(id, (uint32_t) h);
+
+    } else {
+        /* FNV-1a */
+        h = 14695981039346656037ULL;
+        for (p = endpoint->data; p < endpoint->data + endpoint->len; p++) {
+            h = (h ^ *p) * 1099511628211ULL;
+        }
+        log_zmq_write_uint64(id, h);
+    }
+
+    /* the id 0 marks the topics without an id */
+    if (0 == h) {
+        return log_zmq_topic_plain(cf, pool, endpoint);
+    }
+
+    i = h & (ZMQ_NGINX_TOPICS_SIZE - 1);
+
+    for (n = 0; n < ZMQ_NGINX_TOPICS_SIZE; n++, i = (i + 1) & (ZMQ_NGINX_TOPICS_SIZE - 1)) {
+        e = &t->entries[i];
+
+        if (0 == e->len) {
+            /* keep a quarter of the slots free for short probes */
+            if (t->used >= ZMQ_NGINX_TOPICS_SIZE * 3 / 4) {
+                return log_zmq_topic_plain(cf, pool, endpoint);
+            }
+
+            ngx_memcpy(e->topic, endpoint->data, endpoint->len);
+            ngx_memcpy(e->id, id, t->size);
+            e->len = endpoint->len;
+            t->used++;
+            t->dirty = 1;
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: topic_id(): \"%V\" new topic \"%V\"",
+                           cf->name, endpoint);
+            break;
+        }
+
+        if (ngx_memcmp(e->id, id, t->size) == 0) {
+            if (e->len == endpoint->len && ngx_memcmp(e->topic, endpoint->data, e->len) == 0) {
+                break;
+            }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: topic_id(): \"%V\" id collision for \"%V\"",
+                           cf->name, endpoint);
+            return log_zmq_topic_plain(cf, pool, endpoint);
+        }
+    }
+
+    if (n == ZMQ_NGINX_TOPICS_SIZE) {
+        return log_zmq_topic_plain(cf, pool, endpoint);
+    }
+
+    /*
+     * a new topic, or a new socket (log_zmq_connect marks the table). A
+     * message sent right away sets the socket up after the table, a batch
+     * only when its thread is done, so the table isn't sent for each
+     * message until then.
+     */
+    if (t->dirty || (NULL == cf->thread_pool && LOG_ZMQ_STATE_READY != cf->ctx->state)) {
+        log_zmq_topics_flush(&t->timer);
+    }
+
+    endpoint->data = e->id;
+    endpoint->len = t->size;
+
+    return NGX_OK;
+}
+
+/**
+ * @brief parse a log_zmq_server definition
+ *
+ * Shared by the http and stream modules: create the definition context and
+ * evaluate the address, the protocol, the number of threads and the queue
+ * length given to the directive.
+ *
+ * @code{.conf}
+ * log_zmq_server definition 127.0.0.1:5555 tcp 10 10000;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param lecf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param value A ngx_str_t array with the directive arguments
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+char *
+log_zmq_set_server(ngx_conf_t *cf, ngx_http_log_zmq_element_conf_t *lecf, ngx_str_t *value)
+{
+    const unsigned char                 *kind;
+    ngx_int_t                           iothreads;
+    ngx_int_t                           qlen;
+    ngx_url_t                           u;
+    ngx_log_zmq_server_t                *endpoint;
+    char                                *connection;
+    size_t                              connlen;
+    size_t                              zmq_hdlen;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    /* create ZMQ context structure */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): create context");
+
+    lecf->ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_zmq_ctx_t));
+    if (NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": error creating context \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    lecf->ctx->log = cf->cycle->log;
+    ngx_queue_init(&lecf->ctx->batches);
+
+    /* update definition name and cycle log*/
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): set definition name");
+
+    lecf->name = ngx_palloc(cf->pool, sizeof(ngx_str_t));
+    if (lecf->name == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": error setting name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    lecf->name->data = ngx_palloc(cf->pool, value[1].len);
+    lecf->name->len = value[1].len;
+    ngx_memcpy(lecf->name->data, value[1].data, value[1].len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): initialize element \"%V\"", &value[1]);
+    lecf->log = cf->cycle->log;
+    lecf->off = 0;
+
+    /* set the type of protocol TCP|IPC|INPROC */
+    kind = value[3].data;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): server kind \"%V\"", &value[3]);
+
+    endpoint = ngx_pcalloc(cf->pool, sizeof(ngx_log_zmq_server_t));
+
+    if (endpoint == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": error creating endpoint \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (0 == ngx_strcmp(kind, ZMQ_TCP_KEY)) {
+        endpoint->kind = TCP;
+    } else if (0 == ngx_strcmp(kind, ZMQ_IPC_KEY)) {
+        endpoint->kind = IPC;
+    } else if (0 == ngx_strcmp(kind, ZMQ_INPROC_KEY)) {
+        endpoint->kind = INPROC;
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": invalid ZMQ connection type: %s \"%V\"", kind, &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* set the number of threads associated with this context */
+    iothreads = ngx_atoi(value[4].data, value[4].len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): iothreads \"%V\"", &value[4]);
+
+    if (iothreads == NGX_ERROR || iothreads <= 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": invalid I/O threads %d \"%V\"", iothreads, &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    lecf->iothreads = iothreads;
+
+    /* set the queue size associated with this context */
+    qlen = ngx_atoi(value[5].data, value[5].len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): queue length \"%V\"", &value[5]);
+
+    if (qlen == NGX_ERROR || qlen < 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": invalid queue size %d \"%V\"", qlen, &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    lecf->qlen = qlen;
+
+    /* if the protocol used is TCP, parse it and use nginx parse_url to validate the input */
+    if (endpoint->kind == TCP) {
+        u.url = value[2];
+        u.default_port = __get_default_port(endpoint->kind);
+        u.no_resolve = 0;
+        u.listen = 1;
+
+        if(ngx_parse_url(cf->pool, &u) != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": invalid server: %s \"%V\"", u.err, &value[1]);
+            return NGX_CONF_ERROR;
+        }
+        endpoint->peer_addr = u.addrs[0];
+    } else {
+        u.url = value[2];
+    }
+
+    /* create a connection based on the protocol type */
+    switch (endpoint->kind) {
+        case TCP:
+            zmq_hdlen = ZMQ_TCP_HLEN;
+            connlen = u.url.len + zmq_hdlen;
+            connection = (char *) ngx_pcalloc(cf->pool, connlen + 1);
+            ngx_memcpy(connection, ZMQ_TCP_HANDLER, zmq_hdlen);
+            ngx_memcpy(&connection[zmq_hdlen], u.url.data, u.url.len);
+            break;
+        case IPC:
+            zmq_hdlen = ZMQ_IPC_HLEN;
+            connlen = u.url.len + zmq_hdlen;
+            connection = (char *) ngx_pcalloc(cf->pool, connlen + 1);
+            ngx_memcpy(connection, ZMQ_IPC_HANDLER, zmq_hdlen);
+            ngx_memcpy(&connection[zmq_hdlen], u.url.data, u.url.len);
+            break;
+        case INPROC:
+            zmq_hdlen = ZMQ_INPROC_HLEN;
+            connlen = u.url.len + zmq_hdlen;
+            connection = (char *) ngx_pcalloc(cf->pool, connlen + 1);
+            ngx_memcpy(connection, ZMQ_INPROC_HANDLER, zmq_hdlen);
+            ngx_memcpy(&connection[zmq_hdlen], u.url.data, u.url.len);
+            break;
+        default:
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": invalid endpoint type \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): connection %s", connection);
+
+    if (NULL == connection) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": error creating connection \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* create the final connection endpoint to be used on socket connection */
+    endpoint->connection = ngx_palloc(cf->pool, sizeof(ngx_str_t));
+    endpoint->connection->data = ngx_palloc(cf->pool, connlen);
+    endpoint->connection->len = connlen;
+    ngx_memcpy(endpoint->connection->data, connection, connlen);
+    lecf->server = endpoint;
+
+    /* set the server as done */
+    lecf->sset = 1;
+
+    ngx_pfree(cf->pool, connection);
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief parse a log_zmq_socket_option definition
+ *
+ * Shared by the http and stream modules. Each key=value is checked against
+ * the options known by this build and the version of the linked libzmq,
+ * and kept to be set when the socket is created.
+ *
+ * @code{.conf}
+ * log_zmq_socket_option definition sndbuf=4m immediate=on tcp_keepalive=on tcp_keepalive_idle=60s;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param lecf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param value A ngx_str_t array with the directive arguments
+ * @param n The number of arguments
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+char *
+log_zmq_set_socket_option(ngx_conf_t *cf, ngx_http_log_zmq_element_conf_t *lecf, ngx_str_t *value, ngx_uint_t n)
+{
+    ngx_http_log_zmq_sockopt_t *opt;
+    log_zmq_sockopt_def_t      *def;
+    ngx_str_t                   name, v;
+    ngx_int_t                   num;
+    ngx_uint_t                  i;
+    u_char                     *p;
+    int                         major, minor, patch;
+
+    zmq_version(&major, &minor, &patch);
+
+    if (NULL == lecf->sockopts) {
+        lecf->sockopts = ngx_array_create(cf->pool, 4, sizeof(ngx_http_log_zmq_sockopt_t));
+        if (NULL == lecf->sockopts) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2..] <option>=<value>
+     */
+    for (i = 2; i < n; i++) {
+
+        p = ngx_strlchr(value[i].data, value[i].data + value[i].len, '=');
+        if (NULL == p || p == value[i].data || p == value[i].data + value[i].len - 1) {
+            goto invalid;
+        }
+
+        name.data = value[i].data;
+        name.len = p - value[i].data;
+        v.data = p + 1;
+        v.len = value[i].data + value[i].len - v.data;
+
+        for (def = log_zmq_sockopts; def->name.len; def++) {
+            if (def->name.len == name.len && ngx_strncmp(def->name.data, name.data, name.len) == 0) {
+                break;
+            }
+        }
+
+        if (0 == def->name.len) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\": unknown option \"%V\"", &value[0], &name);
+            return NGX_CONF_ERROR;
+        }
+
+        if (ZMQ_MAKE_VERSION(major, minor, patch) < def->version) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"%V\": option \"%V\" needs libzmq %d.%d.%d, linked with %d.%d.%d",
+                               &value[0], &name, def->version / 10000, def->version / 100 % 100,
+                               def->version % 100, major, minor, patch);
+            return NGX_CONF_ERROR;
+        }
+
+        switch (def->kind) {
+
+        case LOG_ZMQ_SOCKOPT_FLAG:
+            if (v.len == 2 && ngx_strncmp(v.data, "on", 2) == 0) {
+                num = 1;
+            } else if (v.len == 3 && ngx_strncmp(v.data, "off", 3) == 0) {
+                num = 0;
+            } else {
+                num = NGX_ERROR;
+            }
+            break;
+
+        case LOG_ZMQ_SOCKOPT_SIZE:
+            num = ngx_parse_size(&v);
+            break;
+
+        case LOG_ZMQ_SOCKOPT_MSEC:
+            num = ngx_parse_time(&v, 0);
+            break;
+
+        case LOG_ZMQ_SOCKOPT_SEC:
+            num = ngx_parse_time(&v, 1);
+            break;
+
+        default:
+            num = ngx_atoi(v.data, v.len);
+        }
+
+        if (num == NGX_ERROR || num > NGX_MAX_INT32_VALUE) {
+            goto invalid;
+        }
+
+        opt = ngx_array_push(lecf->sockopts);
+        if (NULL == opt) {
+            return NGX_CONF_ERROR;
+        }
+
+        opt->name = (const char *) def->name.data;
+        opt->option = def->option;
+        opt->value = (int) num;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_socket_option(): \"%V\" %V=%i",
+                       &value[1], &name, num);
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\": invalid parameter \"%V\"", &value[0], &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/**
+ * @brief parse a log_zmq_io_threads definition
+ *
+ * Shared by the http and stream modules. It needs libzmq 4.3, both in the
+ * headers nginx is built with and in the linked library.
+ *
+ * @code{.conf}
+ * log_zmq_io_threads definition cpus=auto policy=fifo priority=10;
+ * log_zmq_io_threads definition cpus=6,7;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param lecf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param value A ngx_str_t array with the directive arguments
+ * @param n The number of arguments
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+char *
+log_zmq_set_io_threads(ngx_conf_t *cf, ngx_http_log_zmq_element_conf_t *lecf, ngx_str_t *value, ngx_uint_t n)
+{
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+    ngx_uint_t  i;
+    ngx_int_t   first, last;
+    u_char     *p, *end, *comma, *dash;
+    int         major, minor, patch, *cpu;
+
+    zmq_version(&major, &minor, &patch);
+
+    if (ZMQ_MAKE_VERSION(major, minor, patch) < ZMQ_MAKE_VERSION(4, 3, 0)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" needs libzmq 4.3.0, linked with %d.%d.%d",
+                           &value[0], major, minor, patch);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->io_set) {
+        return "is duplicate";
+    }
+
+    lecf->io_set = 1;
+    lecf->io_cpus = NULL;
+    lecf->io_policy = -1;
+    lecf->io_priority = -1;
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2..] cpus=auto|<list> policy=<policy> priority=<n>
+     */
+    for (i = 2; i < n; i++) {
+
+        if (ngx_strncmp(value[i].data, "cpus=", 5) == 0) {
+
+            if (value[i].len == 9 && ngx_strncmp(value[i].data + 5, "auto", 4) == 0) {
+                lecf->io_cpus = NULL;
+                continue;
+            }
+
+            lecf->io_cpus = ngx_array_create(cf->pool, 4, sizeof(int));
+            if (NULL == lecf->io_cpus) {
+                return NGX_CONF_ERROR;
+            }
+
+            /* a list of cpus and ranges: 6,7,10-15 */
+            p = value[i].data + 5;
+            end = value[i].data + value[i].len;
+
+            while (p < end) {
+                comma = ngx_strlchr(p, end, ',');
+                if (NULL == comma) {
+                    comma = end;
+                }
+
+                dash = ngx_strlchr(p, comma, '-');
+                if (dash) {
+                    first = ngx_atoi(p, dash - p);
+                    last = ngx_atoi(dash + 1, comma - dash - 1);
+                } else {
+                    first = ngx_atoi(p, comma - p);
+                    last = first;
+                }
+
+                if (first == NGX_ERROR || last == NGX_ERROR || last < first || last >= (ngx_int_t) ngx_ncpu) {
+                    goto invalid;
+                }
+
+                for ( /* void */ ; first <= last; first++) {
+                    cpu = ngx_array_push(lecf->io_cpus);
+                    if (NULL == cpu) {
+                        return NGX_CONF_ERROR;
+                    }
+                    *cpu = (int) first;
+                }
+
+                p = comma + 1;
+            }
+
+            if (0 == lecf->io_cpus->nelts) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "policy=", 7) == 0) {
+            p = value[i].data + 7;
+            first = value[i].len - 7;
+
+            if (first == 5 && ngx_strncmp(p, "other", 5) == 0) {
+                lecf->io_policy = SCHED_OTHER;
+            } else if (first == 4 && ngx_strncmp(p, "fifo", 4) == 0) {
+                lecf->io_policy = SCHED_FIFO;
+            } else if (first == 2 && ngx_strncmp(p, "rr", 2) == 0) {
+                lecf->io_policy = SCHED_RR;
+#ifdef SCHED_BATCH
+            } else if (first == 5 && ngx_strncmp(p, "batch", 5) == 0) {
+                lecf->io_policy = SCHED_BATCH;
+#endif
+#ifdef SCHED_IDLE
+            } else if (first == 4 && ngx_strncmp(p, "idle", 4) == 0) {
+                lecf->io_policy = SCHED_IDLE;
+#endif
+            } else {
+                goto invalid;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "priority=", 9) == 0) {
+            lecf->io_priority = ngx_atoi(value[i].data + 9, value[i].len - 9);
+            if (lecf->io_priority == NGX_ERROR || lecf->io_priority > 99) {
+                goto invalid;
+            }
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_io_threads(): \"%V\" policy=%i priority=%i",
+                   &value[1], lecf->io_policy, lecf->io_priority);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\": invalid parameter \"%V\"", &value[0], &value[i]);
+    return NGX_CONF_ERROR;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" needs nginx built with libzmq 4.3.0 or newer", &value[0]);
+    return NGX_CONF_ERROR;
+#endif
+}
+
+/**
+ * @brief release what a definition set up in a worker
+ *
+ * Called by the exit process hook of the http and of the stream modules,
+ * the pending aggregates and sketches are sent before the socket goes.
+ *
+ * @param cf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param log A ngx_log_t pointer to the logger
+ */
+void
+log_zmq_definition_exit(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log)
+{
+    if (NULL == cf->ctx) {
+        return;
+    }
+
+    if (cf->aggregate) {
+        log_zmq_aggregate_exit(cf);
+    }
+
+    if (cf->sketch) {
+        log_zmq_sketch_exit(cf);
+    }
+
+#if (NGX_THREADS)
+    if (cf->thread_pool) {
+        log_zmq_batch_exit(cf, log);
+    }
+#endif
+
+#if (NGX_HAVE_ZSTD)
+    if (cf->compress) {
+        log_zmq_zstd_exit(cf);
+    }
+#endif
+
+    if (cf->writable || cf->subscriptions) {
+        log_zmq_watch_stop(cf);
+    }
+}
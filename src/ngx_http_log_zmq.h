@@ -19,12 +19,18 @@
 
 #include <ngx_config.h>
 #include <ngx_core.h>
-#include <ngx_http.h>
+#include <ngx_event.h>
 #include <nginx.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 #include <zmq.h>
 
-#include "ngx_http_log_zmq_module.h"
+#if (NGX_HAVE_ZSTD)
+#include <zstd.h>
+#endif
 
 #ifndef ZMQ_DONTWAIT
 
@@ -51,6 +57,105 @@
 
 #define ZMQ_NGINX_LINGER 0
 #define ZMQ_NGINX_QUEUE_LENGTH 100
+#define ZMQ_NGINX_BACKOFF_MIN 100
+#define ZMQ_NGINX_BACKOFF_MAX 30000
+#define ZMQ_NGINX_CAPS 8
+
+/* thread pool batches */
+#define ZMQ_NGINX_BATCH 100
+#define ZMQ_NGINX_BATCH_FLUSH 100
+
+/* rate limits */
+#define ZMQ_NGINX_RATE_SUMMARY 1000
+#define ZMQ_NGINX_RATE_TOPIC "/log_zmq/suppressed/"
+
+/* adaptive sample and priorities */
+#define ZMQ_NGINX_SAMPLE_MIN 100         /* in LOG_ZMQ_CONTROL_SCALE parts */
+#define ZMQ_NGINX_SAMPLE_STEP 500        /* in LOG_ZMQ_CONTROL_SCALE parts */
+#define ZMQ_NGINX_SAMPLE_WATERMARK 50    /* percent of log_zmq_max_queue_bytes */
+#define ZMQ_NGINX_SAMPLE_INTERVAL 1000
+#define ZMQ_NGINX_PRIORITY_LOW 80        /* percent of log_zmq_max_queue_bytes */
+
+/* subscriptions of the XPUB sockets */
+#define ZMQ_NGINX_SUBSCRIPTION_LEN 256
+#define ZMQ_NGINX_SUBSCRIPTION_READ 64
+
+/* why a watched socket can not take messages */
+#define LOG_ZMQ_BLOCKED_FULL 0x01        /* the socket has no ZMQ_POLLOUT */
+#define LOG_ZMQ_BLOCKED_PEER 0x02        /* the socket is not connected to the collector */
+
+/* aggregates */
+#define ZMQ_NGINX_AGGREGATE_TOPIC "/log_zmq/aggregate/"
+#define ZMQ_NGINX_AGGREGATE_SIZE 1024
+#define ZMQ_NGINX_AGGREGATE_INTERVAL 1000
+#define ZMQ_NGINX_AGGREGATE_SUMS 4
+#define ZMQ_NGINX_AGGREGATE_KEY_LEN 128
+
+/* histograms */
+#define ZMQ_NGINX_HISTOGRAM_TOPIC "/log_zmq/histogram/"
+#define ZMQ_NGINX_HISTOGRAM_SIZE 64
+#define ZMQ_NGINX_HISTOGRAM_INTERVAL 10000
+#define ZMQ_NGINX_HISTOGRAM_VERSION 1
+
+/* log-linear histograms of microseconds: values under 32 have their own
+ * bucket, then each power of two is split in 16 buckets (6% of error),
+ * up to 2^40 microseconds */
+#define ZMQ_NGINX_HISTOGRAM_SUB_BITS 4
+#define ZMQ_NGINX_HISTOGRAM_MAX_SHIFT 35
+#define ZMQ_NGINX_HISTOGRAM_BUCKETS ((ZMQ_NGINX_HISTOGRAM_MAX_SHIFT + 2) << ZMQ_NGINX_HISTOGRAM_SUB_BITS)
+
+/* sketches */
+#define ZMQ_NGINX_SKETCH_TOPIC "/log_zmq/sketch/"
+#define ZMQ_NGINX_SKETCH_VERSION 1
+#define ZMQ_NGINX_SKETCH_INTERVAL 10000
+#define ZMQ_NGINX_SKETCH_WIDTH 2048
+#define ZMQ_NGINX_SKETCH_DEPTH 4
+#define ZMQ_NGINX_SKETCH_MAX_DEPTH 8
+#define ZMQ_NGINX_SKETCH_TOP 10
+#define ZMQ_NGINX_SKETCH_MAX_TOP 100
+#define ZMQ_NGINX_SKETCH_HLL_BITS 12
+
+/* a compressed message is the endpoint, a NUL byte, the dictionary id
+ * (uint32 in network byte order, 0 without dictionary) and a zstd frame */
+#define ZMQ_NGINX_ZSTD_LEVEL 3
+#define ZMQ_NGINX_ZSTD_HEADER 5
+
+/* dictionary batches */
+#define ZMQ_NGINX_DICT_TOPIC "/log_zmq/batch/"
+#define ZMQ_NGINX_DICT_VERSION 1
+#define ZMQ_NGINX_DICT_FIELDS 8
+
+/* an Arrow batch is the topic, NUL bytes up to a multiple of 8 bytes and an
+ * Arrow IPC stream: the schema, one record batch and the end of stream */
+#define ZMQ_NGINX_ARROW_TOPIC "/log_zmq/arrow/"
+#define ZMQ_NGINX_ARROW_FIELDS 16
+
+/* fields of a batch, dictionary or Arrow */
+#define ZMQ_NGINX_BATCH_FIELDS ZMQ_NGINX_ARROW_FIELDS
+
+/* topic ids: a topic without an id is sent after the reserved id 0, with
+ * its length (uint16 in network byte order) */
+#define ZMQ_NGINX_TOPICS_TOPIC "/log_zmq/topics/"
+#define ZMQ_NGINX_TOPICS_INTERVAL 10000
+#define ZMQ_NGINX_TOPICS_SIZE 256
+#define ZMQ_NGINX_TOPICS_ID_LEN 4
+#define ZMQ_NGINX_TOPICS_TOPIC_LEN 128
+
+/* envelope frame, all integers in network byte order:
+ *
+ * 0  version      uint8
+ * 1  host length  uint8
+ * 2  worker slot  uint16
+ * 4  pid          uint32
+ * 8  definition   uint32 (crc32 of the definition name)
+ * 12 sequence     uint64 (per worker and definition, starts at 1)
+ * 20 timestamp    uint64 (microseconds since the epoch)
+ * 28 host
+ */
+#define ZMQ_NGINX_ENVELOPE_VERSION 1
+#define ZMQ_NGINX_ENVELOPE_SEQUENCE 12
+#define ZMQ_NGINX_ENVELOPE_TIMESTAMP 20
+#define ZMQ_NGINX_ENVELOPE_HOST 28
 
 /* ZMQ makes use of three types of protocols:
  *
@@ -75,10 +180,524 @@
 #define ZMQ_INPROC_HANDLER "inproc://"
 #define ZMQ_INPROC_HLEN 9
 
+/**
+ * @brief define a type to use as an address structure
+ *
+ * This type is used to evaluate the url configuration
+ */
+typedef ngx_addr_t ngx_log_zmq_addr_t;
+
+/**
+ * @brief ZMQ protocols
+ *
+ */
+typedef enum{
+    TCP = 0,
+    IPC,
+    INPROC
+} ngx_log_zmq_server_kind;
+
+/**
+ * @brief representation of a zmq server
+ *
+ * We have the address, the type of the connection and the final
+ * string with the connection name (prepended with tcp://)
+ */
+typedef struct {
+    ngx_log_zmq_addr_t       peer_addr;    /**< Address URL */
+    ngx_log_zmq_server_kind  kind;         /**< Type of server (TCP|IPC|INPROC) */
+    ngx_str_t               *connection;   /**< Final connection string
+                                                   tcp://<ip>:<port>
+                                                   ipc://<endpoint>
+                                                   inproc://<endpoint> */
+} ngx_log_zmq_server_t;
+
+/**
+ * @brief counters kept for each definition
+ *
+ * The counters live in the "log_zmq_stats" shared zone so they are the sum
+ * of all workers. Gauges (like the offload queue) go up and down.
+ */
+typedef enum {
+    LOG_ZMQ_STAT_SENT = 0,          /**< Messages given to ZMQ */
+    LOG_ZMQ_STAT_FAILED,            /**< Messages not given to ZMQ */
+    LOG_ZMQ_STAT_OFFLOAD_QUEUED,    /**< Batches waiting for or running in a thread */
+    LOG_ZMQ_STAT_OFFLOAD_BATCHES,   /**< Batches done by a thread */
+    LOG_ZMQ_STAT_OFFLOAD_USEC,      /**< Time spent by the threads, in microseconds */
+    LOG_ZMQ_STAT_RATE_LIMITED,      /**< Messages suppressed by the rate limit */
+    LOG_ZMQ_STAT_SAMPLED_OUT,       /**< Messages dropped by the runtime sample rate */
+    LOG_ZMQ_STAT_QUEUE_FULL,        /**< Messages refused by log_zmq_max_queue_bytes */
+    LOG_ZMQ_STAT_QUEUED_BYTES,      /**< Bytes given to ZMQ and not freed yet (only with a byte limit) */
+    LOG_ZMQ_STAT_NOT_READY,         /**< Messages skipped while the socket setup is in backoff */
+    LOG_ZMQ_STAT_UNSUBSCRIBED,      /**< Messages not rendered because nobody subscribed the topic */
+    LOG_ZMQ_STAT_TRUNCATED,         /**< Variable values cut by their length cap */
+    LOG_ZMQ_STAT_OVERSIZED,         /**< Messages dropped by log_zmq_max_message_size */
+    LOG_ZMQ_STAT_LOW_PRIORITY,      /**< Low priority messages dropped to keep room for the high ones */
+    LOG_ZMQ_STAT_NOT_WRITABLE,      /**< Messages not rendered because the socket could not take them */
+    LOG_ZMQ_STAT_MAX
+} ngx_log_zmq_stat_e;
+
+/**
+ * @brief types of the Arrow columns
+ */
+typedef enum {
+    LOG_ZMQ_ARROW_STRING = 0,       /**< Utf8 */
+    LOG_ZMQ_ARROW_INT,              /**< Int64, null if the value is not an integer */
+    LOG_ZMQ_ARROW_FLOAT             /**< Float64, null if the value is not a number */
+} ngx_log_zmq_arrow_type_e;
+
+/**
+ * @brief token bucket of a rate limited definition
+ *
+ * Tokens are kept in thousandths of a message, so a rate in messages per
+ * second is also the number of tokens added each millisecond.
+ */
+typedef struct {
+    ngx_atomic_t            lock;           /**< Only used by the shared bucket */
+    ngx_uint_t              tokens;         /**< Available tokens, 1000 for each message */
+    ngx_msec_t              last;           /**< Last time tokens were added */
+} ngx_http_log_zmq_bucket_t;
+
+#define LOG_ZMQ_CONTROL_OFF     0x01    /**< Logging disabled */
+#define LOG_ZMQ_CONTROL_SAMPLE  0x02    /**< Only a sample of the messages is sent */
+#define LOG_ZMQ_CONTROL_RATE    0x04    /**< Rate limit set at runtime */
+#define LOG_ZMQ_CONTROL_SCALE   10000   /**< Sample rate of 1 */
+
+/**
+ * @brief runtime control of a definition
+ *
+ * Written by the log_zmq_control location and read by all workers. The
+ * handler loads the flags once, the other fields are only read when their
+ * flag is set, so a definition without any override costs a single load.
+ */
+typedef struct {
+    ngx_atomic_t            flags;          /**< LOG_ZMQ_CONTROL_* overrides in use */
+    ngx_atomic_t            sample;         /**< Messages sent, in LOG_ZMQ_CONTROL_SCALE parts */
+    ngx_atomic_t            rate;           /**< Rate limit, in messages per second for all workers */
+} ngx_http_log_zmq_control_t;
+
+typedef struct {
+    ngx_atomic_t            counters[LOG_ZMQ_STAT_MAX];
+    ngx_http_log_zmq_bucket_t bucket;       /**< Bucket shared by all workers */
+    ngx_http_log_zmq_control_t control;     /**< Runtime control */
+} ngx_http_log_zmq_stats_t;
+
+/**
+ * @brief stages of the log phase timed by log_zmq_timing
+ */
+typedef enum {
+    LOG_ZMQ_TIMING_SCRIPT = 0,      /**< Format and endpoint rendering */
+    LOG_ZMQ_TIMING_SERIALIZE,       /**< Serialization (or compression, or the copy to a batch) */
+    LOG_ZMQ_TIMING_SETUP,           /**< Context and socket setup */
+    LOG_ZMQ_TIMING_SEND,            /**< zmq_msg_send */
+    LOG_ZMQ_TIMING_HANDLER,         /**< The whole handler */
+    LOG_ZMQ_TIMING_MAX
+} ngx_log_zmq_timing_e;
+
+/**
+ * @brief timing histograms of a worker, in nanoseconds
+ *
+ * Each worker only writes its own row of the counters zone, the status
+ * handler adds the rows.
+ */
+typedef struct {
+    uint32_t                buckets[LOG_ZMQ_TIMING_MAX][ZMQ_NGINX_HISTOGRAM_BUCKETS];
+} ngx_http_log_zmq_timing_t;
+
+typedef struct ngx_http_log_zmq_batch_s ngx_http_log_zmq_batch_t;
+
+/**
+ * @brief connection state of a definition in a worker
+ *
+ * A definition starts idle, the first message creates the context and the
+ * socket. If that fails, the socket is closed (the context is kept for the
+ * next try) and the definition waits in backoff, doubling the wait after
+ * each failure, until a timer makes it idle again.
+ */
+typedef enum {
+    LOG_ZMQ_STATE_IDLE = 0,         /**< Nothing created, the next message tries */
+    LOG_ZMQ_STATE_CONNECTING,       /**< Creating the context and the socket */
+    LOG_ZMQ_STATE_READY,            /**< Socket connected */
+    LOG_ZMQ_STATE_BACKOFF           /**< Setup failed, waiting for the retry timer */
+} ngx_log_zmq_state_e;
+
+/**
+ * @brief socket option set by log_zmq_socket_option
+ *
+ * All the options we know are integers, they are applied in the order they
+ * were given, before the socket connects.
+ */
+typedef struct {
+    const char             *name;                /**< Option name, for the error log */
+    int                     option;              /**< ZMQ_* option */
+    int                     value;               /**< Option value */
+} ngx_http_log_zmq_sockopt_t;
+
+/**
+ * @brief counters of one aggregation key
+ */
+typedef struct {
+    uint32_t                hash;                /**< Hash of the key */
+    size_t                  len;                 /**< Key length, 0 if the slot is free */
+    u_char                  key[ZMQ_NGINX_AGGREGATE_KEY_LEN]; /**< Key, truncated if needed */
+    ngx_uint_t              count;               /**< Requests seen with this key */
+    off_t                   sums[ZMQ_NGINX_AGGREGATE_SUMS];   /**< Sum of each variable */
+} ngx_http_log_zmq_agg_entry_t;
+
+/**
+ * @brief aggregation of a definition
+ *
+ * The configuration part is set by log_zmq_aggregate or log_zmq_histogram,
+ * the table is an open addressing hash (linear probing) allocated by each
+ * worker on its first request, and sent as one message every interval.
+ * With log_zmq_histogram the variables are recorded in one histogram per
+ * key and variable instead of being summed.
+ */
+typedef struct {
+    ngx_array_t            *key_lengths;         /**< Key length after compiling */
+    ngx_array_t            *key_values;          /**< Key values */
+    ngx_int_t               sums[ZMQ_NGINX_AGGREGATE_SUMS];      /**< Variable indexes to sum */
+    ngx_str_t               sum_names[ZMQ_NGINX_AGGREGATE_SUMS]; /**< Variable names to sum */
+    ngx_uint_t              nsums;               /**< Number of variables to sum */
+    ngx_uint_t              histogram;           /**< Record the variables in histograms? */
+    ngx_uint_t              size;                /**< Number of slots, a power of two */
+    ngx_msec_t              interval;            /**< Time between two messages */
+    ngx_str_t               topic;               /**< Topic of the messages */
+    ngx_http_log_zmq_agg_entry_t *entries;       /**< Table of this worker */
+    uint32_t               *buckets;             /**< Histograms of this worker, by slot and variable */
+    ngx_uint_t              used;                /**< Used slots */
+    ngx_msec_t              start;               /**< Start of the current interval */
+    ngx_event_t             timer;               /**< Timer to send the table */
+} ngx_http_log_zmq_agg_t;
+
+/**
+ * @brief heavy hitter of a sketch
+ */
+typedef struct {
+    size_t                  len;                 /**< Value length */
+    u_char                  key[ZMQ_NGINX_AGGREGATE_KEY_LEN]; /**< Value, truncated if needed */
+    uint32_t                count;               /**< Count estimated by the count-min sketch */
+} ngx_http_log_zmq_topk_t;
+
+/**
+ * @brief sketches of one variable
+ */
+typedef struct {
+    ngx_int_t               index;               /**< Variable index */
+    ngx_str_t               name;                /**< Variable name */
+    ngx_uint_t              requests;            /**< Values seen in the interval */
+    uint32_t               *cms;                 /**< Count-min sketch, depth rows of width counters */
+    u_char                 *hll;                 /**< HyperLogLog registers */
+    ngx_http_log_zmq_topk_t *top;                /**< Min-heap of the heavy hitters */
+    ngx_uint_t              ntop;                /**< Values in the heap */
+} ngx_http_log_zmq_sketch_var_t;
+
+/**
+ * @brief sketches of a definition
+ *
+ * The configuration part is set by log_zmq_sketch, the sketches are fixed
+ * memory allocated by each worker on its first request, and sent and
+ * cleared every interval.
+ */
+typedef struct {
+    ngx_http_log_zmq_sketch_var_t vars[ZMQ_NGINX_AGGREGATE_SUMS]; /**< Variables to follow */
+    ngx_uint_t              nvars;               /**< Number of variables */
+    ngx_uint_t              width;               /**< Counters per row, a power of two */
+    ngx_uint_t              depth;               /**< Rows of the count-min sketch */
+    ngx_uint_t              top;                 /**< Size of the heavy hitters heap */
+    ngx_uint_t              hll_bits;            /**< HyperLogLog precision */
+    ngx_msec_t              interval;            /**< Time between two messages */
+    ngx_str_t               topic;               /**< Topic of the messages */
+    ngx_uint_t              ready;               /**< Were the sketches allocated? */
+    ngx_msec_t              start;               /**< Start of the current interval */
+    ngx_event_t             timer;               /**< Timer to send the sketches */
+} ngx_http_log_zmq_sketch_t;
+
+/**
+ * @brief topic with a binary id
+ */
+typedef struct {
+    size_t                  len;                 /**< Topic length, 0 for a free slot */
+    u_char                  topic[ZMQ_NGINX_TOPICS_TOPIC_LEN]; /**< Topic */
+    u_char                  id[8];               /**< Id, in network byte order */
+} ngx_http_log_zmq_topic_t;
+
+/**
+ * @brief binary topic ids of a definition
+ *
+ * The id of a topic is a hash of it (crc32 for 4 bytes, FNV-1a for 8), so
+ * every worker gives the same id to a topic. Each worker keeps the topics it
+ * used and sends the table of ids when a topic is new, after a socket setup
+ * and every interval.
+ */
+typedef struct {
+    ngx_uint_t              size;                /**< Bytes of an id, 4 or 8 */
+    ngx_msec_t              interval;            /**< Time between two tables */
+    ngx_str_t               topic;               /**< Topic of the tables */
+    ngx_http_log_zmq_topic_t *entries;           /**< ZMQ_NGINX_TOPICS_SIZE slots of this worker */
+    ngx_uint_t              used;                /**< Used slots */
+    ngx_uint_t              dirty;               /**< Must the table be sent before the next message? */
+    ngx_event_t             timer;               /**< Timer to send the table */
+} ngx_http_log_zmq_topics_t;
+
+/**
+ * @brief node of the subscriptions trie
+ *
+ * One node per byte of the subscribed prefixes, the children are a list
+ * since a topic byte rarely has more than a few followers.
+ */
+typedef struct ngx_http_log_zmq_trie_s ngx_http_log_zmq_trie_t;
+
+struct ngx_http_log_zmq_trie_s {
+    ngx_http_log_zmq_trie_t *child;              /**< First child */
+    ngx_http_log_zmq_trie_t *next;               /**< Next sibling */
+    ngx_uint_t              count;               /**< Subscriptions ending in this node */
+    u_char                  c;                   /**< Byte of this node */
+};
+
+/**
+ * @brief module's context
+ *
+ * Define essencial variables to maintain the context of the ZMQ conection
+ * during all module phases and nginx requests
+ */
+typedef struct {
+    ngx_log_t *log;           /**< Pointer to the logger */
+    ngx_int_t iothreads;      /**< Number of threads to create */
+    void *zmq_context;        /**< The ZMQ Context Initiator */
+    void *zmq_socket;         /**< The ZMQ Socket to use */
+    int     ccreated;         /**< Was the context created? */
+    int  screated;            /**< Was the socket created? */
+    ngx_uint_t state;                 /**< ngx_log_zmq_state_e */
+    ngx_msec_t backoff;               /**< Wait before the next setup, 0 after a success */
+    ngx_event_t retry;                /**< Timer ending the backoff */
+    ngx_http_log_zmq_stats_t *stats;  /**< Shared counters, NULL if there is no zone */
+    ngx_http_log_zmq_batch_t *batch;  /**< Batch being filled by this worker */
+    ngx_event_t flush;                /**< Timer to flush an incomplete batch */
+    ngx_queue_t batches;              /**< Batches posted to the thread pool and not done */
+    ngx_http_log_zmq_bucket_t *bucket;       /**< Bucket used by the rate limit */
+    ngx_http_log_zmq_bucket_t local_bucket;  /**< Bucket of this worker */
+    ngx_uint_t suppressed;            /**< Messages suppressed since the last summary */
+    ngx_event_t summary;              /**< Timer to send the suppressed summary */
+    u_char *envelope;                 /**< Envelope frame of this worker */
+    size_t envelope_len;              /**< Envelope frame length */
+    uint64_t sequence;                /**< Last sequence number sent by this worker */
+    void *zstd_cctx;                  /**< Compression context of this worker */
+    ngx_atomic_t queued_bytes;        /**< Bytes of this worker given to ZMQ and not freed yet */
+    void *zstd_cdict;                 /**< Digested dictionary of this worker */
+    ngx_array_t *zstd_cctxs;          /**< Compression contexts free for the batches */
+    u_char *zstd_buf;                 /**< Compression buffer of this worker */
+    size_t zstd_size;                 /**< Compression buffer size */
+    ngx_http_log_zmq_trie_t *subscriptions; /**< Live subscriptions of the XPUB socket */
+    ngx_uint_t sample;                /**< Adaptive sample rate of this worker, in LOG_ZMQ_CONTROL_SCALE parts */
+    ngx_msec_t sample_adjusted;       /**< Last change of the adaptive sample rate */
+    ngx_atomic_t pressure;            /**< Was a message refused or a send failed since the last change? */
+    ngx_uint_t blocked;               /**< Why the watched socket can not take messages, 0 if it can */
+    ngx_connection_t *watch;          /**< Event loop connection of the socket ZMQ_FD */
+    void *monitor;                    /**< Monitor socket of the connection events */
+    ngx_connection_t *monitor_watch;  /**< Event loop connection of the monitor ZMQ_FD */
+} ngx_http_log_zmq_ctx_t;
+
+/**
+ * @brief element log configuration
+ *
+ * The definition itself doesn't depend on the http or stream modules, the
+ * compiled scripts are kept as plain arrays and run by each module.
+ *
+ * @note nginx has a ngx flag type, we should change sset/fset/eset to that type
+ */
+typedef struct {
+    ngx_log_zmq_server_t   *server;              /**< Configuration server */
+    ngx_int_t               iothreads;           /**< Configuration number of threads */
+    ngx_int_t               qlen;                /**< Configuration queue length */
+    ngx_array_t            *sockopts;            /**< Socket options, NULL if there is none */
+    size_t                  max_queue_bytes;     /**< Bytes queued in ZMQ by the definition, 0 for no limit */
+    size_t                  worker_max_queue_bytes; /**< Bytes queued in ZMQ by all definitions of a worker */
+    ngx_uint_t              io_set;              /**< Was log_zmq_io_threads set? */
+    ngx_array_t            *io_cpus;             /**< CPUs of the I/O threads, NULL for the ones without workers */
+    ngx_int_t               io_policy;           /**< Scheduling policy of the I/O threads, -1 to keep it */
+    ngx_int_t               io_priority;         /**< Priority of the I/O threads, -1 to keep it */
+    ngx_array_t            *data_lengths;        /**< Data length after format and compiling */
+    ngx_array_t            *data_values;         /**< Data values */
+    ngx_array_t            *endpoint_lengths;    /**< Endpoint length after format and compiling */
+    ngx_array_t            *endpoint_values;     /**< Endpoint values */
+    ngx_array_t            *flushes;             /**< Indexes of the variables used by format and endpoint */
+    ngx_cycle_t            *cycle;               /**< Current configuration cycle */
+    ngx_http_log_zmq_ctx_t *ctx;                 /**< Current module context */
+    ngx_str_t              *name;                /**< Configuration name */
+    ngx_log_t              *log;                 /**< Pointer to the logger */
+    ngx_uint_t              sset;                /**< Was the server setted? */
+    ngx_uint_t              fset;                /**< Was the format setted? */
+    ngx_uint_t              eset;                /**< Was the endpoint setted? */
+    ngx_uint_t              off;                 /**< Is this element deactivated? */
+    void                   *thread_pool;         /**< Thread pool used to encode batches */
+    ngx_uint_t              batch;               /**< Number of messages per batch */
+    ngx_msec_t              flush;               /**< Time to wait for a full batch */
+    ngx_uint_t              rate;                /**< Rate limit, in messages per second */
+    ngx_uint_t              burst;               /**< Rate limit burst, in messages */
+    ngx_uint_t              rate_global;         /**< Is the bucket shared by all workers? */
+    ngx_msec_t              rate_summary;        /**< Interval of the suppressed summary */
+    ngx_msec_t              sample_interval;     /**< Adaptive sample rate interval, 0 for a fixed rate */
+    ngx_uint_t              sample_min;          /**< Lowest adaptive sample rate */
+    ngx_uint_t              sample_step;         /**< Adaptive sample rate increase after each quiet interval */
+    ngx_uint_t              sample_watermark;    /**< Queued bytes seen as backpressure, in percent of the limit */
+    ngx_int_t               priority;            /**< Variable index of the message priority */
+    ngx_uint_t              priority_low;        /**< Part of the byte limits for low priority messages, in percent, 0 without priorities */
+    ngx_uint_t              writable;            /**< Skip the messages while the socket can not take them? */
+    ngx_uint_t              envelope;            /**< Send an envelope frame with each message? */
+    ngx_uint_t              subscriptions;       /**< Use a XPUB socket and skip the topics nobody wants? */
+    size_t                  max_message_size;    /**< Endpoint and format size limit, 0 for no limit */
+    ngx_uint_t              ncaps;               /**< Variables with a length cap */
+    ngx_int_t               caps[ZMQ_NGINX_CAPS];     /**< Variable indexes of the caps */
+    size_t                  cap_lens[ZMQ_NGINX_CAPS]; /**< Length caps */
+    ngx_http_log_zmq_agg_t *aggregate;           /**< Aggregation, NULL to send each request */
+    ngx_http_log_zmq_sketch_t *sketch;           /**< Sketches, NULL if there are none */
+    ngx_http_log_zmq_topics_t *topics;           /**< Binary topic ids, NULL for the plain topics */
+    ngx_uint_t              ndict;               /**< Fields encoded with a batch dictionary */
+    ngx_int_t               dict[ZMQ_NGINX_BATCH_FIELDS];       /**< Variable indexes of the fields */
+    ngx_str_t               dict_names[ZMQ_NGINX_BATCH_FIELDS]; /**< Variable names of the fields */
+    ngx_str_t               dict_topic;          /**< Topic of the encoded batches */
+    ngx_uint_t              arrow;               /**< Are the fields encoded as Arrow columns? */
+    u_char                  arrow_types[ZMQ_NGINX_BATCH_FIELDS]; /**< ngx_log_zmq_arrow_type_e of the columns */
+    ngx_str_t               arrow_schema;        /**< Arrow schema message, the same for all batches */
+    ngx_uint_t              compress;            /**< Compress each message with zstd? */
+    int                     compress_level;      /**< zstd compression level */
+    ngx_str_t               compress_dict;       /**< zstd dictionary, loaded with the configuration */
+    uint32_t                compress_dict_id;    /**< Id of the zstd dictionary */
+} ngx_http_log_zmq_element_conf_t;
+
+#if (NGX_THREADS)
+
+/**
+ * @brief message waiting in a batch
+ */
+typedef struct {
+    ngx_str_t               endpoint;            /**< Endpoint copied to the batch pool */
+    ngx_str_t               data;                /**< Data copied to the batch pool */
+    ngx_str_t              *fields;              /**< Dictionary fields copied to the batch pool */
+} ngx_http_log_zmq_batch_msg_t;
+
+/**
+ * @brief batch of messages handed to a thread pool
+ *
+ * The thread builds the final ZMQ messages, the completion handler runs in
+ * the worker and sends them. Everything is allocated from the batch pool.
+ */
+struct ngx_http_log_zmq_batch_s {
+    ngx_pool_t                      *pool;       /**< Pool owned by this batch */
+    ngx_thread_task_t               *task;       /**< Task posted to the thread pool */
+    ngx_http_log_zmq_element_conf_t *element;    /**< Definition of this batch */
+    ngx_array_t                      messages;   /**< ngx_http_log_zmq_batch_msg_t */
+    zmq_msg_t                       *output;     /**< Messages built by the thread */
+    ngx_uint_t                       noutput;    /**< Number of messages built */
+    ngx_uint_t                       declined;   /**< Messages refused by log_zmq_max_queue_bytes */
+    uint64_t                         usec;       /**< Time spent in the thread, in microseconds */
+    ngx_queue_t                      queue;      /**< Link in the posted batches of the definition */
+    uint32_t                        *refs;       /**< Dictionary references of each message */
+    uint32_t                        *table;      /**< Dictionary hash, string number + 1 */
+    ngx_uint_t                       mask;       /**< Dictionary hash size - 1 */
+    ngx_str_t                      **strings;    /**< Dictionary strings */
+    ngx_uint_t                       nstrings;   /**< Number of strings */
+    void                            *zstd_cctx;  /**< Compression context lent to the thread */
+    u_char                          *zstd_buf;   /**< Buffer for the biggest compressed message */
+    size_t                           zstd_size;  /**< Buffer size */
+};
+
+#endif
+
+extern ngx_str_t log_zmq_stat_names[];
+extern ngx_str_t log_zmq_timing_names[];
+extern ngx_http_log_zmq_timing_t *log_zmq_timing;
+
+ngx_uint_t log_zmq_histogram_bucket(uint64_t v);
+
+/**
+ * @brief start timing, if log_zmq_timing is on
+ *
+ * @param t A uint64_t pointer to the start time, in nanoseconds
+ */
+static ngx_inline void
+log_zmq_timing_start(uint64_t *t)
+{
+    struct timespec  ts;
+
+    if (log_zmq_timing) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        *t = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+}
+
+/**
+ * @brief record the time of a stage and start the next one
+ *
+ * @param stage A ngx_log_zmq_timing_e stage
+ * @param t A uint64_t pointer to the start time, updated to now
+ */
+static ngx_inline void
+log_zmq_timing_mark(ngx_uint_t stage, uint64_t *t)
+{
+    struct timespec  ts;
+    uint64_t         now;
+
+    if (log_zmq_timing) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        log_zmq_timing->buckets[stage][log_zmq_histogram_bucket(now - *t)]++;
+        *t = now;
+    }
+}
+
+/**
+ * @brief add to a definition counter
+ *
+ * @param ctx A ngx_http_log_zmq_ctx_t pointer of the definition
+ * @param stat A ngx_log_zmq_stat_e counter
+ * @param n The value to add (it can be negative for gauges)
+ */
+static ngx_inline void
+log_zmq_stat_add(ngx_http_log_zmq_ctx_t *ctx, ngx_uint_t stat, ngx_atomic_int_t n)
+{
+    if (ctx->stats) {
+        (void) ngx_atomic_fetch_add(&ctx->stats->counters[stat], n);
+    }
+}
+
 int zmq_init_ctx(ngx_http_log_zmq_ctx_t *ctx);
 void zmq_term_ctx(ngx_http_log_zmq_ctx_t *ctx);
 int zmq_create_ctx(ngx_http_log_zmq_element_conf_t *cf);
 int zmq_create_socket(ngx_pool_t *pool, ngx_http_log_zmq_element_conf_t *cf);
 ngx_int_t log_zmq_serialize(ngx_pool_t *pool, ngx_str_t *endpoint, ngx_str_t *payload, ngx_str_t *output);
+ngx_int_t log_zmq_send(ngx_http_log_zmq_element_conf_t *cf, ngx_pool_t *pool, ngx_log_t *log,
+                       ngx_str_t *endpoint, ngx_str_t *data);
+ngx_int_t log_zmq_send_fields(ngx_http_log_zmq_element_conf_t *cf, ngx_pool_t *pool, ngx_log_t *log,
+                              ngx_str_t *endpoint, ngx_str_t *data, ngx_str_t *fields);
+ngx_int_t log_zmq_rate_allow(ngx_http_log_zmq_element_conf_t *cf);
+ngx_uint_t log_zmq_sample_adapt(ngx_http_log_zmq_element_conf_t *cf);
+ngx_int_t log_zmq_priority_allow(ngx_http_log_zmq_element_conf_t *cf);
+ngx_int_t log_zmq_writable(ngx_http_log_zmq_element_conf_t *cf);
+void log_zmq_watch_stop(ngx_http_log_zmq_element_conf_t *cf);
+size_t log_zmq_truncate(u_char *p, size_t len, size_t max);
+#if (NGX_THREADS)
+size_t log_zmq_arrow_schema_size(ngx_str_t *names, ngx_uint_t n);
+u_char *log_zmq_arrow_schema(u_char *p, ngx_str_t *names, u_char *types, ngx_uint_t n);
+#endif
+ngx_int_t log_zmq_topic_id(ngx_http_log_zmq_element_conf_t *cf, ngx_pool_t *pool, ngx_log_t *log,
+                           ngx_str_t *endpoint);
+ngx_int_t log_zmq_subscribed(ngx_http_log_zmq_element_conf_t *cf, ngx_pool_t *pool, ngx_log_t *log,
+                             ngx_str_t *endpoint);
+ngx_int_t log_zmq_aggregate_add(ngx_http_log_zmq_element_conf_t *cf, ngx_str_t *key, off_t *values);
+void log_zmq_aggregate_exit(ngx_http_log_zmq_element_conf_t *cf);
+void log_zmq_sketch_exit(ngx_http_log_zmq_element_conf_t *cf);
+#if (NGX_HAVE_ZSTD)
+void log_zmq_zstd_exit(ngx_http_log_zmq_element_conf_t *cf);
+#endif
+ngx_int_t log_zmq_sketch_add(ngx_http_log_zmq_element_conf_t *cf, ngx_uint_t var, ngx_str_t *value);
+char *log_zmq_set_server(ngx_conf_t *cf, ngx_http_log_zmq_element_conf_t *lecf, ngx_str_t *value);
+char *log_zmq_set_socket_option(ngx_conf_t *cf, ngx_http_log_zmq_element_conf_t *lecf, ngx_str_t *value, ngx_uint_t n);
+char *log_zmq_set_io_threads(ngx_conf_t *cf, ngx_http_log_zmq_element_conf_t *lecf, ngx_str_t *value, ngx_uint_t n);
+#if (NGX_THREADS)
+void log_zmq_batch_exit(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log);
+#endif
+void log_zmq_definition_exit(ngx_http_log_zmq_element_conf_t *cf, ngx_log_t *log);
 
 #endif
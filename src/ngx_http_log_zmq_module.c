@@ -21,48 +21,63 @@
 
 #include "ngx_http_log_zmq_module.h"
 
-/**
- * @brief get default port for the input type of protocol
- *
- * This function is responsable to handle the request and log
- * the data we want to the log_zmq via zmq proccess.
- * It's important to note that if this function fails it should
- * not kill the nginx normal running. After all, this is the log
- * phase.
- *
- * @param kind A ngx_log_zmq_server_kind with the value TCP|IPC|INPROC
- * @return A in_port_t with an integer with the port
- * @note Should we move this to ngx_http_log_zmq.c ?
- */
-
-static in_port_t __get_default_port(const ngx_log_zmq_server_kind kind){
-    static const in_port_t DEFAULT_PORT = 0;
-
-    switch(kind){
-        case TCP:
-            return 5555;
-        case IPC:
-        case INPROC:
-            return 0;
-    }
-
-    return DEFAULT_PORT;
-}
-
 static void *ngx_http_log_zmq_create_main_conf(ngx_conf_t *cf);
 static char *ngx_http_log_zmq_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_log_zmq_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_log_zmq_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
+static void ngx_http_log_zmq_merge_override(ngx_http_log_zmq_loc_conf_t *prev, ngx_http_log_zmq_loc_element_conf_t *lelcf);
 
 static char *ngx_http_log_zmq_set_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_log_zmq_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_log_zmq_set_endpoint(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_log_zmq_set_off(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_override(ngx_conf_t *cf, ngx_http_log_zmq_loc_conf_t *llcf, ngx_uint_t format);
+static char *ngx_http_log_zmq_set_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_control(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_rate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_adaptive_sample(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_priority(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_socket_option(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_io_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_max_queue_bytes(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_envelope(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_subscriptions(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_writable(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_max_message_size(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_topic_ids(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_aggregate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_sketch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_dictionary(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_arrow(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_log_zmq_set_compress(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static ngx_int_t ngx_http_log_zmq_init_stats_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_log_zmq_status_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_log_zmq_control_handler(ngx_http_request_t *r);
+static void ngx_http_log_zmq_control_flag(ngx_http_log_zmq_control_t *ctl, ngx_uint_t flag, ngx_uint_t on);
+static uint64_t ngx_http_log_zmq_bucket_value(ngx_uint_t b);
+static ngx_int_t ngx_http_log_zmq_handler_time_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_log_zmq_sample_rate_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 
 static ngx_http_log_zmq_element_conf_t *ngx_http_log_zmq_create_definition(ngx_conf_t *cf, ngx_http_log_zmq_main_conf_t *bkmc, ngx_str_t *name);
 static ngx_http_log_zmq_loc_element_conf_t *ngx_http_log_zmq_create_location_element(ngx_conf_t *cf, ngx_http_log_zmq_loc_conf_t *llcf, ngx_str_t *name);
-
+static ngx_http_log_zmq_element_conf_t *ngx_http_log_zmq_find_definition(ngx_http_log_zmq_main_conf_t *bkmc, ngx_str_t *name);
+
+static u_char *ngx_http_log_zmq_script_run(ngx_http_request_t *r, ngx_pool_t *pool, ngx_str_t *value, void *code_lengths, void *code_values, size_t max);
+static ngx_int_t ngx_http_log_zmq_render(ngx_http_request_t *r, ngx_pool_t *pool, ngx_http_log_zmq_element_conf_t *lecf,
+    ngx_http_log_zmq_loc_element_conf_t *lelcf, ngx_str_t *endpoint, ngx_str_t *data, ngx_str_t *fields);
+static ngx_uint_t ngx_http_log_zmq_priority(ngx_http_request_t *r, ngx_http_log_zmq_element_conf_t *lecf);
+static void ngx_http_log_zmq_caps_cut(ngx_http_request_t *r, ngx_http_log_zmq_element_conf_t *lecf, size_t *saved);
+static void ngx_http_log_zmq_caps_restore(ngx_http_request_t *r, ngx_http_log_zmq_element_conf_t *lecf, size_t *saved);
+static void ngx_http_log_zmq_scratch_reset(ngx_http_log_zmq_main_conf_t *bkmc);
+static void ngx_http_log_zmq_aggregate(ngx_http_request_t *r, ngx_pool_t *pool, ngx_http_log_zmq_element_conf_t *lecf);
+static off_t ngx_http_log_zmq_parse_usec(u_char *p, size_t len);
+static void ngx_http_log_zmq_sketch(ngx_http_request_t *r, ngx_http_log_zmq_element_conf_t *lecf);
+
+static ngx_int_t ngx_http_log_zmq_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_log_zmq_postconf(ngx_conf_t *cf);
+static void ngx_http_log_zmq_exit_process(ngx_cycle_t *cycle);
 static void ngx_http_log_zmq_exitmaster(ngx_cycle_t *cycle);
 
 static ngx_command_t  ngx_http_log_zmq_commands[] = {
@@ -75,14 +90,14 @@ static ngx_command_t  ngx_http_log_zmq_commands[] = {
       NULL },
 
     { ngx_string("log_zmq_format"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
       ngx_http_log_zmq_set_format,
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
 
     { ngx_string("log_zmq_endpoint"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
       ngx_http_log_zmq_set_endpoint,
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
@@ -93,11 +108,169 @@ static ngx_command_t  ngx_http_log_zmq_commands[] = {
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
+
+    { ngx_string("log_zmq_thread_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE234,
+      ngx_http_log_zmq_set_thread_pool,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_rate"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_log_zmq_set_rate,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_adaptive_sample"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_log_zmq_set_adaptive_sample,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_priority"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE23,
+      ngx_http_log_zmq_set_priority,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_socket_option"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_log_zmq_set_socket_option,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_io_threads"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_log_zmq_set_io_threads,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_max_queue_bytes"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_log_zmq_set_max_queue_bytes,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_max_message_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_log_zmq_set_max_message_size,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_envelope"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_log_zmq_set_envelope,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_subscriptions"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_log_zmq_set_subscriptions,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_writable"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_log_zmq_set_writable,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_topic_ids"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE123,
+      ngx_http_log_zmq_set_topic_ids,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_aggregate"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_log_zmq_set_aggregate,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_histogram"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_log_zmq_set_aggregate,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_sketch"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_log_zmq_set_sketch,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_dictionary"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_log_zmq_set_dictionary,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_arrow"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_log_zmq_set_arrow,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_compress"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE234,
+      ngx_http_log_zmq_set_compress,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_timing"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_log_zmq_main_conf_t, timing),
+      NULL },
+
+    { ngx_string("log_zmq_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_log_zmq_set_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_control"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_log_zmq_set_control,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
     ngx_null_command
 };
 
+static ngx_http_variable_t  ngx_http_log_zmq_vars[] = {
+
+    { ngx_string("log_zmq_handler_time"), NULL, ngx_http_log_zmq_handler_time_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("log_zmq_sample_rate"), NULL, ngx_http_log_zmq_sample_rate_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
 static ngx_http_module_t  ngx_http_log_zmq_module_ctx = {
-    NULL,                                /* preconfiguration */
+    ngx_http_log_zmq_add_variables,      /* preconfiguration */
     ngx_http_log_zmq_postconf,           /* postconfiguration */
     ngx_http_log_zmq_create_main_conf,   /* create main configuration */
     ngx_http_log_zmq_init_main_conf,     /* init main configuration */
@@ -119,11 +292,291 @@ ngx_module_t  ngx_http_log_zmq_module = {
     NULL,                                /* init process */
     NULL,                                /* init thread */
     NULL,                                /* exit thread */
-    NULL,                                /* exit process */
+    ngx_http_log_zmq_exit_process,       /* exit process */
     ngx_http_log_zmq_exitmaster,         /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
+/**
+ * @brief run a compiled format or endpoint
+ *
+ * This is ngx_http_script_run without the flush of the non cacheable
+ * variables. The handler flushes the variables used by all definitions
+ * once, so each variable ($upstream_response_time, ...) is evaluated once
+ * per request and every definition reads the same value.
+ *
+ * @param r A ngx_http_request_t that represents the current request
+ * @param pool A ngx_pool_t pointer where the result is allocated
+ * @param value A ngx_str_t pointer to the result
+ * @param code_lengths The compiled lengths
+ * @param code_values The compiled values
+ * @param max The result size limit, 0 for no limit
+ * @return A u_char pointer to the end of the result or NULL on error (or
+ *         over the limit, then value->len is the size and nothing is allocated)
+ */
+static u_char *
+ngx_http_log_zmq_script_run(ngx_http_request_t *r, ngx_pool_t *pool, ngx_str_t *value, void *code_lengths, void *code_values,
+    size_t max)
+{
+    size_t                        len;
+    ngx_http_script_code_pt       code;
+    ngx_http_script_len_code_pt   lcode;
+    ngx_http_script_engine_t      e;
+
+    ngx_memzero(&e, sizeof(ngx_http_script_engine_t));
+
+    e.ip = code_lengths;
+    e.request = r;
+    e.flushed = 1;
+
+    len = 0;
+
+    while (*(uintptr_t *) e.ip) {
+        lcode = *(ngx_http_script_len_code_pt *) e.ip;
+        len += lcode(&e);
+    }
+
+    value->len = len;
+
+    if (max && len > max) {
+        value->data = NULL;
+        return NULL;
+    }
+
+    value->data = ngx_pnalloc(pool, len);
+    if (value->data == NULL) {
+        return NULL;
+    }
+
+    e.ip = code_values;
+    e.pos = value->data;
+
+    while (*(uintptr_t *) e.ip) {
+        code = *(ngx_http_script_code_pt *) e.ip;
+        code((ngx_http_script_engine_t *) &e);
+    }
+
+    return e.pos;
+}
+
+/**
+ * @brief priority of the message of a definition
+ *
+ * @param r A ngx_http_request_t that represents the current request
+ * @param lecf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @return A ngx_uint_t with 1 for a high priority message, 0 for a low one
+ */
+static ngx_uint_t
+ngx_http_log_zmq_priority(ngx_http_request_t *r, ngx_http_log_zmq_element_conf_t *lecf)
+{
+    ngx_http_variable_value_t  *vv;
+
+    vv = ngx_http_get_indexed_variable(r, lecf->priority);
+    if (NULL == vv || vv->not_found || 0 == vv->len) {
+        return 0;
+    }
+
+    return !(vv->len == 1 && vv->data[0] == '0');
+}
+
+/**
+ * @brief cut the capped variables of a definition
+ *
+ * The cut is done in the request variable itself, so the scripts see it,
+ * and the lengths are kept to put them back.
+ *
+ * @param r A ngx_http_request_t that represents the current request
+ * @param lecf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param saved A size_t array where the lengths are kept
+ */
+static void
+ngx_http_log_zmq_caps_cut(ngx_http_request_t *r, ngx_http_log_zmq_element_conf_t *lecf, size_t *saved)
+{
+    ngx_http_variable_value_t  *vv;
+    ngx_uint_t                  i;
+    size_t                      len;
+
+    for (i = 0; i < lecf->ncaps; i++) {
+        vv = ngx_http_get_indexed_variable(r, lecf->caps[i]);
+        if (NULL == vv || vv->not_found) {
+            continue;
+        }
+
+        saved[i] = vv->len;
+
+        len = log_zmq_truncate(vv->data, vv->len, lecf->cap_lens[i]);
+        if (len != vv->len) {
+            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "log_zmq: caps_cut(): \"%V\" %uz to %uz",
+                           lecf->name, (size_t) vv->len, len);
+            vv->len = len;
+            log_zmq_stat_add(lecf->ctx, LOG_ZMQ_STAT_TRUNCATED, 1);
+        }
+    }
+}
+
+/**
+ * @brief put back the capped variables of a definition
+ *
+ * In the reverse order, so a variable capped twice gets its first length.
+ *
+ * @param r A ngx_http_request_t that represents the current request
+ * @param lecf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param saved A size_t array with the lengths kept by ngx_http_log_zmq_caps_cut
+ */
+static void
+ngx_http_log_zmq_caps_restore(ngx_http_request_t *r, ngx_http_log_zmq_element_conf_t *lecf, size_t *saved)
+{
+    ngx_http_variable_value_t  *vv;
+    ngx_uint_t                  i;
+
+    for (i = lecf->ncaps; i-- > 0; /* void */) {
+        /* the variables are valid now, this only reads them */
+        vv = ngx_http_get_indexed_variable(r, lecf->caps[i]);
+        if (NULL == vv || vv->not_found) {
+            continue;
+        }
+
+        vv->len = saved[i];
+    }
+}
+
+/**
+ * @brief render the endpoint, the format and the dictionary fields of a message
+ *
+ * The endpoint comes first, so a definition with log_zmq_subscriptions
+ * only renders the format of the topics somebody wants. With
+ * log_zmq_max_message_size the format length is known before it is
+ * rendered, and an oversized message is dropped whole, not truncated,
+ * without allocating it.
+ *
+ * @param r A ngx_http_request_t that represents the current request
+ * @param pool A ngx_pool_t pointer where the message is rendered
+ * @param lecf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ * @param lelcf A ngx_http_log_zmq_loc_element_conf_t pointer to the location element
+ * @param endpoint A ngx_str_t pointer to the rendered endpoint
+ * @param data A ngx_str_t pointer to the rendered format
+ * @param fields A ngx_str_t array for the dictionary fields
+ * @return A ngx_int_t with NGX_OK | NGX_DECLINED (skipped) | NGX_ERROR
+ */
+static ngx_int_t
+ngx_http_log_zmq_render(ngx_http_request_t *r, ngx_pool_t *pool, ngx_http_log_zmq_element_conf_t *lecf,
+    ngx_http_log_zmq_loc_element_conf_t *lelcf, ngx_str_t *endpoint, ngx_str_t *data, ngx_str_t *fields)
+{
+    ngx_array_t                *data_lengths, *data_values;
+    ngx_array_t                *endpoint_lengths, *endpoint_values;
+    ngx_http_variable_value_t  *vv;
+    ngx_uint_t                  j;
+    size_t                      max;
+    uint64_t                    t;
+    ngx_log_t                  *log = r->connection->log;
+
+    /* a server or location can override the format and the endpoint */
+    if (lelcf->data_lengths) {
+        data_lengths = lelcf->data_lengths;
+        data_values = lelcf->data_values;
+    } else {
+        data_lengths = lecf->data_lengths;
+        data_values = lecf->data_values;
+    }
+
+    if (lelcf->endpoint_lengths) {
+        endpoint_lengths = lelcf->endpoint_lengths;
+        endpoint_values = lelcf->endpoint_values;
+    } else {
+        endpoint_lengths = lecf->endpoint_lengths;
+        endpoint_values = lecf->endpoint_values;
+    }
+
+    /* an Arrow definition only has columns, the batch has its own topic */
+    if (lecf->arrow) {
+        ngx_str_set(endpoint, "");
+        ngx_str_set(data, "");
+
+        if (lecf->subscriptions && NGX_OK != log_zmq_subscribed(lecf, pool, log, endpoint)) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: render(): no subscriber");
+            return NGX_DECLINED;
+        }
+
+        goto fields;
+    }
+
+    /* we set the data format... but we don't have any content to sent? */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: render(): checking format to log");
+    if (NULL == data_lengths) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: render(): no format to log");
+        return NGX_ERROR;
+    }
+
+    /* we set the endpoint... but we don't have any valid endpoint? */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: render(): checking endpoint to log");
+    if (NULL == endpoint_lengths) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: render(): no endpoint to log");
+        return NGX_ERROR;
+    }
+
+    t = 0;
+    log_zmq_timing_start(&t);
+
+    /* process all endpoint variables and write them back the the endpoint values */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: render(): script endpoint");
+    if (NULL == ngx_http_log_zmq_script_run(r, pool, endpoint, endpoint_lengths->elts, endpoint_values->elts, 0)) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: render(): error script endpoint");
+        return NGX_ERROR;
+    }
+
+    /* the id replaces the endpoint in the message and in the subscriptions */
+    if (lecf->topics && NGX_ERROR == log_zmq_topic_id(lecf, pool, log, endpoint)) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: render(): error creating topic ids");
+        return NGX_ERROR;
+    }
+
+    /* the endpoint is enough to know if a subscriber wants the message */
+    if (lecf->subscriptions && NGX_OK != log_zmq_subscribed(lecf, pool, log, endpoint)) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: render(): no subscriber");
+        return NGX_DECLINED;
+    }
+
+    /* the format gets what the endpoint left of the message size */
+    max = 0;
+    if (lecf->max_message_size) {
+        if (endpoint->len >= lecf->max_message_size) {
+            log_zmq_stat_add(lecf->ctx, LOG_ZMQ_STAT_OVERSIZED, 1);
+            return NGX_DECLINED;
+        }
+        max = lecf->max_message_size - endpoint->len;
+    }
+
+    /* process all data variables and write them back to the data values */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: render(): script data");
+    if (NULL == ngx_http_log_zmq_script_run(r, pool, data, data_lengths->elts, data_values->elts, max)) {
+        if (max && data->len > max) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: render(): \"%V\" oversized message, %uz bytes",
+                           lecf->name, endpoint->len + data->len);
+            log_zmq_stat_add(lecf->ctx, LOG_ZMQ_STAT_OVERSIZED, 1);
+            return NGX_DECLINED;
+        }
+        ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: render(): error script data");
+        return NGX_ERROR;
+    }
+
+    log_zmq_timing_mark(LOG_ZMQ_TIMING_SCRIPT, &t);
+
+fields:
+
+    /* the dictionary fields are kept apart, the batch replaces them by references */
+    for (j = 0; j < lecf->ndict; j++) {
+        vv = ngx_http_get_indexed_variable(r, lecf->dict[j]);
+        if (NULL == vv || vv->not_found) {
+            ngx_str_null(&fields[j]);
+        } else {
+            fields[j].data = vv->data;
+            fields[j].len = vv->len;
+        }
+    }
+
+    return NGX_OK;
+}
+
 /**
  * @brief nginx module's handler for logger phase
  *
@@ -140,18 +593,22 @@ ngx_module_t  ngx_http_log_zmq_module = {
 ngx_int_t
 ngx_http_log_zmq_handler(ngx_http_request_t *r)
 {
+    ngx_http_log_zmq_main_conf_t        *bkmc;
     ngx_http_log_zmq_loc_conf_t         *lccf;
     ngx_http_log_zmq_element_conf_t     *clecf;
     ngx_http_log_zmq_loc_element_conf_t *lelcf, *clelcf;
     ngx_uint_t                          i;
+    ngx_int_t                           rc;
     ngx_str_t                           data;
-    ngx_str_t                           zmq_data;
     ngx_str_t                           endpoint;
-    ngx_pool_t                          *pool = r->connection->pool;
+    ngx_str_t                           fields[ZMQ_NGINX_BATCH_FIELDS];
+    size_t                              saved[ZMQ_NGINX_CAPS];
+    ngx_http_log_zmq_control_t          *ctl;
+    ngx_http_log_zmq_request_ctx_t      *ctx;
+    ngx_uint_t                          flags, sample, high;
+    uint64_t                            start, t;
+    ngx_pool_t                          *pool;
     ngx_log_t                           *log = r->connection->log;
-    ngx_int_t (*serializer)(ngx_pool_t*, ngx_str_t*, ngx_str_t*, ngx_str_t*) = NULL;
-    zmq_msg_t query;
-    int rc;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler()");
 
@@ -164,6 +621,33 @@ ngx_http_log_zmq_handler(ngx_http_request_t *r)
         return NGX_OK;
     }
 
+    bkmc = ngx_http_get_module_main_conf(r, ngx_http_log_zmq_module);
+
+    /* messages are built in a worker scratch pool, not in the connection pool
+     * which lives as long as the keepalive connection */
+    if (NULL == bkmc->scratch) {
+        bkmc->scratch = ngx_create_pool(LOG_ZMQ_SCRATCH_SIZE, ngx_cycle->log);
+        if (NULL == bkmc->scratch) {
+            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: handler(): error creating scratch pool");
+            return NGX_OK;
+        }
+    }
+
+    /* only the handler is timed, not the timers or the stream module, and each
+     * worker writes the histograms in its own row of the counters zone */
+    if (bkmc->timing && bkmc->stats && bkmc->stats->timing && ngx_worker < bkmc->stats->timing_workers) {
+        log_zmq_timing = &bkmc->stats->timing[ngx_worker];
+    }
+
+    start = 0;
+    t = 0;
+    log_zmq_timing_start(&start);
+
+    /* evaluate the non cacheable variables again, but only once for all the definitions */
+    ngx_http_script_flush_no_cacheable_variables(r, bkmc->flushes);
+
+    pool = bkmc->scratch;
+
     /* location configuration has an ngx_array of log elements, we should iterate
      * by each one
      */
@@ -191,8 +675,13 @@ ngx_http_log_zmq_handler(ngx_http_request_t *r)
             continue;
         }
 
-        /* we only proceed if all the variables were setted: endpoint, server, format */
-        if (clecf->eset == 0 || clecf->fset == 0 || clecf->sset == 0) {
+        /* we only proceed if all the variables were setted: endpoint, server, format
+         * (an aggregated or Arrow definition only needs the server) */
+        if (clecf->sset == 0
+            || (NULL == clecf->aggregate && NULL == clecf->sketch && !clecf->arrow
+                && ((clecf->eset == 0 && NULL == clelcf->endpoint_lengths)
+                    || (clecf->fset == 0 && NULL == clelcf->data_lengths))))
+        {
             ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): eset=%d, fset=%d, sset=%d",
                                                        clecf->eset, clecf->fset, clecf->sset);
             continue;
@@ -215,105 +704,293 @@ ngx_http_log_zmq_handler(ngx_http_request_t *r)
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): server connection \"%V\"", clecf->server->connection);
         }
 
-        /* we set the data format... but we don't have any content to sent? */
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): checking format to log");
-        if (NULL == clecf->data_lengths) {
-            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: handler(): no format to log");
+        /* the runtime control, a single load when nothing is overridden */
+        ctl = clecf->ctx->stats ? &clecf->ctx->stats->control : NULL;
+        flags = ctl ? ctl->flags : 0;
+
+        if (flags & LOG_ZMQ_CONTROL_OFF) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): disabled at runtime");
             continue;
         }
 
-        /* we set the endpoint... but we don't have any valid endpoint? */
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): checking endpoint to log");
-        if (NULL == clecf->endpoint_lengths) {
-            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: handler(): no endpoint to log");
+        /* aggregated definitions only count the request, the worker sends the totals */
+        if (clecf->aggregate || clecf->sketch) {
+            if (clecf->aggregate) {
+                ngx_http_log_zmq_aggregate(r, pool, clecf);
+            }
+            if (clecf->sketch) {
+                ngx_http_log_zmq_sketch(r, clecf);
+            }
             continue;
         }
 
-        /* process all data variables and write them back to the data values */
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): script data");
-        if (NULL == ngx_http_script_run(r, &data, clecf->data_lengths->elts, 0, clecf->data_values->elts)) {
-            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: handler(): error script data");
+        /* the socket setup failed in this worker, skip the definition until the retry */
+        if (LOG_ZMQ_STATE_BACKOFF == clecf->ctx->state) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): not ready");
+            log_zmq_stat_add(clecf->ctx, LOG_ZMQ_STAT_NOT_READY, 1);
             continue;
         }
 
-        /* process all endpoint variables and write them back the the endpoint values */
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): script endpoint");
-        if (NULL == ngx_http_script_run(r, &endpoint, clecf->endpoint_lengths->elts, 0, clecf->endpoint_values->elts)) {
-            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: handler(): error script endpoint");
+        /* the watched socket can not take the message, do not build it */
+        if (clecf->writable && !log_zmq_writable(clecf)) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): not writable");
             continue;
         }
 
-        /* yes, we must go on */
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): logging to server");
-
-        /* no data */
-        if (0 == data.len) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): no message to log");
-            continue;
+        /* the low priority messages leave room in the queues for the high ones */
+        high = 0;
+        if (clecf->priority_low) {
+            high = ngx_http_log_zmq_priority(r, clecf);
+            if (!high && !log_zmq_priority_allow(clecf)) {
+                ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): low priority dropped");
+                continue;
+            }
         }
 
-        /* serialize to the final message format */
-        serializer = &log_zmq_serialize;
+        /* sample and rate limit before doing any work for this message,
+         * the adaptive rate is a part of the runtime one and spares the
+         * high priority messages */
+        sample = (flags & LOG_ZMQ_CONTROL_SAMPLE) ? ctl->sample : LOG_ZMQ_CONTROL_SCALE;
+        if (clecf->sample_interval && sample && !high) {
+            sample = ngx_max(sample * log_zmq_sample_adapt(clecf) / LOG_ZMQ_CONTROL_SCALE, 1);
+        }
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): serializing message");
-        if (NGX_ERROR == (*serializer)(pool, &endpoint, &data, &zmq_data)) {
-            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: handler(): error serializing message");
-            ngx_pfree(pool, zmq_data.data);
+        if (sample < LOG_ZMQ_CONTROL_SCALE
+            && (ngx_uint_t) ngx_random() % LOG_ZMQ_CONTROL_SCALE >= sample)
+        {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): sampled out");
+            log_zmq_stat_add(clecf->ctx, LOG_ZMQ_STAT_SAMPLED_OUT, 1);
             continue;
         }
 
-        /* no context? we dont create any */
-        if (NULL == clecf->ctx) {
-            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: handler(): no context");
+        if ((clecf->rate || (flags & LOG_ZMQ_CONTROL_RATE)) && !log_zmq_rate_allow(clecf)) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): rate limited");
             continue;
         }
 
-        clecf->ctx->log = log;
+        /* $log_zmq_sample_rate is the rate of this definition */
+        bkmc->sample_rate = sample;
+        r->variables[bkmc->sample_index].valid = 0;
+        r->variables[bkmc->sample_index].not_found = 0;
 
-        rc = 1; /* we should have a rc = 0 after this call */
+        /* the capped variables are only cut while this message is rendered */
+        ngx_http_log_zmq_caps_cut(r, clecf, saved);
+        rc = ngx_http_log_zmq_render(r, pool, clecf, clelcf, &endpoint, &data, fields);
+        ngx_http_log_zmq_caps_restore(r, clecf, saved);
 
-        /* create zmq context if needed */
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): verify ZMQ context");
-        if ((NULL == clecf->ctx->zmq_context) && (0 == clecf->ctx->ccreated)) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): creating context");
-            rc = zmq_create_ctx(clecf);
-            if (rc != 0) {
-                ngx_log_error(NGX_LOG_INFO, log, 0, "log_zmq: handler(): error creating context");
-                continue;
-            }
+        if (NGX_OK != rc) {
+            continue;
         }
 
-        /* open zmq socket if needed */
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): verify ZMQ socket");
-        if (NULL == clecf->ctx->zmq_socket && 0 == clecf->ctx->screated) {
-            ngx_log_debug0(NGX_LOG_INFO, log, 0, "log_zmq: handler(): creating socket");
-            rc = zmq_create_socket(pool, clecf);
-            if (rc != 0) {
-                ngx_log_error(NGX_LOG_INFO, log, 0, "log_zmq: handler(): error creating socket");
-                continue;
-            }
-        }
+        /* yes, we must go on */
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): logging to server");
 
-        /* initialize zmq message */
-        zmq_msg_init_size(&query, zmq_data.len);
-
-        ngx_memcpy(zmq_msg_data(&query), zmq_data.data, zmq_data.len);
+        /* no data */
+        if (0 == data.len && !clecf->arrow) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): no message to log");
+            continue;
+        }
 
-        if (zmq_msg_send(&query, clecf->ctx->zmq_socket, 0) >= 0) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): message sent: %V", &zmq_data);
-        } else {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): message not sent: %V", &zmq_data);
+        if (NGX_OK != log_zmq_send_fields(clecf, pool, log, &endpoint, &data, clecf->ndict ? fields : NULL)) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "log_zmq: handler(): message not sent");
+            continue;
         }
+    }
 
-        /* free all for the next iteration */
-        zmq_msg_close(&query);
+    ngx_http_log_zmq_scratch_reset(bkmc);
 
-        ngx_pfree(pool, zmq_data.data);
+    /* the cached value of the last definition must not leak to access_log */
+    bkmc->sample_rate = 0;
+    r->variables[bkmc->sample_index].valid = 0;
+    r->variables[bkmc->sample_index].not_found = 1;
+
+    /* keep the handler time for $log_zmq_handler_time */
+    if (log_zmq_timing) {
+        t = start;
+        log_zmq_timing_mark(LOG_ZMQ_TIMING_HANDLER, &t);
+
+        ctx = ngx_palloc(r->pool, sizeof(ngx_http_log_zmq_request_ctx_t));
+        if (ctx) {
+            ctx->handler_time = t - start;
+            ngx_http_set_ctx(r, ctx, ngx_http_log_zmq_module);
+        }
+
+        log_zmq_timing = NULL;
     }
 
     return NGX_OK;
 }
 
+/**
+ * @brief reset the worker scratch pool after the log phase
+ *
+ * Before the reset we measure the small blocks in use and keep the high
+ * water mark of all workers. Allocations over the pool max (a page at most,
+ * whatever the pool size) are malloc'ed apart and their size is not kept,
+ * so we keep the most of them instead. The reset frees them.
+ *
+ * @param bkmc A ngx_http_log_zmq_main_conf_t pointer to the main configuration
+ */
+static void
+ngx_http_log_zmq_scratch_reset(ngx_http_log_zmq_main_conf_t *bkmc)
+{
+    ngx_pool_t        *p;
+    ngx_pool_large_t  *l;
+    ngx_atomic_uint_t  used, large, hwm;
+
+    used = 0;
+    large = 0;
+
+    for (p = bkmc->scratch; p; p = p->d.next) {
+        used += p->d.last - (u_char *) p;
+    }
+
+    for (l = bkmc->scratch->large; l; l = l->next) {
+        large++;
+    }
+
+    if (bkmc->stats) {
+        hwm = bkmc->stats->scratch_hwm;
+        while (used > hwm && !ngx_atomic_cmp_set(&bkmc->stats->scratch_hwm, hwm, used)) {
+            hwm = bkmc->stats->scratch_hwm;
+        }
+
+        hwm = bkmc->stats->scratch_large;
+        while (large > hwm && !ngx_atomic_cmp_set(&bkmc->stats->scratch_large, hwm, large)) {
+            hwm = bkmc->stats->scratch_large;
+        }
+    }
+
+    ngx_reset_pool(bkmc->scratch);
+}
+
+/**
+ * @brief parse a time in seconds into microseconds
+ *
+ * Times like $upstream_response_time can have one value for each upstream
+ * tried ("0.012, 0.340 : 0.020"), they are added up. Anything else than
+ * digits and points separates two values.
+ *
+ * @param p A u_char pointer to the value
+ * @param len The value length
+ * @return An off_t with the microseconds, -1 if there is no time
+ */
+static off_t
+ngx_http_log_zmq_parse_usec(u_char *p, size_t len)
+{
+    u_char     *last = p + len;
+    off_t       total, sec, usec, scale;
+    ngx_uint_t  found;
+
+    total = 0;
+    found = 0;
+
+    while (p < last) {
+
+        if (*p < '0' || *p > '9') {
+            p++;
+            continue;
+        }
+
+        sec = 0;
+        while (p < last && *p >= '0' && *p <= '9') {
+            sec = sec * 10 + (*p++ - '0');
+        }
+
+        usec = 0;
+        if (p < last && *p == '.') {
+            p++;
+            for (scale = 100000; p < last && *p >= '0' && *p <= '9'; p++, scale /= 10) {
+                usec += (*p - '0') * scale;
+            }
+        }
+
+        total += sec * 1000000 + usec;
+        found = 1;
+    }
+
+    return found ? total : -1;
+}
+
+/**
+ * @brief count the request in the aggregation of a definition
+ *
+ * The sums which are not numbers (like an empty $upstream_response_length)
+ * count as zero, the histogram values which are not times are not recorded.
+ *
+ * @param r A ngx_http_request_t pointer to the current request
+ * @param pool A ngx_pool_t pointer to the scratch pool
+ * @param lecf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ */
+static void
+ngx_http_log_zmq_aggregate(ngx_http_request_t *r, ngx_pool_t *pool, ngx_http_log_zmq_element_conf_t *lecf)
+{
+    ngx_http_log_zmq_agg_t    *agg = lecf->aggregate;
+    ngx_http_variable_value_t *vv;
+    ngx_str_t                  key;
+    off_t                      values[ZMQ_NGINX_AGGREGATE_SUMS];
+    off_t                      n;
+    ngx_uint_t                 j;
+
+    if (NULL == ngx_http_log_zmq_script_run(r, pool, &key, agg->key_lengths->elts, agg->key_values->elts, 0)) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "log_zmq: aggregate(): error script key");
+        return;
+    }
+
+    for (j = 0; j < agg->nsums; j++) {
+        values[j] = agg->histogram ? -1 : 0;
+
+        vv = ngx_http_get_indexed_variable(r, agg->sums[j]);
+        if (NULL == vv || vv->not_found || 0 == vv->len) {
+            continue;
+        }
+
+        if (agg->histogram) {
+            values[j] = ngx_http_log_zmq_parse_usec(vv->data, vv->len);
+            continue;
+        }
+
+        n = ngx_atoof(vv->data, vv->len);
+        if (n != NGX_ERROR) {
+            values[j] = n;
+        }
+    }
+
+    if (log_zmq_aggregate_add(lecf, &key, values) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "log_zmq: aggregate(): error adding \"%V\"", lecf->name);
+    }
+}
+
+/**
+ * @brief count the request in the sketches of a definition
+ *
+ * @param r A ngx_http_request_t pointer to the current request
+ * @param lecf A ngx_http_log_zmq_element_conf_t pointer to the log definition
+ */
+static void
+ngx_http_log_zmq_sketch(ngx_http_request_t *r, ngx_http_log_zmq_element_conf_t *lecf)
+{
+    ngx_http_log_zmq_sketch_t *sk = lecf->sketch;
+    ngx_http_variable_value_t *vv;
+    ngx_str_t                  value;
+    ngx_uint_t                 j;
+
+    for (j = 0; j < sk->nvars; j++) {
+        vv = ngx_http_get_indexed_variable(r, sk->vars[j].index);
+        if (NULL == vv || vv->not_found) {
+            continue;
+        }
+
+        value.data = vv->data;
+        value.len = vv->len;
+
+        if (log_zmq_sketch_add(lecf, j, &value) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "log_zmq: sketch(): error adding \"%V\"", lecf->name);
+            return;
+        }
+    }
+}
+
 /**
  * @brief nginx module's proccess to create main configuration
  *
@@ -337,6 +1014,7 @@ ngx_http_log_zmq_create_main_conf(ngx_conf_t *cf)
 
     bkmc->cycle = cf->cycle;
     bkmc->log = cf->log;
+    bkmc->timing = NGX_CONF_UNSET;
     bkmc->logs = ngx_array_create(cf->pool, 4, sizeof(ngx_http_log_zmq_element_conf_t));
     if (bkmc->logs == NULL) {
         ngx_log_error(NGX_LOG_INFO, cf->log, 0, "\"log_zmq\" error creating main definitions");
@@ -360,6 +1038,14 @@ ngx_http_log_zmq_create_main_conf(ngx_conf_t *cf)
 static char *
 ngx_http_log_zmq_init_main_conf(ngx_conf_t *cf, void *conf)
 {
+    ngx_http_log_zmq_main_conf_t    *bkmc = conf;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_core_conf_t                 *ccf;
+    ngx_str_t                        name = ngx_string(LOG_ZMQ_STATS_ZONE);
+    ngx_str_t                        sample = ngx_string("log_zmq_sample_rate");
+    ngx_uint_t                       i;
+    size_t                           size;
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: init_main_conf()");
 
     if (conf == NULL) {
@@ -367,6 +1053,47 @@ ngx_http_log_zmq_init_main_conf(ngx_conf_t *cf, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    ngx_conf_init_value(bkmc->timing, 0);
+
+    /* the handler sets $log_zmq_sample_rate again for each definition */
+    bkmc->sample_index = ngx_http_get_variable_index(cf, &sample);
+    if (bkmc->sample_index == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* the worker limit is checked by each definition */
+    if (bkmc->max_queue_bytes && bkmc->logs && bkmc->logs != NGX_CONF_UNSET_PTR) {
+        lecf = bkmc->logs->elts;
+        for (i = 0; i < bkmc->logs->nelts; i++) {
+            lecf[i].worker_max_queue_bytes = bkmc->max_queue_bytes;
+        }
+    }
+
+    /* all the definitions are known here, create the zone for their counters */
+    if (bkmc->logs && bkmc->logs != NGX_CONF_UNSET_PTR && bkmc->logs->nelts > 0) {
+        if (bkmc->logs->nelts > LOG_ZMQ_STATS_SLOTS) {
+            ngx_log_error(NGX_LOG_WARN, cf->log, 0, "\"log_zmq\": only %d definitions have counters",
+                          LOG_ZMQ_STATS_SLOTS);
+        }
+
+        size = ngx_align(sizeof(ngx_http_log_zmq_stats_shm_t), ngx_pagesize) + 8 * ngx_pagesize;
+
+        /* one timing row per worker, "worker_processes" is unset here if it comes after "http" */
+        if (bkmc->timing) {
+            ccf = (ngx_core_conf_t *) ngx_get_conf(cf->cycle->conf_ctx, ngx_core_module);
+            bkmc->timing_workers = (ccf->worker_processes == NGX_CONF_UNSET) ? 1 : ccf->worker_processes;
+            size += ngx_align(bkmc->timing_workers * sizeof(ngx_http_log_zmq_timing_t), ngx_pagesize);
+        }
+
+        bkmc->stats_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_log_zmq_module);
+        if (bkmc->stats_zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        bkmc->stats_zone->init = ngx_http_log_zmq_init_stats_zone;
+        bkmc->stats_zone->data = bkmc;
+    }
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: init_main_conf(): return OK");
 
     return NGX_CONF_OK;
@@ -410,6 +1137,42 @@ ngx_http_log_zmq_create_loc_conf(ngx_conf_t *cf)
     return conf;
 }
 
+/**
+ * @brief inherit the format and endpoint overrides of a parent location
+ *
+ * @param prev A ngx_http_log_zmq_loc_conf_t pointer to the parent configuration
+ * @param lelcf A ngx_http_log_zmq_loc_element_conf_t pointer to the child element
+ */
+static void
+ngx_http_log_zmq_merge_override(ngx_http_log_zmq_loc_conf_t *prev, ngx_http_log_zmq_loc_element_conf_t *lelcf)
+{
+    ngx_http_log_zmq_loc_element_conf_t *plelcf;
+    ngx_uint_t                           i;
+
+    if (NULL == prev->logs || NGX_CONF_UNSET_PTR == prev->logs) {
+        return;
+    }
+
+    plelcf = prev->logs->elts;
+    for (i = 0; i < prev->logs->nelts; i++) {
+        if (plelcf[i].element != lelcf->element) {
+            continue;
+        }
+
+        if (NULL == lelcf->data_lengths) {
+            lelcf->data_lengths = plelcf[i].data_lengths;
+            lelcf->data_values = plelcf[i].data_values;
+        }
+
+        if (NULL == lelcf->endpoint_lengths) {
+            lelcf->endpoint_lengths = plelcf[i].endpoint_lengths;
+            lelcf->endpoint_values = plelcf[i].endpoint_values;
+        }
+
+        return;
+    }
+}
+
 /**
  * @brief nginx module's proccess to merge all location configuration
  *
@@ -470,6 +1233,13 @@ ngx_http_log_zmq_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         ngx_memzero(conf->logs->elts, conf->logs->size);
     }
 
+    /* the format and endpoint overrides of the parent apply to the elements
+     * of the child which don't have their own */
+    locelement = conf->logs->elts;
+    for (j = 0; j < conf->logs->nelts; j++) {
+        ngx_http_log_zmq_merge_override(prev, &locelement[j]);
+    }
+
     for (i = 0; i < prev->logs_definition->nelts; i++) {
         found = 0;
         locelement = conf->logs->elts;
@@ -486,9 +1256,13 @@ ngx_http_log_zmq_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         if (found == 0) {
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: merge_loc_conf(): \"%V\" not found", element[i].name);
             locelement = ngx_array_push(conf->logs);
+            if (NULL == locelement) {
+                return NGX_CONF_ERROR;
+            }
             ngx_memzero(locelement, sizeof(ngx_http_log_zmq_loc_element_conf_t));
             locelement->off = 0;
             locelement->element = element + i;
+            ngx_http_log_zmq_merge_override(prev, locelement);
         }
     }
 #if (NGX_DEBUG)
@@ -530,14 +1304,6 @@ ngx_http_log_zmq_set_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_log_zmq_element_conf_t     *lecf;
     ngx_http_log_zmq_loc_element_conf_t *lelcf;
     ngx_str_t                           *value;
-    const unsigned char                 *kind;
-    ngx_int_t                           iothreads;
-    ngx_int_t                           qlen;
-    ngx_url_t                           u;
-    ngx_log_zmq_server_t                *endpoint;
-    char                                *connection;
-    size_t                              connlen;
-    size_t                              zmq_hdlen;
 
     bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
 
@@ -582,139 +1348,10 @@ ngx_http_log_zmq_set_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    /* create ZMQ context structure */
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): create context");
-
-    lecf->ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_zmq_ctx_t));
-    if (NULL == lecf->ctx) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": error creating context \"%V\"", &value[1]);
-        return NGX_CONF_ERROR;
-    }
-
-    lecf->ctx->log = cf->cycle->log;
-
-    /* update definition name and cycle log*/
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): set definition name");
-
-    lecf->name = ngx_palloc(cf->pool, sizeof(ngx_str_t));
-    if (lecf->name == NULL) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": error setting name \"%V\"", &value[1]);
-        return NGX_CONF_ERROR;
-    }
-    lecf->name->data = ngx_palloc(cf->pool, value[1].len);
-    lecf->name->len = value[1].len;
-    ngx_memcpy(lecf->name->data, value[1].data, value[1].len);
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): initialize element \"%V\"", &value[1]);
-    lecf->log = cf->cycle->log;
-    lecf->off = 0;
-
-    /* set the type of protocol TCP|IPC|INPROC */
-    kind = value[3].data;
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): server kind \"%V\"", &value[3]);
-
-    endpoint = ngx_pcalloc(cf->pool, sizeof(ngx_log_zmq_server_t));
-
-    if (endpoint == NULL) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": error creating endpoint \"%V\"", &value[1]);
-        return NGX_CONF_ERROR;
-    }
-
-    if (0 == ngx_strcmp(kind, ZMQ_TCP_KEY)) {
-        endpoint->kind = TCP;
-    } else if (0 == ngx_strcmp(kind, ZMQ_IPC_KEY)) {
-        endpoint->kind = IPC;
-    } else if (0 == ngx_strcmp(kind, ZMQ_INPROC_KEY)) {
-        endpoint->kind = INPROC;
-    } else {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": invalid ZMQ connection type: %s \"%V\"", kind, &value[1]);
-        return NGX_CONF_ERROR;
-    }
-
-    /* set the number of threads associated with this context */
-    iothreads = ngx_atoi(value[4].data, value[4].len);
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): iothreads \"%V\"", &value[4]);
-
-    if (iothreads == NGX_ERROR || iothreads <= 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": invalid I/O threads %d \"%V\"", iothreads, &value[1]);
-        return NGX_CONF_ERROR;
-    }
-
-    lecf->iothreads = iothreads;
-
-    /* set the queue size associated with this context */
-    qlen = ngx_atoi(value[5].data, value[5].len);
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): queue length \"%V\"", &value[5]);
-
-    if (qlen == NGX_ERROR || qlen < 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": invalid queue size %d \"%V\"", qlen, &value[1]);
-    }
-
-    lecf->qlen = qlen;
-
-    /* if the protocol used is TCP, parse it and use nginx parse_url to validate the input */
-    if (endpoint->kind == TCP) {
-        u.url = value[2];
-        u.default_port = __get_default_port(endpoint->kind);
-        u.no_resolve = 0;
-        u.listen = 1;
-
-        if(ngx_parse_url(cf->pool, &u) != NGX_OK) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": invalid server: %s \"%V\"", u.err, &value[1]);
-            return NGX_CONF_ERROR;
-        }
-        endpoint->peer_addr = u.addrs[0];
-    } else {
-        u.url = value[2];
-    }
-
-    /* create a connection based on the protocol type */
-    switch (endpoint->kind) {
-        case TCP:
-            zmq_hdlen = ZMQ_TCP_HLEN;
-            connlen = u.url.len + zmq_hdlen;
-            connection = (char *) ngx_pcalloc(cf->pool, connlen + 1);
-            ngx_memcpy(connection, ZMQ_TCP_HANDLER, zmq_hdlen);
-            ngx_memcpy(&connection[zmq_hdlen], u.url.data, u.url.len);
-            break;
-        case IPC:
-            zmq_hdlen = ZMQ_IPC_HLEN;
-            connlen = u.url.len + zmq_hdlen;
-            connection = (char *) ngx_pcalloc(cf->pool, connlen + 1);
-            ngx_memcpy(connection, ZMQ_IPC_HANDLER, zmq_hdlen);
-            ngx_memcpy(&connection[zmq_hdlen], u.url.data, u.url.len);
-            break;
-        case INPROC:
-            zmq_hdlen = ZMQ_INPROC_HLEN;
-            connlen = u.url.len + zmq_hdlen;
-            connection = (char *) ngx_pcalloc(cf->pool, connlen + 1);
-            ngx_memcpy(connection, ZMQ_INPROC_HANDLER, zmq_hdlen);
-            ngx_memcpy(&connection[zmq_hdlen], u.url.data, u.url.len);
-            break;
-        default:
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": invalid endpoint type \"%V\"", &value[1]);
-            return NGX_CONF_ERROR;
-    }
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server(): connection %s", connection);
-
-    if (NULL == connection) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": error creating connection \"%V\"", &value[1]);
+    if (log_zmq_set_server(cf, lecf, value) != NGX_CONF_OK) {
         return NGX_CONF_ERROR;
     }
 
-    /* create the final connection endpoint to be used on socket connection */
-    endpoint->connection = ngx_palloc(cf->pool, sizeof(ngx_str_t));
-    endpoint->connection->data = ngx_palloc(cf->pool, connlen);
-    endpoint->connection->len = connlen;
-    ngx_memcpy(endpoint->connection->data, connection, connlen);
-    lecf->server = endpoint;
-
-    /* set the server as done */
-    lecf->sset = 1;
-
     /* by default, the configuration for this location is unmuted */
     lelcf->element = (ngx_http_log_zmq_element_conf_t *) lecf;
     lelcf->off = 0;
@@ -722,8 +1359,6 @@ ngx_http_log_zmq_set_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     /* by default, the configuration is unmuted */
     llcf->off = 0;
 
-    ngx_pfree(cf->pool, connection);
-
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_server() return OK \"%V\"", &value[1]);
 
     return NGX_CONF_OK;
@@ -759,9 +1394,9 @@ ngx_http_log_zmq_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
 
+    /* in a server or a location, it only overrides the format of a definition */
     if (cf->cmd_type != NGX_HTTP_MAIN_CONF) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "the \"log_zmq_format\" directive can only be used in \"http\" context");
-        return NGX_CONF_ERROR;
+        return ngx_http_log_zmq_set_override(cf, llcf, 1);
     }
 
     if (bkmc == NULL) {
@@ -837,6 +1472,7 @@ ngx_http_log_zmq_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
     sc.cf = cf;
     sc.source = log_format;
+    sc.flushes = &(lecf->flushes);
     sc.lengths = &(lecf->data_lengths);
     sc.values = &(lecf->data_values);
     sc.variables = ngx_http_script_variables_count(log_format);
@@ -895,9 +1531,9 @@ ngx_http_log_zmq_set_endpoint(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
 
+    /* in a server or a location, it only overrides the endpoint of a definition */
     if (cf->cmd_type != NGX_HTTP_MAIN_CONF) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "the \"log_zmq_endpoint\" directive can only used in \"http\" context");
-        return NGX_CONF_ERROR;
+        return ngx_http_log_zmq_set_override(cf, llcf, 0);
     }
 
     if (bkmc == NULL) {
@@ -950,6 +1586,7 @@ ngx_http_log_zmq_set_endpoint(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
     sc.cf = cf;
     sc.source = &value[2];
+    sc.flushes = &(lecf->flushes);
     sc.lengths = &(lecf->endpoint_lengths);
     sc.values = &(lecf->endpoint_values);
     sc.variables = ngx_http_script_variables_count(&value[2]);
@@ -975,6 +1612,105 @@ ngx_http_log_zmq_set_endpoint(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     return NGX_CONF_OK;
 }
 
+/**
+ * @brief nginx module's set format or endpoint of a server or location
+ *
+ * The definition keeps its server and socket, only the format or the
+ * endpoint change for this server or location (and the ones inside it).
+ *
+ * @code{.conf}
+ * location /static/ {
+ *     log_zmq_format definition '{"uri":"$uri","status":$status}';
+ *     log_zmq_endpoint definition "/static/";
+ * }
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param llcf A ngx_http_log_zmq_loc_conf_t pointer to the server or location configuration
+ * @param format Is it the format (1) or the endpoint (0)?
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_override(ngx_conf_t *cf, ngx_http_log_zmq_loc_conf_t *llcf, ngx_uint_t format)
+{
+    ngx_http_log_zmq_main_conf_t        *bkmc;
+    ngx_http_log_zmq_element_conf_t     *lecf;
+    ngx_http_log_zmq_loc_element_conf_t *lelcf;
+    ngx_http_script_compile_t            sc;
+    ngx_str_t                           *value, source;
+    ngx_array_t                        **lengths, **values;
+    ngx_uint_t                           i;
+    u_char                              *p;
+    const char                          *name;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+    name = format ? "log_zmq_format" : "log_zmq_endpoint";
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2..] format or endpoint
+     */
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%s\": \"%V\" definition not found", name, &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    lelcf = ngx_http_log_zmq_create_location_element(cf, llcf, &value[1]);
+    if (NULL == lelcf) {
+        return NGX_CONF_ERROR;
+    }
+
+    lengths = format ? &lelcf->data_lengths : &lelcf->endpoint_lengths;
+    values = format ? &lelcf->data_values : &lelcf->endpoint_values;
+
+    if (*lengths) {
+        return "is duplicate";
+    }
+
+    /* like in http, the format can be split in several strings */
+    source.len = 0;
+    for (i = 2; i < cf->args->nelts; i++) {
+        source.len += value[i].len;
+    }
+
+    source.data = ngx_pnalloc(cf->pool, source.len + 1);
+    if (NULL == source.data) {
+        return NGX_CONF_ERROR;
+    }
+
+    p = source.data;
+    for (i = 2; i < cf->args->nelts; i++) {
+        p = ngx_cpymem(p, value[i].data, value[i].len);
+    }
+    *p = '\0';
+
+    /* the variables are flushed with the other ones of the definition */
+    ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
+    sc.cf = cf;
+    sc.source = &source;
+    sc.flushes = &(lecf->flushes);
+    sc.lengths = lengths;
+    sc.values = values;
+    sc.variables = ngx_http_script_variables_count(&source);
+    sc.complete_lengths = 1;
+    sc.complete_values = 1;
+
+    if (ngx_http_script_compile(&sc) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%s\": error compiling \"%V\"", name, &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    llcf->logs_definition = (ngx_array_t *) bkmc->logs;
+    lelcf->element = lecf;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_override(): %s \"%V\"", name, &value[1]);
+
+    return NGX_CONF_OK;
+}
+
 static char *
 ngx_http_log_zmq_set_off(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -1049,35 +1785,2496 @@ ngx_http_log_zmq_set_off(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 /**
- * @brief nginx module after the configuration was submited
+ * @brief nginx module's set thread pool
  *
- * In this phase of the module initiation we push our handler to the
- * core handler list to be proccessed each request
+ * Encode the messages of a definition in batches, in a nginx thread pool.
+ * The worker only copies the message, the thread builds the final ZMQ
+ * messages and the worker sends them when the thread is done.
+ *
+ * @code{.conf}
+ * log_zmq_thread_pool definition default batch=100 flush=100ms;
+ * @endcode
  *
  * @param cf A ngx_conf_t pointer to the main nginx configurion
- * @return A ngx_int_t which can be NGX_ERROR | NGX_OK
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
  */
-static ngx_int_t
-ngx_http_log_zmq_postconf(ngx_conf_t *cf)
+static char *
+ngx_http_log_zmq_set_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_core_main_conf_t *cmcf;
-    ngx_http_handler_pt       *h;
-
-    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+#if (NGX_THREADS)
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value, s;
+    ngx_int_t                        n;
+    ngx_uint_t                       i;
 
-    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
-    if (h == NULL) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->cycle->log, 0, "log_zmq: postconf(): error pushing handler");
-        return NGX_ERROR;
-    }
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
 
-    *h = ngx_http_log_zmq_handler;
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2] thread pool name
+     * value[3..] batch=<n> flush=<time>
+     */
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_thread_pool\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->thread_pool) {
+        return "is duplicate";
+    }
+
+    lecf->thread_pool = ngx_thread_pool_add(cf, &value[2]);
+    if (NULL == lecf->thread_pool) {
+        return NGX_CONF_ERROR;
+    }
+
+    lecf->batch = ZMQ_NGINX_BATCH;
+    lecf->flush = ZMQ_NGINX_BATCH_FLUSH;
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "batch=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR || n <= 0) {
+                goto invalid;
+            }
+            lecf->batch = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "flush=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n <= 0) {
+                goto invalid;
+            }
+            lecf->flush = (ngx_msec_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_thread_pool(): \"%V\" batch=%ui flush=%M",
+                   &value[1], lecf->batch, lecf->flush);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_thread_pool\": invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_thread_pool\" requires nginx built with --with-threads");
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+/**
+ * @brief nginx module's set rate
+ *
+ * Limit the messages of a definition with a token bucket, checked before
+ * any formatting. By default each worker has its own bucket, with "global"
+ * all workers share the bucket in the counters zone. The number of
+ * suppressed messages is sent every "summary" interval (0 disables it).
+ *
+ * @code{.conf}
+ * log_zmq_rate definition rate=50000/s burst=100000 global summary=1s;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_rate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value, s;
+    ngx_int_t                        n;
+    ngx_uint_t                       i;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2..] rate=<n>/s burst=<n> global summary=<time>
+     */
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_rate\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->rate) {
+        return "is duplicate";
+    }
+
+    lecf->burst = 0;
+    lecf->rate_summary = ZMQ_NGINX_RATE_SUMMARY;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+            if (value[i].len < 8 || ngx_strncmp(value[i].data + value[i].len - 2, "/s", 2) != 0) {
+                goto invalid;
+            }
+            n = ngx_atoi(value[i].data + 5, value[i].len - 7);
+            if (n == NGX_ERROR || n <= 0) {
+                goto invalid;
+            }
+            lecf->rate = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "burst=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR || n <= 0) {
+                goto invalid;
+            }
+            lecf->burst = n;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "global") == 0) {
+            lecf->rate_global = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "summary=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
+            lecf->rate_summary = (ngx_msec_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (0 == lecf->rate) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_rate\": no rate for \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* by default the burst is one second of messages */
+    if (0 == lecf->burst) {
+        lecf->burst = lecf->rate;
+    }
+
+    /* the shared bucket is set when the counters zone is initialized */
+    lecf->ctx->bucket = &lecf->ctx->local_bucket;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_rate(): \"%V\" rate=%ui burst=%ui global=%ui",
+                   &value[1], lecf->rate, lecf->burst, lecf->rate_global);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_rate\": invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/**
+ * @brief nginx module's set adaptive sample
+ *
+ * Lower the sample rate of a definition in each worker when the messages
+ * meet backpressure, and raise it again when the queues drain. The rate is
+ * halved, down to "min", after each "interval" with a refused message, a
+ * failed send or the queued bytes over "watermark" percent of
+ * log_zmq_max_queue_bytes, and grows by "step" after each quiet interval.
+ *
+ * @code{.conf}
+ * log_zmq_adaptive_sample definition min=0.01 step=0.05 watermark=50 interval=1s;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_adaptive_sample(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value, s;
+    ngx_int_t                        n;
+    ngx_uint_t                       i;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2..] min=<0..1> step=<0..1> watermark=<percent> interval=<time>
+     */
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_adaptive_sample\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->sample_interval) {
+        return "is duplicate";
+    }
+
+    lecf->sample_interval = ZMQ_NGINX_SAMPLE_INTERVAL;
+    lecf->sample_min = ZMQ_NGINX_SAMPLE_MIN;
+    lecf->sample_step = ZMQ_NGINX_SAMPLE_STEP;
+    lecf->sample_watermark = ZMQ_NGINX_SAMPLE_WATERMARK;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "min=", 4) == 0) {
+            n = ngx_atofp(value[i].data + 4, value[i].len - 4, 4);
+            if (n == NGX_ERROR || n <= 0 || n > LOG_ZMQ_CONTROL_SCALE) {
+                goto invalid;
+            }
+            lecf->sample_min = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "step=", 5) == 0) {
+            n = ngx_atofp(value[i].data + 5, value[i].len - 5, 4);
+            if (n == NGX_ERROR || n <= 0 || n > LOG_ZMQ_CONTROL_SCALE) {
+                goto invalid;
+            }
+            lecf->sample_step = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "watermark=", 10) == 0) {
+            n = ngx_atoi(value[i].data + 10, value[i].len - 10);
+            if (n == NGX_ERROR || n <= 0 || n > 100) {
+                goto invalid;
+            }
+            lecf->sample_watermark = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+            lecf->sample_interval = (ngx_msec_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "log_zmq: set_adaptive_sample(): \"%V\" min=%ui step=%ui watermark=%ui interval=%M",
+                   &value[1], lecf->sample_min, lecf->sample_step, lecf->sample_watermark, lecf->sample_interval);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_adaptive_sample\": invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/**
+ * @brief nginx module's set priority
+ *
+ * Give the messages of a definition a priority, from a variable: a message
+ * is high priority if the value is not empty and not "0", like the "if"
+ * of access_log. The low priority messages only get "low" percent of the
+ * log_zmq_max_queue_bytes limits, so when the queues fill they are dropped
+ * first and the rest is kept for the high priority ones.
+ *
+ * @code{.conf}
+ * map $status$slow $log_priority { ~^[45] 1; ~1$ 1; default 0; }
+ * log_zmq_priority definition $log_priority low=80;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_priority(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value, s;
+    ngx_int_t                        n, *index;
+    ngx_uint_t                       i;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2] variable
+     * value[3] low=<percent>
+     */
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_priority\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->priority_low) {
+        return "is duplicate";
+    }
+
+    i = 2;
+    if (value[i].len < 2 || value[i].data[0] != '$') {
+        goto invalid;
+    }
+
+    s.len = value[i].len - 1;
+    s.data = value[i].data + 1;
+
+    n = ngx_http_get_variable_index(cf, &s);
+    if (n == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* the priority is flushed with the other variables of the definition */
+    if (NULL == lecf->flushes) {
+        lecf->flushes = ngx_array_create(cf->pool, 4, sizeof(ngx_uint_t));
+        if (NULL == lecf->flushes) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    index = ngx_array_push(lecf->flushes);
+    if (NULL == index) {
+        return NGX_CONF_ERROR;
+    }
+    *index = n;
+
+    lecf->priority = n;
+    lecf->priority_low = ZMQ_NGINX_PRIORITY_LOW;
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "low=", 4) == 0) {
+            n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (n == NGX_ERROR || n <= 0 || n >= 100) {
+                goto invalid;
+            }
+            lecf->priority_low = n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_priority(): \"%V\" %V low=%ui",
+                   &value[1], &value[2], lecf->priority_low);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_priority\": invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/**
+ * @brief nginx module's set socket option
+ *
+ * Tune the socket of a definition, the options are applied when each
+ * worker creates the socket.
+ *
+ * @code{.conf}
+ * log_zmq_socket_option definition sndbuf=4m immediate=on reconnect_ivl=100ms reconnect_ivl_max=10s;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_socket_option(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_socket_option\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    return log_zmq_set_socket_option(cf, lecf, value, cf->args->nelts);
+}
+
+/**
+ * @brief nginx module's set io threads
+ *
+ * Bind the ZMQ I/O threads of a definition to some CPUs, by default the
+ * ones without workers, and set their scheduling policy and priority.
+ *
+ * @code{.conf}
+ * log_zmq_io_threads definition cpus=auto policy=fifo priority=10;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_io_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_io_threads\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    return log_zmq_set_io_threads(cf, lecf, value, cf->args->nelts);
+}
+
+/**
+ * @brief nginx module's set max queue bytes
+ *
+ * Limit the bytes given to ZMQ and not sent yet, for a definition or, with
+ * only the size, for all the definitions of a worker. A message over the
+ * limit is dropped and counted in queue_full.
+ *
+ * @code{.conf}
+ * log_zmq_max_queue_bytes 64m;
+ * log_zmq_max_queue_bytes definition 8m;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_max_queue_bytes(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value;
+    ssize_t                          size;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[cf->args->nelts - 1]);
+    if (size == NGX_ERROR || size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_max_queue_bytes\": invalid size \"%V\"",
+                           &value[cf->args->nelts - 1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 2) {
+        if (bkmc->max_queue_bytes) {
+            return "is duplicate";
+        }
+        bkmc->max_queue_bytes = size;
+        return NGX_CONF_OK;
+    }
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_max_queue_bytes\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->max_queue_bytes) {
+        return "is duplicate";
+    }
+
+    lecf->max_queue_bytes = size;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_max_queue_bytes(): \"%V\" %uz",
+                   &value[1], lecf->max_queue_bytes);
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief nginx module's set envelope
+ *
+ * Send each message of the definition with a second frame holding the
+ * host, pid, worker slot, definition id, sequence and send timestamp.
+ *
+ * @code{.conf}
+ * log_zmq_envelope definition;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_envelope(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     */
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_envelope\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->envelope) {
+        return "is duplicate";
+    }
+
+    lecf->envelope = 1;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_envelope(): \"%V\"", &value[1]);
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief nginx module's set subscriptions
+ *
+ * Publish the definition with a XPUB socket and keep the subscriptions of
+ * the collectors in each worker, so the format is only rendered for the
+ * topics somebody subscribed.
+ *
+ * @code{.conf}
+ * log_zmq_subscriptions definition;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_subscriptions(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value;
+#ifdef ZMQ_XPUB
+    int                              major, minor, patch;
+#endif
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     */
+    value = cf->args->elts;
+
+#ifdef ZMQ_XPUB
+    zmq_version(&major, &minor, &patch);
+
+    if (major < 3) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" needs libzmq 3.0.0, linked with %d.%d.%d",
+                           &value[0], major, minor, patch);
+        return NGX_CONF_ERROR;
+    }
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" needs libzmq 3.0.0, built with %d.%d.%d",
+                       &value[0], ZMQ_VERSION_MAJOR, ZMQ_VERSION_MINOR, ZMQ_VERSION_PATCH);
+    return NGX_CONF_ERROR;
+#endif
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_subscriptions\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->subscriptions) {
+        return "is duplicate";
+    }
+
+    lecf->subscriptions = 1;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_subscriptions(): \"%V\"", &value[1]);
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief nginx module's set writable
+ *
+ * Watch the socket of a definition from the event loop of each worker and
+ * skip the messages, before they are rendered, while the socket can not
+ * take them: no ZMQ_POLLOUT or no connection to the collector.
+ *
+ * @code{.conf}
+ * log_zmq_writable definition;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_writable(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value;
+#if (ZMQ_VERSION_MAJOR >= 4)
+    int                              major, minor, patch;
+#endif
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     */
+    value = cf->args->elts;
+
+#if (ZMQ_VERSION_MAJOR >= 4)
+    zmq_version(&major, &minor, &patch);
+
+    if (major < 4) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" needs libzmq 4.0.0, linked with %d.%d.%d",
+                           &value[0], major, minor, patch);
+        return NGX_CONF_ERROR;
+    }
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" needs libzmq 4.0.0, built with %d.%d.%d",
+                       &value[0], ZMQ_VERSION_MAJOR, ZMQ_VERSION_MINOR, ZMQ_VERSION_PATCH);
+    return NGX_CONF_ERROR;
+#endif
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_writable\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->writable) {
+        return "is duplicate";
+    }
+
+    lecf->writable = 1;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_writable(): \"%V\"", &value[1]);
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief nginx module's set max message size
+ *
+ * Limit the size of the messages of a definition (endpoint and format),
+ * and optionally cut some variables to a length while the format is
+ * rendered. A message over the limit is dropped before it is allocated and
+ * counted in oversized, each cut value is counted in truncated.
+ *
+ * @code{.conf}
+ * log_zmq_max_message_size definition 16k $request_uri=2k $http_cookie=512;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_max_message_size(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value, name, v;
+    ngx_uint_t                       i;
+    ngx_int_t                        index;
+    ssize_t                          size;
+    u_char                          *p;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2] size, 0 for no limit
+     * value[3..] $variable=length
+     */
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_max_message_size\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->max_message_size || lecf->ncaps) {
+        return "is duplicate";
+    }
+
+    size = ngx_parse_size(&value[2]);
+    if (size == NGX_ERROR) {
+        goto invalid;
+    }
+    lecf->max_message_size = size;
+
+    if (cf->args->nelts - 3 > ZMQ_NGINX_CAPS) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_max_message_size\": too many variables for \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        p = ngx_strlchr(value[i].data, value[i].data + value[i].len, '=');
+        if (value[i].data[0] != '$' || NULL == p || p - value[i].data < 2) {
+            goto invalid_var;
+        }
+
+        name.data = value[i].data + 1;
+        name.len = p - name.data;
+
+        v.data = p + 1;
+        v.len = value[i].data + value[i].len - v.data;
+
+        size = ngx_parse_size(&v);
+        if (size == NGX_ERROR || size == 0) {
+            goto invalid_var;
+        }
+
+        index = ngx_http_get_variable_index(cf, &name);
+        if (index == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        lecf->caps[lecf->ncaps] = index;
+        lecf->cap_lens[lecf->ncaps] = size;
+        lecf->ncaps++;
+    }
+
+    if (0 == lecf->max_message_size && 0 == lecf->ncaps) {
+        goto invalid;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_max_message_size(): \"%V\" %uz, %ui caps",
+                   &value[1], lecf->max_message_size, lecf->ncaps);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_max_message_size\": invalid size \"%V\"", &value[2]);
+
+    return NGX_CONF_ERROR;
+
+invalid_var:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_max_message_size\": invalid variable cap \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+/**
+ * @brief nginx module's set topic ids
+ *
+ * Send the messages of the definition with a 4 or 8 bytes id instead of
+ * the endpoint, and the table of the ids on the topics topic of the
+ * definition.
+ *
+ * @code{.conf}
+ * log_zmq_topic_ids definition size=8 interval=30s;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_topic_ids(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_http_log_zmq_topics_t       *t;
+    ngx_str_t                       *value, s;
+    ngx_int_t                        n;
+    ngx_uint_t                       i;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2..] size=<4|8> interval=<time>
+     */
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_topic_ids\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->topics) {
+        return "is duplicate";
+    }
+
+    if (lecf->compress) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_topic_ids\": \"%V\" is compressed", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    t = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_zmq_topics_t));
+    if (NULL == t) {
+        return NGX_CONF_ERROR;
+    }
+
+    t->size = ZMQ_NGINX_TOPICS_ID_LEN;
+    t->interval = ZMQ_NGINX_TOPICS_INTERVAL;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+            n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (n != 4 && n != 8) {
+                goto invalid;
+            }
+            t->size = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+            t->interval = (ngx_msec_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    t->topic.len = sizeof(ZMQ_NGINX_TOPICS_TOPIC) - 1 + lecf->name->len;
+    t->topic.data = ngx_pnalloc(cf->pool, t->topic.len);
+    if (NULL == t->topic.data) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_sprintf(t->topic.data, ZMQ_NGINX_TOPICS_TOPIC "%V", lecf->name);
+
+    lecf->topics = t;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_topic_ids(): \"%V\" size=%ui interval=%M",
+                   &value[1], t->size, t->interval);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_topic_ids\": invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+/**
+ * @brief nginx module's set aggregate
+ *
+ * Count the requests of the definition by key in each worker, and send the
+ * counts and sums of all the keys once per interval instead of a message
+ * per request. The sums are variables and there can be up to four.
+ *
+ * log_zmq_histogram uses the same table, but records the values (in
+ * seconds, like $request_time) in one histogram per key and variable.
+ *
+ * @code{.conf}
+ * log_zmq_aggregate definition key=$host:$status sum=$body_bytes_sent interval=1s size=1024;
+ * log_zmq_histogram definition key=$server_name value=$request_time interval=10s size=64;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_aggregate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t        *bkmc;
+    ngx_http_log_zmq_loc_conf_t         *llcf = conf;
+    ngx_http_log_zmq_element_conf_t     *lecf;
+    ngx_http_log_zmq_loc_element_conf_t *lelcf;
+    ngx_http_log_zmq_agg_t              *agg;
+    ngx_http_script_compile_t            sc;
+    ngx_str_t                           *value, s;
+    ngx_int_t                            n, *index;
+    ngx_uint_t                           i, histogram;
+    size_t                               len;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2..] key=<key> sum=<variable> interval=<time> size=<number>
+     *            (value=<variable> for log_zmq_histogram)
+     */
+    value = cf->args->elts;
+
+    histogram = (ngx_strcmp(cmd->name.data, "log_zmq_histogram") == 0);
+    len = histogram ? sizeof("value=") - 1 : sizeof("sum=") - 1;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\": \"%V\" definition not found", &cmd->name, &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->aggregate) {
+        return "is duplicate";
+    }
+
+    agg = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_zmq_agg_t));
+    if (NULL == agg) {
+        return NGX_CONF_ERROR;
+    }
+
+    agg->histogram = histogram;
+    agg->size = histogram ? ZMQ_NGINX_HISTOGRAM_SIZE : ZMQ_NGINX_AGGREGATE_SIZE;
+    agg->interval = histogram ? ZMQ_NGINX_HISTOGRAM_INTERVAL : ZMQ_NGINX_AGGREGATE_INTERVAL;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "key=", 4) == 0) {
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            if (0 == s.len || agg->key_lengths) {
+                goto invalid;
+            }
+
+            ngx_memzero(&sc, sizeof(ngx_http_script_compile_t));
+            sc.cf = cf;
+            sc.source = &s;
+            sc.flushes = &(lecf->flushes);
+            sc.lengths = &(agg->key_lengths);
+            sc.values = &(agg->key_values);
+            sc.variables = ngx_http_script_variables_count(&s);
+            sc.complete_lengths = 1;
+            sc.complete_values = 1;
+
+            if (ngx_http_script_compile(&sc) != NGX_OK) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\": error compiling key \"%V\"", &cmd->name, &s);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, histogram ? "value=" : "sum=", len) == 0) {
+            if (value[i].len < len + 2 || value[i].data[len] != '$') {
+                goto invalid;
+            }
+
+            if (agg->nsums == ZMQ_NGINX_AGGREGATE_SUMS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\": too many variables for \"%V\"", &cmd->name, &value[1]);
+                return NGX_CONF_ERROR;
+            }
+
+            s.len = value[i].len - len - 1;
+            s.data = value[i].data + len + 1;
+
+            n = ngx_http_get_variable_index(cf, &s);
+            if (n == NGX_ERROR) {
+                return NGX_CONF_ERROR;
+            }
+
+            /* the sums are flushed with the other variables of the definition */
+            if (NULL == lecf->flushes) {
+                lecf->flushes = ngx_array_create(cf->pool, 4, sizeof(ngx_uint_t));
+                if (NULL == lecf->flushes) {
+                    return NGX_CONF_ERROR;
+                }
+            }
+
+            index = ngx_array_push(lecf->flushes);
+            if (NULL == index) {
+                return NGX_CONF_ERROR;
+            }
+            *index = n;
+
+            agg->sums[agg->nsums] = n;
+            agg->sum_names[agg->nsums] = s;
+            agg->nsums++;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+            agg->interval = (ngx_msec_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+            n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (n == NGX_ERROR || n <= 0) {
+                goto invalid;
+            }
+            /* the table is probed with a mask */
+            agg->size = 4;
+            while (agg->size < (ngx_uint_t) n) {
+                agg->size <<= 1;
+            }
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (NULL == agg->key_lengths) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\": no key for \"%V\"", &cmd->name, &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (histogram && 0 == agg->nsums) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\": no value for \"%V\"", &cmd->name, &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    s.len = histogram ? sizeof(ZMQ_NGINX_HISTOGRAM_TOPIC) - 1 : sizeof(ZMQ_NGINX_AGGREGATE_TOPIC) - 1;
+    s.data = (u_char *) (histogram ? ZMQ_NGINX_HISTOGRAM_TOPIC : ZMQ_NGINX_AGGREGATE_TOPIC);
+
+    agg->topic.len = s.len + lecf->name->len;
+    agg->topic.data = ngx_pnalloc(cf->pool, agg->topic.len);
+    if (NULL == agg->topic.data) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_sprintf(agg->topic.data, "%V%V", &s, lecf->name);
+
+    lecf->aggregate = agg;
+
+    /* an aggregated definition has no format, so it is added to the location here */
+    lelcf = ngx_http_log_zmq_create_location_element(cf, llcf, &value[1]);
+    if (NULL == lelcf) {
+        return NGX_CONF_ERROR;
+    }
+
+    llcf->logs_definition = (ngx_array_t *) bkmc->logs;
+    lelcf->element = lecf;
+    lelcf->off = 0;
+    llcf->off = 0;
+
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_aggregate(): \"%V\" variables=%ui histogram=%ui interval=%M size=%ui",
+                   &value[1], agg->nsums, histogram, agg->interval, agg->size);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\": invalid parameter \"%V\"", &cmd->name, &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/**
+ * @brief nginx module's set sketch
+ *
+ * Follow the values of up to four variables with a count-min sketch, the
+ * heaviest values and a HyperLogLog, in fixed memory in each worker, and
+ * send them every interval instead of a message per request.
+ *
+ * @code{.conf}
+ * log_zmq_sketch definition value=$remote_addr value=$uri interval=10s width=2048 depth=4 top=10 hll=12;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_sketch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_log_zmq_main_conf_t        *bkmc;
+    ngx_http_log_zmq_loc_conf_t         *llcf = conf;
+    ngx_http_log_zmq_element_conf_t     *lecf;
+    ngx_http_log_zmq_loc_element_conf_t *lelcf;
+    ngx_http_log_zmq_sketch_t           *sk;
+    ngx_str_t                           *value, s;
+    ngx_int_t                            n, *index;
+    ngx_uint_t                           i;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2..] value=<variable> interval=<time> width=<number> depth=<number> top=<number> hll=<number>
+     */
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_sketch\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->sketch) {
+        return "is duplicate";
+    }
+
+    sk = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_zmq_sketch_t));
+    if (NULL == sk) {
+        return NGX_CONF_ERROR;
+    }
+
+    sk->interval = ZMQ_NGINX_SKETCH_INTERVAL;
+    sk->width = ZMQ_NGINX_SKETCH_WIDTH;
+    sk->depth = ZMQ_NGINX_SKETCH_DEPTH;
+    sk->top = ZMQ_NGINX_SKETCH_TOP;
+    sk->hll_bits = ZMQ_NGINX_SKETCH_HLL_BITS;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "value=", 6) == 0) {
+            if (value[i].len < 8 || value[i].data[6] != '$') {
+                goto invalid;
+            }
+
+            if (sk->nvars == ZMQ_NGINX_AGGREGATE_SUMS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_sketch\": too many variables for \"%V\"", &value[1]);
+                return NGX_CONF_ERROR;
+            }
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            n = ngx_http_get_variable_index(cf, &s);
+            if (n == NGX_ERROR) {
+                return NGX_CONF_ERROR;
+            }
+
+            /* the values are flushed with the other variables of the definition */
+            if (NULL == lecf->flushes) {
+                lecf->flushes = ngx_array_create(cf->pool, 4, sizeof(ngx_uint_t));
+                if (NULL == lecf->flushes) {
+                    return NGX_CONF_ERROR;
+                }
+            }
+
+            index = ngx_array_push(lecf->flushes);
+            if (NULL == index) {
+                return NGX_CONF_ERROR;
+            }
+            *index = n;
+
+            sk->vars[sk->nvars].index = n;
+            sk->vars[sk->nvars].name = s;
+            sk->nvars++;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+            sk->interval = (ngx_msec_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "width=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR || n <= 0) {
+                goto invalid;
+            }
+            /* the rows are indexed with a mask */
+            sk->width = 4;
+            while (sk->width < (ngx_uint_t) n) {
+                sk->width <<= 1;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "depth=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR || n <= 0 || n > ZMQ_NGINX_SKETCH_MAX_DEPTH) {
+                goto invalid;
+            }
+            sk->depth = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "top=", 4) == 0) {
+            n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (n == NGX_ERROR || n <= 0 || n > ZMQ_NGINX_SKETCH_MAX_TOP) {
+                goto invalid;
+            }
+            sk->top = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "hll=", 4) == 0) {
+            n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (n == NGX_ERROR || n < 4 || n > 16) {
+                goto invalid;
+            }
+            sk->hll_bits = n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (0 == sk->nvars) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_sketch\": no value for \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    sk->topic.len = sizeof(ZMQ_NGINX_SKETCH_TOPIC) - 1 + lecf->name->len;
+    sk->topic.data = ngx_pnalloc(cf->pool, sk->topic.len);
+    if (NULL == sk->topic.data) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_sprintf(sk->topic.data, ZMQ_NGINX_SKETCH_TOPIC "%V", lecf->name);
+
+    lecf->sketch = sk;
+
+    /* like an aggregated definition, there is no format to add it to the location */
+    lelcf = ngx_http_log_zmq_create_location_element(cf, llcf, &value[1]);
+    if (NULL == lelcf) {
+        return NGX_CONF_ERROR;
+    }
+
+    llcf->logs_definition = (ngx_array_t *) bkmc->logs;
+    lelcf->element = lecf;
+    lelcf->off = 0;
+    llcf->off = 0;
+
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_sketch(): \"%V\" variables=%ui width=%ui depth=%ui top=%ui",
+                   &value[1], sk->nvars, sk->width, sk->depth, sk->top);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_sketch\": invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/**
+ * @brief nginx module's set dictionary
+ *
+ * Send each batch of the definition as one message, where the endpoints
+ * and the given variables are replaced by references to a table with the
+ * different strings of the batch. The variables should be left out of the
+ * format, the collector gets them from the table. The definition needs a
+ * thread pool, set before, to build the batches.
+ *
+ * @code{.conf}
+ * log_zmq_dictionary definition $host $http_user_agent $upstream_addr;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_dictionary(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value, s;
+    ngx_int_t                        n, *index;
+    ngx_uint_t                       i;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2..] variables
+     */
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_dictionary\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->arrow) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_dictionary\": \"%V\" already has a \"log_zmq_arrow\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->ndict) {
+        return "is duplicate";
+    }
+
+    if (NULL == lecf->thread_pool) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_dictionary\": \"%V\" needs a \"log_zmq_thread_pool\" before",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts - 2 > ZMQ_NGINX_DICT_FIELDS) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_dictionary\": too many fields for \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (value[i].len < 2 || value[i].data[0] != '$') {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_dictionary\": invalid variable \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[i].len - 1;
+        s.data = value[i].data + 1;
+
+        n = ngx_http_get_variable_index(cf, &s);
+        if (n == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        /* the fields are flushed with the other variables of the definition */
+        if (NULL == lecf->flushes) {
+            lecf->flushes = ngx_array_create(cf->pool, 4, sizeof(ngx_uint_t));
+            if (NULL == lecf->flushes) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        index = ngx_array_push(lecf->flushes);
+        if (NULL == index) {
+            return NGX_CONF_ERROR;
+        }
+        *index = n;
+
+        lecf->dict[lecf->ndict] = n;
+        lecf->dict_names[lecf->ndict] = s;
+        lecf->ndict++;
+    }
+
+    lecf->dict_topic.len = sizeof(ZMQ_NGINX_DICT_TOPIC) - 1 + lecf->name->len;
+    lecf->dict_topic.data = ngx_pnalloc(cf->pool, lecf->dict_topic.len);
+    if (NULL == lecf->dict_topic.data) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_sprintf(lecf->dict_topic.data, ZMQ_NGINX_DICT_TOPIC "%V", lecf->name);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_dictionary(): \"%V\" %ui fields",
+                   &value[1], lecf->ndict);
+
+    return NGX_CONF_OK;
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_dictionary\" requires nginx built with --with-threads");
+    return NGX_CONF_ERROR;
+#endif
+}
+
+/**
+ * @brief nginx module's set arrow
+ *
+ * Send each batch of the definition as an Arrow IPC stream, with a column
+ * for each variable, typed as a string, a 64 bits integer or a double. The
+ * definition has no format, the variables are the message. The definition
+ * needs a thread pool, set before, to build the batches.
+ *
+ * @code{.conf}
+ * log_zmq_arrow definition $host $status:int $request_time:float;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_arrow(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+    ngx_http_log_zmq_main_conf_t        *bkmc;
+    ngx_http_log_zmq_loc_conf_t         *llcf = conf;
+    ngx_http_log_zmq_element_conf_t     *lecf;
+    ngx_http_log_zmq_loc_element_conf_t *lelcf;
+    ngx_str_t                           *value, s;
+    ngx_int_t                            n, *index;
+    ngx_uint_t                           i, type;
+    u_char                              *colon, *p;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2..] variables, with an optional :string, :int or :float type
+     */
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_arrow\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->arrow) {
+        return "is duplicate";
+    }
+
+    if (lecf->ndict) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_arrow\": \"%V\" already has a \"log_zmq_dictionary\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (NULL == lecf->thread_pool) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_arrow\": \"%V\" needs a \"log_zmq_thread_pool\" before",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts - 2 > ZMQ_NGINX_ARROW_FIELDS) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_arrow\": too many fields for \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (value[i].len < 2 || value[i].data[0] != '$') {
+            goto invalid;
+        }
+
+        s.len = value[i].len - 1;
+        s.data = value[i].data + 1;
+        type = LOG_ZMQ_ARROW_STRING;
+
+        colon = ngx_strlchr(s.data, s.data + s.len, ':');
+        if (colon) {
+            p = colon + 1;
+            n = s.data + s.len - p;
+
+            if (n == 6 && ngx_strncmp(p, "string", 6) == 0) {
+                type = LOG_ZMQ_ARROW_STRING;
+            } else if (n == 3 && ngx_strncmp(p, "int", 3) == 0) {
+                type = LOG_ZMQ_ARROW_INT;
+            } else if (n == 5 && ngx_strncmp(p, "float", 5) == 0) {
+                type = LOG_ZMQ_ARROW_FLOAT;
+            } else {
+                goto invalid;
+            }
+
+            s.len = colon - s.data;
+            if (0 == s.len) {
+                goto invalid;
+            }
+        }
+
+        n = ngx_http_get_variable_index(cf, &s);
+        if (n == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        /* the columns are flushed with the other variables of the definition */
+        if (NULL == lecf->flushes) {
+            lecf->flushes = ngx_array_create(cf->pool, 4, sizeof(ngx_uint_t));
+            if (NULL == lecf->flushes) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        index = ngx_array_push(lecf->flushes);
+        if (NULL == index) {
+            return NGX_CONF_ERROR;
+        }
+        *index = n;
+
+        lecf->dict[lecf->ndict] = n;
+        lecf->dict_names[lecf->ndict] = s;
+        lecf->arrow_types[lecf->ndict] = (u_char) type;
+        lecf->ndict++;
+    }
+
+    lecf->arrow = 1;
+
+    lecf->dict_topic.len = sizeof(ZMQ_NGINX_ARROW_TOPIC) - 1 + lecf->name->len;
+    lecf->dict_topic.data = ngx_pnalloc(cf->pool, lecf->dict_topic.len);
+    if (NULL == lecf->dict_topic.data) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_sprintf(lecf->dict_topic.data, ZMQ_NGINX_ARROW_TOPIC "%V", lecf->name);
+
+    /* the schema is the same for all the batches */
+    p = ngx_pcalloc(cf->pool, log_zmq_arrow_schema_size(lecf->dict_names, lecf->ndict));
+    if (NULL == p) {
+        return NGX_CONF_ERROR;
+    }
+    lecf->arrow_schema.data = p;
+    lecf->arrow_schema.len = log_zmq_arrow_schema(p, lecf->dict_names, lecf->arrow_types, lecf->ndict) - p;
+
+    /* like an aggregated definition, there is no format to add it to the location */
+    lelcf = ngx_http_log_zmq_create_location_element(cf, llcf, &value[1]);
+    if (NULL == lelcf) {
+        return NGX_CONF_ERROR;
+    }
+
+    llcf->logs_definition = (ngx_array_t *) bkmc->logs;
+    lelcf->element = lecf;
+    lelcf->off = 0;
+    llcf->off = 0;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_arrow(): \"%V\" %ui columns, schema %uz bytes",
+                   &value[1], lecf->ndict, lecf->arrow_schema.len);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_arrow\": invalid column \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_arrow\" requires nginx built with --with-threads");
+    return NGX_CONF_ERROR;
+#endif
+}
+
+/**
+ * @brief nginx module's set compress
+ *
+ * Compress each message of the definition with zstd, the endpoint is kept
+ * in clear. The dictionary is read here, each worker digests it once.
+ *
+ * @code{.conf}
+ * log_zmq_compress definition zstd dict=/etc/nginx/access.dict level=3;
+ * @endcode
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @param cmd A pointer to ngx_commant_t that defines the configuration line
+ * @param conf A pointer to the configuration received
+ * @return A char pointer which represents the status NGX_CONF_ERROR | NGX_CONF_OK
+ */
+static char *
+ngx_http_log_zmq_set_compress(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_HAVE_ZSTD)
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_str_t                       *value, path;
+    ngx_file_t                       file;
+    ngx_file_info_t                  fi;
+    ngx_int_t                        n;
+    ngx_uint_t                       i;
+    ssize_t                          size;
+
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* value[0] variable name
+     * value[1] definition name
+     * value[2] zstd
+     * value[3..] dict=<path> level=<number>
+     */
+    value = cf->args->elts;
+
+    lecf = ngx_http_log_zmq_find_definition(bkmc, &value[1]);
+    if (NULL == lecf || NULL == lecf->ctx) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_compress\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->compress) {
+        return "is duplicate";
+    }
+
+    /* the compressed messages end their topic with a NUL byte, an id can have one */
+    if (lecf->topics) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_compress\": \"%V\" has topic ids", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(value[2].data, "zstd") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_compress\": unknown compression \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    lecf->compress_level = ZMQ_NGINX_ZSTD_LEVEL;
+    ngx_str_null(&path);
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "dict=", 5) == 0) {
+            path.len = value[i].len - 5;
+            path.data = value[i].data + 5;
+            if (0 == path.len) {
+                goto invalid;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "level=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR || n < 1 || n > ZSTD_maxCLevel()) {
+                goto invalid;
+            }
+            lecf->compress_level = (int) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (path.len) {
+        if (ngx_conf_full_name(cf->cycle, &path, 1) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&file, sizeof(ngx_file_t));
+        file.name = path;
+        file.log = cf->log;
+
+        file.fd = ngx_open_file(path.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+        if (file.fd == NGX_INVALID_FILE) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, ngx_open_file_n " \"%s\" failed", path.data);
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, ngx_fd_info_n " \"%s\" failed", path.data);
+            (void) ngx_close_file(file.fd);
+            return NGX_CONF_ERROR;
+        }
+
+        lecf->compress_dict.len = (size_t) ngx_file_size(&fi);
+        lecf->compress_dict.data = ngx_pnalloc(cf->pool, lecf->compress_dict.len);
+
+        size = NGX_ERROR;
+        if (lecf->compress_dict.data) {
+            size = ngx_read_file(&file, lecf->compress_dict.data, lecf->compress_dict.len, 0);
+        }
+
+        if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+            ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno, ngx_close_file_n " \"%s\" failed", path.data);
+        }
+
+        if (size != (ssize_t) lecf->compress_dict.len || 0 == size) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_compress\": error reading dictionary \"%s\"", path.data);
+            return NGX_CONF_ERROR;
+        }
+
+        /* a raw content dictionary has no id */
+        lecf->compress_dict_id = ZSTD_getDictID_fromDict(lecf->compress_dict.data, lecf->compress_dict.len);
+    }
+
+    lecf->compress = 1;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, cf->log, 0, "log_zmq: set_compress(): \"%V\" level=%d dict=%uD",
+                   &value[1], lecf->compress_level, lecf->compress_dict_id);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_compress\": invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_compress\" requires nginx built with libzstd");
+    return NGX_CONF_ERROR;
+#endif
+}
+
+/**
+ * @brief nginx module's set status
+ *
+ * Show the counters of all definitions in the current location.
+ *
+ * @code{.conf}
+ * location = /log_zmq_status { log_zmq_status; }
+ * @endcode
+ */
+static char *
+ngx_http_log_zmq_set_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_log_zmq_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief nginx module's set control
+ *
+ * Show and change the runtime control of the definitions in the current
+ * location. Keep this location internal or protected by allow/deny.
+ *
+ * @code{.conf}
+ * location = /log_zmq_control { allow 127.0.0.1; deny all; log_zmq_control; }
+ * @endcode
+ */
+static char *
+ngx_http_log_zmq_set_control(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_log_zmq_control_handler;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief initialize the counters zone
+ *
+ * Find, or take, a slot for each definition. On a reload the zone is
+ * reused and the definitions keep their counters.
+ *
+ * @param shm_zone A ngx_shm_zone_t pointer to the zone
+ * @param data The zone data of the previous cycle, if any
+ * @return A ngx_int_t which can be NGX_ERROR | NGX_OK
+ */
+static ngx_int_t
+ngx_http_log_zmq_init_stats_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc = shm_zone->data;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_http_log_zmq_stats_shm_t    *shm;
+    ngx_core_conf_t                 *ccf;
+    ngx_slab_pool_t                 *shpool;
+    ngx_uint_t                       i, j;
+    size_t                           len;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shpool->data) {
+        shm = shpool->data;
+    } else {
+        shm = ngx_slab_calloc(shpool, sizeof(ngx_http_log_zmq_stats_shm_t));
+        if (NULL == shm) {
+            return NGX_ERROR;
+        }
+        shpool->data = shm;
+    }
+
+    bkmc->stats = shm;
+
+    /* the rows of a reused zone are kept, unless there are more workers now */
+    if (bkmc->timing) {
+        ccf = (ngx_core_conf_t *) ngx_get_conf(bkmc->cycle->conf_ctx, ngx_core_module);
+
+        if ((ngx_uint_t) ccf->worker_processes > bkmc->timing_workers) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "\"log_zmq_timing\" needs \"worker_processes\" before the \"http\" block");
+            return NGX_ERROR;
+        }
+
+        if (shm->timing_workers < (ngx_uint_t) ccf->worker_processes) {
+            if (shm->timing) {
+                ngx_slab_free(shpool, shm->timing);
+            }
+
+            shm->timing = ngx_slab_calloc(shpool, ccf->worker_processes * sizeof(ngx_http_log_zmq_timing_t));
+            if (NULL == shm->timing) {
+                shm->timing_workers = 0;
+                return NGX_ERROR;
+            }
+            shm->timing_workers = ccf->worker_processes;
+        }
+    }
+
+    lecf = bkmc->logs->elts;
+
+    for (i = 0; i < bkmc->logs->nelts; i++) {
+
+        if (NULL == lecf[i].ctx) {
+            continue;
+        }
+
+        len = ngx_min(lecf[i].name->len, LOG_ZMQ_STATS_NAME_LEN);
+
+        for (j = 0; j < shm->nslots; j++) {
+            if (shm->slots[j].len == len && ngx_strncmp(shm->slots[j].name, lecf[i].name->data, len) == 0) {
+                break;
+            }
+        }
+
+        if (j == shm->nslots) {
+            if (j == LOG_ZMQ_STATS_SLOTS) {
+                /* a global rate without its shared bucket would be a limit per worker */
+                if (lecf[i].rate && lecf[i].rate_global) {
+                    ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                                  "log_zmq: \"%V\" needs a counters slot for its global rate, all %d are taken",
+                                  lecf[i].name, LOG_ZMQ_STATS_SLOTS);
+                    return NGX_ERROR;
+                }
+
+                ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, 0,
+                              "log_zmq: no counters slot left for \"%V\", it has no counters and no runtime control",
+                              lecf[i].name);
+                continue;
+            }
+            ngx_memcpy(shm->slots[j].name, lecf[i].name->data, len);
+            shm->slots[j].len = len;
+            shm->nslots++;
+        }
+
+        lecf[i].ctx->stats = &shm->slots[j].stats;
+
+        if (lecf[i].rate && lecf[i].rate_global) {
+            lecf[i].ctx->bucket = &shm->slots[j].stats.bucket;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * @brief nginx module's status handler
+ *
+ * One line with the largest scratch pool (in bytes, and the most large
+ * allocations) and one line for each definition, with all its counters:
+ *
+ * @code
+ * log_zmq_scratch hwm=16384 large=2
+ * log_zmq main sent=10 failed=0 offload_queued=0 offload_batches=0 offload_usec=0
+ * @endcode
+ *
+ * With log_zmq_timing, one more line for each handler stage, with the
+ * percentiles (in nanoseconds) of all workers:
+ *
+ * @code
+ * log_zmq_timing script count=10 p50=1023 p90=2047 p99=4095 p999=4095 max=4095
+ * @endcode
+ *
+ * @param r A ngx_http_request_t that represents the current request
+ * @return A ngx_int_t with the status
+ */
+static ngx_int_t
+ngx_http_log_zmq_status_handler(ngx_http_request_t *r)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_http_log_zmq_timing_t       *timing;
+    ngx_buf_t                       *b;
+    ngx_chain_t                      out;
+    ngx_uint_t                       i, j, k, w, last;
+    ngx_int_t                        rc;
+    size_t                           size;
+    uint64_t                         count, seen, *h;
+    static ngx_uint_t                per[] = { 500, 900, 990, 999 };
+    static char                     *per_names[] = { "p50", "p90", "p99", "p999" };
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    bkmc = ngx_http_get_module_main_conf(r, ngx_http_log_zmq_module);
+
+    size = sizeof("log_zmq_scratch hwm= large=\n") - 1 + 2 * NGX_ATOMIC_T_LEN;
+    lecf = bkmc->logs->elts;
+
+    for (i = 0; i < bkmc->logs->nelts; i++) {
+        size += sizeof("log_zmq \n") - 1 + lecf[i].name->len;
+        for (j = 0; log_zmq_stat_names[j].len; j++) {
+            size += sizeof(" =") - 1 + log_zmq_stat_names[j].len + NGX_ATOMIC_T_LEN;
+        }
+    }
+
+    timing = (bkmc->timing && bkmc->stats) ? bkmc->stats->timing : NULL;
+
+    if (timing) {
+        for (j = 0; log_zmq_timing_names[j].len; j++) {
+            size += sizeof("log_zmq_timing  count= p50= p90= p99= p999= max=\n") - 1
+                    + log_zmq_timing_names[j].len + 6 * NGX_INT64_LEN;
+        }
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_length_n = 0;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->header_only = 1;
+        return ngx_http_send_header(r);
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, "log_zmq_scratch hwm=%uA large=%uA\n",
+                          bkmc->stats ? bkmc->stats->scratch_hwm : 0, bkmc->stats ? bkmc->stats->scratch_large : 0);
+
+    for (i = 0; i < bkmc->logs->nelts; i++) {
+        b->last = ngx_sprintf(b->last, "log_zmq %V", lecf[i].name);
+        for (j = 0; log_zmq_stat_names[j].len; j++) {
+            b->last = ngx_sprintf(b->last, " %V=%uA", &log_zmq_stat_names[j],
+                                  (lecf[i].ctx && lecf[i].ctx->stats) ? lecf[i].ctx->stats->counters[j] : 0);
+        }
+        *b->last++ = '\n';
+    }
+
+    if (timing) {
+        h = ngx_palloc(r->pool, ZMQ_NGINX_HISTOGRAM_BUCKETS * sizeof(uint64_t));
+        if (h == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        for (j = 0; j < LOG_ZMQ_TIMING_MAX; j++) {
+
+            /* add the rows of all workers */
+            count = 0;
+            last = 0;
+            for (k = 0; k < ZMQ_NGINX_HISTOGRAM_BUCKETS; k++) {
+                h[k] = 0;
+                for (w = 0; w < bkmc->stats->timing_workers; w++) {
+                    h[k] += timing[w].buckets[j][k];
+                }
+                if (h[k]) {
+                    count += h[k];
+                    last = k;
+                }
+            }
+
+            b->last = ngx_sprintf(b->last, "log_zmq_timing %V count=%uL", &log_zmq_timing_names[j], count);
+
+            seen = 0;
+            k = 0;
+            for (i = 0; i < sizeof(per) / sizeof(per[0]); i++) {
+                while (k < last && (seen + h[k]) * 1000 < count * per[i]) {
+                    seen += h[k++];
+                }
+                b->last = ngx_sprintf(b->last, " %s=%uL", per_names[i],
+                                      count ? ngx_http_log_zmq_bucket_value(k) : 0);
+            }
+
+            b->last = ngx_sprintf(b->last, " max=%uL\n", count ? ngx_http_log_zmq_bucket_value(last) : 0);
+        }
+    }
+
+    r->headers_out.content_length_n = b->last - b->pos;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/**
+ * @brief set or clear a runtime control flag
+ *
+ * The values of the flag are written before it is set, so a worker that
+ * sees the flag also sees its value.
+ *
+ * @param ctl A ngx_http_log_zmq_control_t pointer to the control
+ * @param flag The LOG_ZMQ_CONTROL_* flag
+ * @param on Set the flag if 1, clear it if 0
+ */
+static void
+ngx_http_log_zmq_control_flag(ngx_http_log_zmq_control_t *ctl, ngx_uint_t flag, ngx_uint_t on)
+{
+    ngx_atomic_uint_t old;
+
+    ngx_memory_barrier();
+
+    do {
+        old = ctl->flags;
+    } while (!ngx_atomic_cmp_set(&ctl->flags, old, on ? (old | flag) : (old & ~flag)));
+}
+
+/**
+ * @brief nginx module's control handler
+ *
+ * A GET shows one line for each definition. A POST changes one definition,
+ * or all of them without "definition", and shows the result:
+ *
+ * @code
+ * curl -X POST 'http://127.0.0.1/log_zmq_control?definition=main&sample=0.1&rate=500'
+ * log_zmq_control main enabled=on sample=0.1000 rate=500
+ * @endcode
+ *
+ * The arguments are "enabled=on|off", "sample=<0..1>" (1 sends all the
+ * messages) and "rate=<n>|off" (messages per second for all workers, off
+ * goes back to log_zmq_rate). The control lives in the counters zone, so
+ * it is kept on a reload.
+ *
+ * @param r A ngx_http_request_t that represents the current request
+ * @return A ngx_int_t with the status
+ */
+static ngx_int_t
+ngx_http_log_zmq_control_handler(ngx_http_request_t *r)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_http_log_zmq_control_t      *ctl;
+    ngx_buf_t                       *b;
+    ngx_chain_t                      out;
+    ngx_str_t                        name, enabled, sample, rate;
+    ngx_uint_t                       i, flags;
+    ngx_int_t                        rc, s, n;
+    size_t                           size;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    bkmc = ngx_http_get_module_main_conf(r, ngx_http_log_zmq_module);
+
+    if (NULL == bkmc->stats) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    lecf = bkmc->logs->elts;
+
+    if (r->method == NGX_HTTP_POST) {
+
+        ngx_str_null(&name);
+        ngx_str_null(&enabled);
+        ngx_str_null(&sample);
+        ngx_str_null(&rate);
+
+        (void) ngx_http_arg(r, (u_char *) "definition", 10, &name);
+        (void) ngx_http_arg(r, (u_char *) "enabled", 7, &enabled);
+        (void) ngx_http_arg(r, (u_char *) "sample", 6, &sample);
+        (void) ngx_http_arg(r, (u_char *) "rate", 4, &rate);
+
+        /* check everything before changing anything */
+        if (enabled.len
+            && !(enabled.len == 2 && ngx_strncmp(enabled.data, "on", 2) == 0)
+            && !(enabled.len == 3 && ngx_strncmp(enabled.data, "off", 3) == 0))
+        {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        s = LOG_ZMQ_CONTROL_SCALE;
+        if (sample.len) {
+            s = ngx_atofp(sample.data, sample.len, 4);
+            if (s == NGX_ERROR || s > LOG_ZMQ_CONTROL_SCALE) {
+                return NGX_HTTP_BAD_REQUEST;
+            }
+        }
+
+        n = 0;
+        if (rate.len && !(rate.len == 3 && ngx_strncmp(rate.data, "off", 3) == 0)) {
+            n = ngx_atoi(rate.data, rate.len);
+            if (n == NGX_ERROR || n == 0) {
+                return NGX_HTTP_BAD_REQUEST;
+            }
+        }
+
+        flags = 0;
+
+        for (i = 0; i < bkmc->logs->nelts; i++) {
+
+            if (NULL == lecf[i].ctx || NULL == lecf[i].ctx->stats) {
+                continue;
+            }
+
+            if (name.len && (name.len != lecf[i].name->len
+                             || ngx_strncmp(name.data, lecf[i].name->data, name.len) != 0))
+            {
+                continue;
+            }
+
+            ctl = &lecf[i].ctx->stats->control;
+
+            if (sample.len) {
+                ctl->sample = s;
+                ngx_http_log_zmq_control_flag(ctl, LOG_ZMQ_CONTROL_SAMPLE, s < LOG_ZMQ_CONTROL_SCALE);
+            }
+
+            if (rate.len) {
+                if (n) {
+                    ctl->rate = n;
+                }
+                ngx_http_log_zmq_control_flag(ctl, LOG_ZMQ_CONTROL_RATE, n != 0);
+            }
+
+            if (enabled.len) {
+                ngx_http_log_zmq_control_flag(ctl, LOG_ZMQ_CONTROL_OFF, enabled.len == 3);
+            }
+
+            ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                          "log_zmq: control(): \"%V\" flags=%uA sample=%uA rate=%uA",
+                          lecf[i].name, ctl->flags, ctl->sample, ctl->rate);
+
+            flags = 1;
+        }
+
+        if (0 == flags) {
+            return NGX_HTTP_NOT_FOUND;
+        }
+    }
+
+    size = 0;
+
+    for (i = 0; i < bkmc->logs->nelts; i++) {
+        size += sizeof("log_zmq_control  enabled=off sample=0.0000 rate=\n") - 1
+                + lecf[i].name->len + NGX_ATOMIC_T_LEN * 2;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_length_n = 0;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->header_only = 1;
+        return ngx_http_send_header(r);
+    }
+
+    b = ngx_create_temp_buf(r->pool, size + 1);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    for (i = 0; i < bkmc->logs->nelts; i++) {
+
+        if (NULL == lecf[i].ctx || NULL == lecf[i].ctx->stats) {
+            continue;
+        }
+
+        ctl = &lecf[i].ctx->stats->control;
+        flags = ctl->flags;
+        s = (flags & LOG_ZMQ_CONTROL_SAMPLE) ? (ngx_int_t) ctl->sample : LOG_ZMQ_CONTROL_SCALE;
+
+        b->last = ngx_sprintf(b->last, "log_zmq_control %V enabled=%s sample=%i.%04i rate=",
+                              lecf[i].name, (flags & LOG_ZMQ_CONTROL_OFF) ? "off" : "on",
+                              s / LOG_ZMQ_CONTROL_SCALE, s % LOG_ZMQ_CONTROL_SCALE);
+
+        if (flags & LOG_ZMQ_CONTROL_RATE) {
+            b->last = ngx_sprintf(b->last, "%uA\n", ctl->rate);
+        } else {
+            b->last = ngx_sprintf(b->last, "off\n");
+        }
+    }
+
+    r->headers_out.content_length_n = b->last - b->pos;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/**
+ * @brief upper bound of a histogram bucket
+ *
+ * See log_zmq_histogram_bucket, a bucket b >= 32 starts at
+ * (b - 16 * e) << e with e = b / 16 - 1, and is 1 << e wide.
+ *
+ * @param b A histogram bucket
+ * @return A uint64_t with the largest value of the bucket
+ */
+static uint64_t
+ngx_http_log_zmq_bucket_value(ngx_uint_t b)
+{
+    ngx_uint_t  e;
+
+    e = (b < (2 << ZMQ_NGINX_HISTOGRAM_SUB_BITS)) ? 0 : (b >> ZMQ_NGINX_HISTOGRAM_SUB_BITS) - 1;
+
+    return ((uint64_t) (b - (e << ZMQ_NGINX_HISTOGRAM_SUB_BITS)) << e) + ((uint64_t) 1 << e) - 1;
+}
+
+/**
+ * @brief $log_zmq_handler_time variable
+ *
+ * The time spent by the log_zmq handler in this request, in microseconds
+ * with nanosecond resolution. It is only found with log_zmq_timing on.
+ *
+ * @param r A ngx_http_request_t that represents the current request
+ * @param v A ngx_http_variable_value_t pointer to the value
+ * @param data Unused
+ * @return A ngx_int_t with NGX_OK | NGX_ERROR
+ */
+static ngx_int_t
+ngx_http_log_zmq_handler_time_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_log_zmq_request_ctx_t *ctx;
+    u_char                         *p;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_log_zmq_module);
+    if (NULL == ctx) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT64_LEN + 4);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%uL.%03uL", ctx->handler_time / 1000, ctx->handler_time % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+/**
+ * @brief $log_zmq_sample_rate variable
+ *
+ * The part of the messages sent by the definition being rendered, with the
+ * runtime and the adaptive sample rates, from 0.0001 to 1.0000. A collector
+ * multiplies its counts by the inverse. It is only found in the formats and
+ * endpoints of log_zmq.
+ *
+ * @param r A ngx_http_request_t that represents the current request
+ * @param v A ngx_http_variable_value_t pointer to the value
+ * @param data Unused
+ * @return A ngx_int_t with NGX_OK | NGX_ERROR
+ */
+static ngx_int_t
+ngx_http_log_zmq_sample_rate_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_log_zmq_main_conf_t *bkmc;
+    u_char                       *p;
+
+    bkmc = ngx_http_get_module_main_conf(r, ngx_http_log_zmq_module);
+    if (0 == bkmc->sample_rate) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN + 5);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui.%04ui", bkmc->sample_rate / LOG_ZMQ_CONTROL_SCALE,
+                         bkmc->sample_rate % LOG_ZMQ_CONTROL_SCALE) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+/**
+ * @brief nginx module before the configuration is read
+ *
+ * Add the module variables, so they can be used by access_log.
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @return A ngx_int_t which can be NGX_ERROR | NGX_OK
+ */
+static ngx_int_t
+ngx_http_log_zmq_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_log_zmq_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * @brief nginx module after the configuration was submited
+ *
+ * In this phase of the module initiation we push our handler to the
+ * core handler list to be proccessed each request
+ *
+ * @param cf A ngx_conf_t pointer to the main nginx configurion
+ * @return A ngx_int_t which can be NGX_ERROR | NGX_OK
+ */
+static ngx_int_t
+ngx_http_log_zmq_postconf(ngx_conf_t *cf)
+{
+    ngx_http_core_main_conf_t       *cmcf;
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_http_handler_pt             *h;
+    ngx_uint_t                      i, j, k, *index, *flush;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+    bkmc = ngx_http_conf_get_module_main_conf(cf, ngx_http_log_zmq_module);
+
+    /* the union of the variables used by all definitions, flushed once per request */
+    bkmc->flushes = ngx_array_create(cf->pool, 8, sizeof(ngx_uint_t));
+    if (bkmc->flushes == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (bkmc->logs && bkmc->logs != NGX_CONF_UNSET_PTR) {
+        lecf = bkmc->logs->elts;
+        for (i = 0; i < bkmc->logs->nelts; i++) {
+
+            /* the priorities and the adaptive sample see the queues through the byte limits */
+            if (0 == lecf[i].max_queue_bytes && 0 == lecf[i].worker_max_queue_bytes) {
+                if (lecf[i].priority_low) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "\"log_zmq_priority\" needs \"log_zmq_max_queue_bytes\" for \"%V\"",
+                                       lecf[i].name);
+                    return NGX_ERROR;
+                }
+
+                if (lecf[i].sample_interval) {
+                    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                                       "\"log_zmq_adaptive_sample\" without \"log_zmq_max_queue_bytes\" "
+                                       "only sees the failed sends of \"%V\"", lecf[i].name);
+                }
+            }
+
+            if (NULL == lecf[i].flushes) {
+                continue;
+            }
+            index = lecf[i].flushes->elts;
+            for (j = 0; j < lecf[i].flushes->nelts; j++) {
+                flush = bkmc->flushes->elts;
+                for (k = 0; k < bkmc->flushes->nelts; k++) {
+                    if (flush[k] == index[j]) {
+                        break;
+                    }
+                }
+                if (k < bkmc->flushes->nelts) {
+                    continue;
+                }
+                flush = ngx_array_push(bkmc->flushes);
+                if (flush == NULL) {
+                    return NGX_ERROR;
+                }
+                *flush = index[j];
+            }
+        }
+    }
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->cycle->log, 0, "log_zmq: postconf(): error pushing handler");
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_log_zmq_handler;
+
+    /* run before the other log handlers, so access_log sees $log_zmq_handler_time */
+    if (bkmc->timing) {
+        h = cmcf->phases[NGX_HTTP_LOG_PHASE].handlers.elts;
+        i = cmcf->phases[NGX_HTTP_LOG_PHASE].handlers.nelts - 1;
+        ngx_memmove(&h[1], &h[0], i * sizeof(ngx_http_handler_pt));
+        h[0] = ngx_http_log_zmq_handler;
+    }
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->cycle->log, 0, "log_zmq: postconf(): return OK");
 
     return NGX_OK;
 }
 
+/**
+ * @brief nginx module on the exit of a worker
+ *
+ * The aggregates, sketches and batches still in the worker are sent, then
+ * the zstd contexts are freed. The watched sockets have their ZMQ_FD in the
+ * event loop, they leave it before the connections of the worker are checked.
+ *
+ * @param cycle A ngx_cycle_t pointer to the current nginx cycle
+ * @return Nothing
+ */
+static void
+ngx_http_log_zmq_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_log_zmq_main_conf_t    *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_uint_t                       i;
+
+    /* no http block */
+    if (NULL == cycle->conf_ctx[ngx_http_module.index]) {
+        return;
+    }
+
+    bkmc = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_log_zmq_module);
+    if (NULL == bkmc || NULL == bkmc->logs || NGX_CONF_UNSET_PTR == bkmc->logs) {
+        return;
+    }
+
+    lecf = bkmc->logs->elts;
+    for (i = 0; i < bkmc->logs->nelts; i++) {
+        log_zmq_definition_exit(&lecf[i], cycle->log);
+    }
+}
+
 /**
  * @brief nginx module after exit the master proccess
  *
@@ -1177,3 +4374,24 @@ ngx_http_log_zmq_create_location_element(ngx_conf_t *cf, ngx_http_log_zmq_loc_co
 
     return lelcf;
 }
+
+static ngx_http_log_zmq_element_conf_t *
+ngx_http_log_zmq_find_definition(ngx_http_log_zmq_main_conf_t *bkmc, ngx_str_t *name)
+{
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_uint_t                      i;
+
+    if (NULL == bkmc || NULL == bkmc->logs || NGX_CONF_UNSET_PTR == bkmc->logs) {
+        return NULL;
+    }
+
+    lecf = bkmc->logs->elts;
+    for (i = 0; i < bkmc->logs->nelts; i++) {
+        if (lecf[i].name && lecf[i].name->len == name->len
+            && ngx_strncmp(lecf[i].name->data, name->data, name->len) == 0) {
+            return lecf + i;
+        }
+    }
+
+    return NULL;
+}
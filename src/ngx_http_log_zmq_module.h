@@ -22,75 +22,43 @@
 #include <ngx_http.h>
 #include <nginx.h>
 
-/**
- * @brief define a type to use as an address structure
- *
- * This type is used to evaluate the url configuration
- */
-typedef ngx_addr_t ngx_log_zmq_addr_t;
+#include "ngx_http_log_zmq.h"
 
-/**
- * @brief ZMQ protocols
- *
- */
-typedef enum{
-    TCP = 0,
-    IPC,
-    INPROC
-} ngx_log_zmq_server_kind;
+#define LOG_ZMQ_STATS_ZONE "log_zmq_stats"
+#define LOG_ZMQ_STATS_SLOTS 64
+#define LOG_ZMQ_STATS_NAME_LEN 64
+#define LOG_ZMQ_SCRATCH_SIZE 16384
 
 /**
- * @brief representation of a zmq server
+ * @brief counters of a definition in the shared zone
  *
- * We have the address, the type of the connection and the final
- * string with the connection name (prepended with tcp://)
+ * Slots are found by the definition name, so the counters survive a reload
+ * and old and new workers write to the same place.
  */
 typedef struct {
-    ngx_log_zmq_addr_t       peer_addr;    /**< Address URL */
-    ngx_log_zmq_server_kind  kind;         /**< Type of server (TCP|IPC|INPROC) */
-    ngx_str_t               *connection;   /**< Final connection string
-                                                   tcp://<ip>:<port>
-                                                   ipc://<endpoint>
-                                                   inproc://<endpoint> */
-} ngx_log_zmq_server_t;
+    u_char                          name[LOG_ZMQ_STATS_NAME_LEN];  /**< Definition name */
+    size_t                          len;                           /**< Definition name length */
+    ngx_http_log_zmq_stats_t        stats;                         /**< Definition counters */
+} ngx_http_log_zmq_stats_slot_t;
 
 /**
- * @brief module's context
- *
- * Define essencial variables to maintain the context of the ZMQ conection
- * during all module phases and nginx requests
+ * @brief shared zone with the counters of all definitions
  */
 typedef struct {
-    ngx_log_t *log;           /**< Pointer to the logger */
-    ngx_int_t iothreads;      /**< Number of threads to create */
-    void *zmq_context;        /**< The ZMQ Context Initiator */
-    void *zmq_socket;         /**< The ZMQ Socket to use */
-    int     ccreated;         /**< Was the context created? */
-    int  screated;            /**< Was the socket created? */
-} ngx_http_log_zmq_ctx_t;
+    ngx_atomic_t                    scratch_hwm;                   /**< Largest scratch pool of all workers, small blocks only */
+    ngx_atomic_t                    scratch_large;                 /**< Most large allocations of a request, in all workers */
+    ngx_http_log_zmq_timing_t      *timing;                        /**< Timing rows of the workers, NULL if log_zmq_timing is off */
+    ngx_uint_t                      timing_workers;                /**< Timing rows */
+    ngx_uint_t                      nslots;                        /**< Slots in use */
+    ngx_http_log_zmq_stats_slot_t   slots[LOG_ZMQ_STATS_SLOTS];    /**< Slots */
+} ngx_http_log_zmq_stats_shm_t;
 
 /**
- * @brief element log configuration
- *
- * @note nginx has a ngx flag type, we should change sset/fset/eset to that type
+ * @brief request context, only created with log_zmq_timing
  */
 typedef struct {
-    ngx_log_zmq_server_t   *server;              /**< Configuration server */
-    ngx_int_t               iothreads;           /**< Configuration number of threads */
-    ngx_int_t               qlen;                /**< Configuration queue length */
-    ngx_array_t            *data_lengths;        /**< Data length after format and compiling */
-    ngx_array_t            *data_values;         /**< Data values */
-    ngx_array_t            *endpoint_lengths;    /**< Endpoint length after format and compiling */
-    ngx_array_t            *endpoint_values;     /**< Endpoint values */
-    ngx_cycle_t            *cycle;               /**< Current configuration cycle */
-    ngx_http_log_zmq_ctx_t *ctx;                 /**< Current module context */
-    ngx_str_t              *name;                /**< Configuration name */
-    ngx_log_t              *log;                 /**< Pointer to the logger */
-    ngx_uint_t              sset;                /**< Was the server setted? */
-    ngx_uint_t              fset;                /**< Was the format setted? */
-    ngx_uint_t              eset;                /**< Was the endpoint setted? */
-    ngx_uint_t              off;                 /**< Is this element deactivated? */
-} ngx_http_log_zmq_element_conf_t;
+    uint64_t                        handler_time;                  /**< Handler time, in nanoseconds */
+} ngx_http_log_zmq_request_ctx_t;
 
 /**
  * @brief location log configuration
@@ -98,6 +66,10 @@ typedef struct {
 typedef struct {
     ngx_uint_t                       off;      /**< Is this element deactivated? */
     ngx_http_log_zmq_element_conf_t *element;  /**< Pointer to the log definition */
+    ngx_array_t                     *data_lengths;      /**< Format of this server or location, NULL for the definition one */
+    ngx_array_t                     *data_values;       /**< Format values */
+    ngx_array_t                     *endpoint_lengths;  /**< Endpoint of this server or location, NULL for the definition one */
+    ngx_array_t                     *endpoint_values;   /**< Endpoint values */
 } ngx_http_log_zmq_loc_element_conf_t;
 
 /**
@@ -121,8 +93,15 @@ typedef struct {
     ngx_cycle_t             *cycle;              /**< Pointer to the current nginx cycle */
     ngx_log_t               *log;                /**< Pointer to the logger */
     ngx_array_t				*logs;               /**< Array of logs definitions */
+    ngx_shm_zone_t          *stats_zone;         /**< Shared zone with the counters */
+    ngx_array_t             *flushes;            /**< Indexes of the variables used by all definitions */
+    ngx_http_log_zmq_stats_shm_t *stats;         /**< Counters in the shared zone */
+    ngx_pool_t              *scratch;            /**< Worker pool for the log phase, reset after each request */
+    ngx_flag_t               timing;             /**< Time the handler stages? */
+    ngx_uint_t               timing_workers;     /**< Timing rows the counters zone is sized for */
+    size_t                   max_queue_bytes;    /**< Bytes queued in ZMQ by all definitions of a worker, 0 for no limit */
+    ngx_int_t                sample_index;       /**< Index of $log_zmq_sample_rate */
+    ngx_uint_t               sample_rate;        /**< Sample rate of the definition being rendered, 0 out of the handler */
 } ngx_http_log_zmq_main_conf_t;
 
-#include "ngx_http_log_zmq.h"
-
 #endif
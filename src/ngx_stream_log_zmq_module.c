@@ -0,0 +1,750 @@
+/******************************************************************************
+ * Copyright (c) 2014-2015 by SAPO - PT Comunicações
+ * Copyright (c) 2016 by Altice Labs
+ *
+ *****************************************************************************/
+
+/**
+ * @file ngx_stream_log_zmq_module.c
+ * @author Dani Bento <dani@telecom.pt>
+ * @date 1 March 2014
+ * @brief Brokerlog Module for nginx stream (TCP/UDP) sessions using ZMQ Message
+ *
+ * This is the stream counterpart of ngx_http_log_zmq_module. It uses the same
+ * directives and shares the context, socket and serialization code from
+ * ngx_http_log_zmq.c, logging each session at NGX_STREAM_LOG_PHASE.
+ *
+ * @see http://www.zeromq.org/
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+#include <nginx.h>
+
+#include "ngx_stream_log_zmq_module.h"
+
+/* NGX_STREAM_LOG_PHASE and the variables of ngx_stream_script */
+#if (nginx_version < 1011004)
+#error ngx_stream_log_zmq_module needs nginx 1.11.4 or later
+#endif
+
+static void *ngx_stream_log_zmq_create_main_conf(ngx_conf_t *cf);
+static void *ngx_stream_log_zmq_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_log_zmq_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child);
+
+static char *ngx_stream_log_zmq_set_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_stream_log_zmq_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_stream_log_zmq_set_endpoint(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_stream_log_zmq_set_off(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_stream_log_zmq_set_socket_option(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_stream_log_zmq_set_io_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static ngx_http_log_zmq_element_conf_t *ngx_stream_log_zmq_create_definition(ngx_conf_t *cf, ngx_stream_log_zmq_main_conf_t *bkmc, ngx_str_t *name);
+static ngx_stream_log_zmq_srv_element_conf_t *ngx_stream_log_zmq_create_server_element(ngx_conf_t *cf, ngx_stream_log_zmq_srv_conf_t *lscf, ngx_str_t *name);
+
+static ngx_int_t ngx_stream_log_zmq_postconf(ngx_conf_t *cf);
+static void ngx_stream_log_zmq_exit_process(ngx_cycle_t *cycle);
+
+static ngx_command_t  ngx_stream_log_zmq_commands[] = {
+
+    { ngx_string("log_zmq_server"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE5,
+      ngx_stream_log_zmq_set_server,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_format"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_stream_log_zmq_set_format,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_endpoint"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_stream_log_zmq_set_endpoint,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_off"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_log_zmq_set_off,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_socket_option"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_stream_log_zmq_set_socket_option,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_zmq_io_threads"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_stream_log_zmq_set_io_threads,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+    ngx_null_command
+};
+
+static ngx_stream_module_t  ngx_stream_log_zmq_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_stream_log_zmq_postconf,           /* postconfiguration */
+    ngx_stream_log_zmq_create_main_conf,   /* create main configuration */
+    NULL,                                  /* init main configuration */
+    ngx_stream_log_zmq_create_srv_conf,    /* create server configuration */
+    ngx_stream_log_zmq_merge_srv_conf      /* merge server configuration */
+};
+
+ngx_module_t  ngx_stream_log_zmq_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_log_zmq_module_ctx,      /* module context */
+    ngx_stream_log_zmq_commands,         /* module directives */
+    NGX_STREAM_MODULE,                   /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    ngx_stream_log_zmq_exit_process,     /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+/**
+ * @brief nginx stream module's handler for logger phase
+ *
+ * Same as ngx_http_log_zmq_handler, but for a finished stream session.
+ * If anything fails we simply go on to the next definition, the session
+ * is already done.
+ *
+ * @param s A ngx_stream_session_t that represents the current session
+ * @return A ngx_int_t which can be NGX_ERROR | NGX_OK
+ */
+static ngx_int_t
+ngx_stream_log_zmq_handler(ngx_stream_session_t *s)
+{
+    ngx_stream_log_zmq_srv_conf_t         *lscf;
+    ngx_http_log_zmq_element_conf_t       *clecf;
+    ngx_stream_log_zmq_srv_element_conf_t *lelcf, *clelcf;
+    ngx_uint_t                            i;
+    ngx_str_t                             data;
+    ngx_str_t                             endpoint;
+    ngx_pool_t                            *pool = s->connection->pool;
+    ngx_log_t                             *log = s->connection->log;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, log, 0, "log_zmq: stream handler()");
+
+    lscf = ngx_stream_get_module_srv_conf(s, ngx_stream_log_zmq_module);
+
+    if (lscf->off == 1 || NULL == lscf->logs) {
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, log, 0, "log_zmq: stream handler(): all logs off");
+        return NGX_OK;
+    }
+
+    lelcf = lscf->logs->elts;
+
+    for (i = 0; i < lscf->logs->nelts; i++) {
+
+        clelcf = lelcf + i;
+
+        if (clelcf->off == 1) {
+            ngx_log_debug0(NGX_LOG_DEBUG_STREAM, log, 0, "log_zmq: stream handler(): element off");
+            continue;
+        }
+
+        clecf = clelcf->element;
+
+        if (NULL == clecf) {
+            ngx_log_debug0(NGX_LOG_DEBUG_STREAM, log, 0, "log_zmq: stream handler(): no element config");
+            continue;
+        }
+
+        /* we only proceed if all the variables were setted: endpoint, server, format */
+        if (clecf->eset == 0 || clecf->fset == 0 || clecf->sset == 0) {
+            ngx_log_debug3(NGX_LOG_DEBUG_STREAM, log, 0, "log_zmq: stream handler(): eset=%d, fset=%d, sset=%d",
+                                                         clecf->eset, clecf->fset, clecf->sset);
+            continue;
+        }
+
+        if (NULL == clecf->server || NULL == clecf->data_lengths || NULL == clecf->endpoint_lengths) {
+            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: stream handler(): incomplete definition \"%V\"", clecf->name);
+            continue;
+        }
+
+        if (LOG_ZMQ_STATE_BACKOFF == clecf->ctx->state) {
+            ngx_log_debug0(NGX_LOG_DEBUG_STREAM, log, 0, "log_zmq: stream handler(): not ready");
+            log_zmq_stat_add(clecf->ctx, LOG_ZMQ_STAT_NOT_READY, 1);
+            continue;
+        }
+
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, log, 0, "log_zmq: stream handler(): script data");
+        if (NULL == ngx_stream_script_run(s, &data, clecf->data_lengths->elts, 0, clecf->data_values->elts)) {
+            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: stream handler(): error script data");
+            continue;
+        }
+
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, log, 0, "log_zmq: stream handler(): script endpoint");
+        if (NULL == ngx_stream_script_run(s, &endpoint, clecf->endpoint_lengths->elts, 0, clecf->endpoint_values->elts)) {
+            ngx_log_error(NGX_LOG_ERR, log, 0, "log_zmq: stream handler(): error script endpoint");
+            continue;
+        }
+
+        if (0 == data.len) {
+            ngx_log_debug0(NGX_LOG_DEBUG_STREAM, log, 0, "log_zmq: stream handler(): no message to log");
+            continue;
+        }
+
+        if (NGX_OK != log_zmq_send(clecf, pool, log, &endpoint, &data)) {
+            ngx_log_debug0(NGX_LOG_DEBUG_STREAM, log, 0, "log_zmq: stream handler(): message not sent");
+            continue;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static void *
+ngx_stream_log_zmq_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_log_zmq_main_conf_t *bkmc;
+
+    bkmc = ngx_pcalloc(cf->pool, sizeof(ngx_stream_log_zmq_main_conf_t));
+    if (bkmc == NULL) {
+        ngx_log_error(NGX_LOG_INFO, cf->log, 0, "\"log_zmq\" error creating stream main configuration");
+        return NULL;
+    }
+
+    bkmc->cycle = cf->cycle;
+    bkmc->log = cf->log;
+    bkmc->logs = ngx_array_create(cf->pool, 4, sizeof(ngx_http_log_zmq_element_conf_t));
+    if (bkmc->logs == NULL) {
+        ngx_log_error(NGX_LOG_INFO, cf->log, 0, "\"log_zmq\" error creating stream main definitions");
+        return NULL;
+    }
+
+    return bkmc;
+}
+
+static void *
+ngx_stream_log_zmq_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_log_zmq_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_log_zmq_srv_conf_t));
+    if (conf == NULL) {
+        ngx_log_error(NGX_LOG_INFO, cf->log, 0, "\"log_zmq\" error creating stream server configuration");
+        return NULL;
+    }
+
+    conf->off = 0;
+    conf->logs = ngx_array_create(cf->pool, 4, sizeof(ngx_stream_log_zmq_srv_element_conf_t));
+    if (conf->logs == NULL) {
+        ngx_log_error(NGX_LOG_INFO, cf->log, 0, "\"log_zmq\" error creating stream server elements");
+        return NULL;
+    }
+    conf->logs_definition = NGX_CONF_UNSET_PTR;
+    conf->log = cf->log;
+
+    return conf;
+}
+
+/**
+ * @brief nginx stream module's proccess to merge all server configuration
+ *
+ * Every definition not muted in the server is inherited from the stream block.
+ */
+static char *
+ngx_stream_log_zmq_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_stream_log_zmq_srv_conf_t         *prev = parent;
+    ngx_stream_log_zmq_srv_conf_t         *conf = child;
+    ngx_http_log_zmq_element_conf_t       *element;
+    ngx_stream_log_zmq_srv_element_conf_t *srvelement;
+    ngx_uint_t                            i, j, found;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, cf->log, 0, "log_zmq: merge_srv_conf()");
+
+    if (NULL == conf->log) {
+        conf->log = prev->log;
+    }
+
+    if (NULL == conf->logs_definition || NGX_CONF_UNSET_PTR == conf->logs_definition) {
+        conf->logs_definition = prev->logs_definition;
+    }
+
+    if (NULL == prev->logs_definition || NGX_CONF_UNSET_PTR == prev->logs_definition) {
+        return NGX_CONF_OK;
+    }
+
+    element = prev->logs_definition->elts;
+
+    for (i = 0; i < prev->logs_definition->nelts; i++) {
+        found = 0;
+        srvelement = conf->logs->elts;
+        for (j = 0; j < conf->logs->nelts; j++) {
+            if (element[i].name->len == srvelement[j].element->name->len
+                && ngx_strncmp(element[i].name->data, srvelement[j].element->name->data, element[i].name->len) == 0) {
+                found = 1;
+            }
+        }
+        if (found == 0) {
+            srvelement = ngx_array_push(conf->logs);
+            if (NULL == srvelement) {
+                return NGX_CONF_ERROR;
+            }
+            srvelement->off = 0;
+            srvelement->element = element + i;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief nginx stream module's set server
+ *
+ * @code{.conf}
+ * log_zmq_server definition 127.0.0.1:5555 tcp 10 10000;
+ * @endcode
+ */
+static char *
+ngx_stream_log_zmq_set_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_log_zmq_main_conf_t        *bkmc;
+    ngx_stream_log_zmq_srv_conf_t         *lscf = conf;
+    ngx_http_log_zmq_element_conf_t       *lecf;
+    ngx_stream_log_zmq_srv_element_conf_t *lelcf;
+    ngx_str_t                             *value;
+
+    bkmc = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_log_zmq_module);
+
+    if (bkmc == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no \"log_zmq\" main configuration defined");
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    lecf = ngx_stream_log_zmq_create_definition(cf, bkmc, &value[1]);
+    if (NULL == lecf) {
+        return NGX_CONF_ERROR;
+    }
+
+    lscf->logs_definition = bkmc->logs;
+
+    if (lecf->sset == 1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_server\": \"%V\" was initializated before", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (log_zmq_set_server(cf, lecf, value) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    lelcf = ngx_stream_log_zmq_create_server_element(cf, lscf, &value[1]);
+    if (NULL == lelcf) {
+        return NGX_CONF_ERROR;
+    }
+
+    lelcf->element = lecf;
+    lelcf->off = 0;
+    lscf->off = 0;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief compile a stream script for a log definition
+ *
+ * The format can be split in multiple arguments, we join them before
+ * compiling like ngx_http_log_zmq_set_format does.
+ */
+static char *
+ngx_stream_log_zmq_compile(ngx_conf_t *cf, ngx_str_t *value, ngx_uint_t first,
+    ngx_array_t **lengths, ngx_array_t **values)
+{
+    ngx_stream_script_compile_t  sc;
+    ngx_str_t                   *source;
+    ngx_uint_t                   i;
+    size_t                       len;
+    u_char                      *p;
+
+    len = 0;
+    for (i = first; i < cf->args->nelts; i++) {
+        len += value[i].len;
+    }
+
+    source = ngx_palloc(cf->pool, sizeof(ngx_str_t));
+    if (source == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    source->len = len;
+    source->data = ngx_palloc(cf->pool, len + 1);
+    if (source->data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    p = source->data;
+    for (i = first; i < cf->args->nelts; i++) {
+        p = ngx_cpymem(p, value[i].data, value[i].len);
+    }
+
+    ngx_memzero(&sc, sizeof(ngx_stream_script_compile_t));
+    sc.cf = cf;
+    sc.source = source;
+    sc.lengths = lengths;
+    sc.values = values;
+    sc.variables = ngx_stream_script_variables_count(source);
+    sc.complete_lengths = 1;
+    sc.complete_values = 1;
+
+    if (ngx_stream_script_compile(&sc) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief nginx stream module's set format
+ *
+ * @code{.conf}
+ * log_zmq_format definition '{"remote_addr":"$remote_addr","bytes":$bytes_sent}';
+ * @endcode
+ */
+static char *
+ngx_stream_log_zmq_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_log_zmq_main_conf_t        *bkmc;
+    ngx_stream_log_zmq_srv_conf_t         *lscf = conf;
+    ngx_http_log_zmq_element_conf_t       *lecf;
+    ngx_stream_log_zmq_srv_element_conf_t *lelcf;
+    ngx_str_t                             *value;
+
+    bkmc = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_log_zmq_module);
+
+    if (bkmc == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no \"log_zmq\" main configuration defined");
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    lecf = ngx_stream_log_zmq_create_definition(cf, bkmc, &value[1]);
+    if (NULL == lecf) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->sset == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_format\": \"log_zmq_server\" must be set before \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->fset == 1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_format\" %V was initializated before", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_stream_log_zmq_compile(cf, value, 2, &lecf->data_lengths, &lecf->data_values) != NGX_CONF_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_format\": error compiling format \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    lelcf = ngx_stream_log_zmq_create_server_element(cf, lscf, &value[1]);
+    if (NULL == lelcf) {
+        return NGX_CONF_ERROR;
+    }
+
+    lecf->fset = 1;
+    lelcf->element = lecf;
+    lelcf->off = 0;
+    lscf->off = 0;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * @brief nginx stream module's set endpoint
+ *
+ * @code{.conf}
+ * log_zmq_endpoint definition "/stream/$protocol/";
+ * @endcode
+ */
+static char *
+ngx_stream_log_zmq_set_endpoint(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_log_zmq_main_conf_t        *bkmc;
+    ngx_stream_log_zmq_srv_conf_t         *lscf = conf;
+    ngx_http_log_zmq_element_conf_t       *lecf;
+    ngx_stream_log_zmq_srv_element_conf_t *lelcf;
+    ngx_str_t                             *value;
+
+    bkmc = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_log_zmq_module);
+
+    if (bkmc == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no \"log_zmq\" main configuration defined");
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    lecf = ngx_stream_log_zmq_create_definition(cf, bkmc, &value[1]);
+    if (NULL == lecf) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->sset == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_endpoint\": \"log_zmq_server\" must be set before \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->eset == 1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_endpoint\" %V was initializated before", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_stream_log_zmq_compile(cf, value, 2, &lecf->endpoint_lengths, &lecf->endpoint_values) != NGX_CONF_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_endpoint\": error compiling format \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    lelcf = ngx_stream_log_zmq_create_server_element(cf, lscf, &value[1]);
+    if (NULL == lelcf) {
+        return NGX_CONF_ERROR;
+    }
+
+    lecf->eset = 1;
+    lelcf->element = lecf;
+    lelcf->off = 0;
+    lscf->off = 0;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_stream_log_zmq_set_off(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_log_zmq_main_conf_t        *bkmc;
+    ngx_stream_log_zmq_srv_conf_t         *lscf = conf;
+    ngx_http_log_zmq_element_conf_t       *lecf;
+    ngx_stream_log_zmq_srv_element_conf_t *lelcf;
+    ngx_str_t                             *value;
+    ngx_uint_t                            i, found = 0;
+
+    bkmc = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_log_zmq_module);
+
+    if (NULL == bkmc || NULL == bkmc->logs) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq\" doesn't have any log defined");
+        return NGX_CONF_ERROR;
+    }
+
+    lscf->logs_definition = bkmc->logs;
+
+    value = cf->args->elts;
+
+    if ((value[1].len == 3) && (ngx_strncmp(value[1].data, "all", value[1].len) == 0)) {
+        lscf->off = 1;
+        return NGX_CONF_OK;
+    }
+
+    lecf = bkmc->logs->elts;
+    for (i = 0; i < bkmc->logs->nelts; i++) {
+        if (lecf[i].name->len == value[1].len
+            && ngx_strncmp(lecf[i].name->data, value[1].data, lecf[i].name->len) == 0) {
+            lecf = lecf + i;
+            found = 1;
+            break;
+        }
+    }
+
+    if (!found) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_off\": \"%V\" definition not found", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    lscf->off = 0;
+
+    lelcf = ngx_stream_log_zmq_create_server_element(cf, lscf, &value[1]);
+    if (NULL == lelcf) {
+        return NGX_CONF_ERROR;
+    }
+
+    lelcf->off = 1;
+    lelcf->element = lecf;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_stream_log_zmq_set_socket_option(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_log_zmq_main_conf_t        *bkmc;
+    ngx_http_log_zmq_element_conf_t       *lecf;
+    ngx_str_t                             *value;
+
+    bkmc = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_log_zmq_module);
+
+    if (bkmc == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no \"log_zmq\" main configuration defined");
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    lecf = ngx_stream_log_zmq_create_definition(cf, bkmc, &value[1]);
+    if (NULL == lecf) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->sset == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_socket_option\": \"log_zmq_server\" must be set before \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    return log_zmq_set_socket_option(cf, lecf, value, cf->args->nelts);
+}
+
+static char *
+ngx_stream_log_zmq_set_io_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_log_zmq_main_conf_t        *bkmc;
+    ngx_http_log_zmq_element_conf_t       *lecf;
+    ngx_str_t                             *value;
+
+    bkmc = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_log_zmq_module);
+
+    if (bkmc == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no \"log_zmq\" main configuration defined");
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    lecf = ngx_stream_log_zmq_create_definition(cf, bkmc, &value[1]);
+    if (NULL == lecf) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (lecf->sset == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq_io_threads\": \"log_zmq_server\" must be set before \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    return log_zmq_set_io_threads(cf, lecf, value, cf->args->nelts);
+}
+
+/**
+ * @brief nginx stream module after the configuration was submited
+ *
+ * Push our handler to the stream log phase.
+ */
+static ngx_int_t
+ngx_stream_log_zmq_postconf(ngx_conf_t *cf)
+{
+    ngx_stream_core_main_conf_t *cmcf;
+    ngx_stream_handler_pt       *h;
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_STREAM_LOG_PHASE].handlers);
+    if (h == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, cf->cycle->log, 0, "log_zmq: stream postconf(): error pushing handler");
+        return NGX_ERROR;
+    }
+
+    *h = ngx_stream_log_zmq_handler;
+
+    return NGX_OK;
+}
+
+/**
+ * @brief nginx stream module's exit process
+ *
+ * Same as the http module, the definitions of the stream block release
+ * what they set up in this worker.
+ *
+ * @param cycle A ngx_cycle_t pointer to the current nginx cycle
+ */
+static void
+ngx_stream_log_zmq_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_stream_log_zmq_main_conf_t  *bkmc;
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_uint_t                       i;
+
+    /* no stream block */
+    bkmc = ngx_stream_cycle_get_module_main_conf(cycle, ngx_stream_log_zmq_module);
+    if (NULL == bkmc || NULL == bkmc->logs) {
+        return;
+    }
+
+    lecf = bkmc->logs->elts;
+    for (i = 0; i < bkmc->logs->nelts; i++) {
+        log_zmq_definition_exit(&lecf[i], cycle->log);
+    }
+}
+
+static ngx_http_log_zmq_element_conf_t *
+ngx_stream_log_zmq_create_definition(ngx_conf_t *cf, ngx_stream_log_zmq_main_conf_t *bkmc, ngx_str_t *name)
+{
+    ngx_http_log_zmq_element_conf_t *lecf;
+    ngx_uint_t                      i;
+
+    lecf = bkmc->logs->elts;
+    for (i = 0; i < bkmc->logs->nelts; i++) {
+        if (lecf[i].name->len == name->len
+            && ngx_strncmp(lecf[i].name->data, name->data, name->len) == 0) {
+            return lecf + i;
+        }
+    }
+
+    lecf = ngx_array_push(bkmc->logs);
+    if (NULL == lecf) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq\": error creating definitions \"%V\"", name);
+        return NULL;
+    }
+    ngx_memzero(lecf, sizeof(ngx_http_log_zmq_element_conf_t));
+
+    /* set the name right away, the lookup above depends on it */
+    lecf->name = ngx_palloc(cf->pool, sizeof(ngx_str_t));
+    if (NULL == lecf->name) {
+        return NULL;
+    }
+    lecf->name->len = name->len;
+    lecf->name->data = ngx_pstrdup(cf->pool, name);
+    if (NULL == lecf->name->data) {
+        return NULL;
+    }
+
+    return lecf;
+}
+
+static ngx_stream_log_zmq_srv_element_conf_t *
+ngx_stream_log_zmq_create_server_element(ngx_conf_t *cf, ngx_stream_log_zmq_srv_conf_t *lscf, ngx_str_t *name)
+{
+    ngx_stream_log_zmq_srv_element_conf_t *lelcf;
+    ngx_uint_t                            i;
+
+    lelcf = lscf->logs->elts;
+    for (i = 0; i < lscf->logs->nelts; i++) {
+        if (lelcf[i].element->name->len == name->len
+            && ngx_strncmp(lelcf[i].element->name->data, name->data, name->len) == 0) {
+            return lelcf + i;
+        }
+    }
+
+    lelcf = ngx_array_push(lscf->logs);
+    if (NULL == lelcf) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"log_zmq\": error creating server log \"%V\"", name);
+        return NULL;
+    }
+    ngx_memzero(lelcf, sizeof(ngx_stream_log_zmq_srv_element_conf_t));
+
+    return lelcf;
+}
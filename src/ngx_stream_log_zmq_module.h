@@ -0,0 +1,54 @@
+/******************************************************************************
+ * Copyright (c) 2014-2015 by SAPO - PT Comunicações
+ * Copyright (c) 2016 by Altice Labs
+ *
+ *****************************************************************************/
+
+/**
+ * @file ngx_stream_log_zmq_module.h
+ * @author Dani Bento <dani@telecom.pt>
+ * @date 1 March 2014
+ * @brief Brokerlog Stream Module Header
+ *
+ * @see http://www.zeromq.org/
+ */
+
+#ifndef NGX_STREAM_BROKERLOG_H
+
+#define NGX_STREAM_BROKERLOG_H 1
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+#include <nginx.h>
+
+#include "ngx_http_log_zmq.h"
+
+/**
+ * @brief server log configuration
+ */
+typedef struct {
+    ngx_uint_t                       off;      /**< Is this element deactivated? */
+    ngx_http_log_zmq_element_conf_t *element;  /**< Pointer to the log definition */
+} ngx_stream_log_zmq_srv_element_conf_t;
+
+/**
+ * @brief server configuration
+ */
+typedef struct {
+    ngx_array_t              *logs;              /**< Array of logs to handle in this server */
+    ngx_uint_t                off;               /**< Should we off all the logs in this server? */
+    ngx_log_t                *log;               /**< Pointer to the logger */
+    ngx_array_t              *logs_definition;   /**< Pointer to the main conf logs definition */
+} ngx_stream_log_zmq_srv_conf_t;
+
+/**
+ * @brief module main configuration
+ */
+typedef struct {
+    ngx_cycle_t             *cycle;              /**< Pointer to the current nginx cycle */
+    ngx_log_t               *log;                /**< Pointer to the logger */
+    ngx_array_t             *logs;               /**< Array of logs definitions */
+} ngx_stream_log_zmq_main_conf_t;
+
+#endif
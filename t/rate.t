@@ -0,0 +1,85 @@
+# vi:filetype=perl
+#
+# Rate limits of ngx_http_log_zmq_module, checked with the counters of
+# log_zmq_status. Nothing listens on the endpoint: a PUB socket takes the
+# messages anyway, so "sent" is what passed the limits.
+
+use Test::Nginx::Socket 'no_plan';
+
+repeat_each(1);
+workers(2);
+master_on();
+no_shuffle();
+
+our $HttpConfig = q{
+    log_zmq_server main 127.0.0.1:5599 tcp 1 1000;
+    log_zmq_endpoint main "/t/";
+    log_zmq_format main '$request_uri';
+};
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: a global rate is shared by the workers
+--- http_config eval
+$::HttpConfig . q{
+    log_zmq_rate main rate=5/s global;
+}
+--- config
+    location = /status {
+        log_zmq_off all;
+        log_zmq_status;
+    }
+    location / {
+        return 200 "ok\n";
+    }
+--- request eval
+[(map { "GET /r$_" } 1..20), "GET /status"]
+--- response_body_like eval
+[(map { qr/^ok$/ } 1..20), qr/log_zmq main sent=[5-9] .* rate_limited=1[1-5]\b/]
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: a runtime rate caps all the workers
+--- http_config eval: $::HttpConfig
+--- config
+    location = /control {
+        log_zmq_off all;
+        log_zmq_control;
+    }
+    location = /status {
+        log_zmq_off all;
+        log_zmq_status;
+    }
+    location / {
+        return 200 "ok\n";
+    }
+--- request eval
+["POST /control?definition=main&rate=5", (map { "GET /r$_" } 1..20), "GET /status"]
+--- response_body_like eval
+[qr/log_zmq_control main enabled=on .* rate=5/, (map { qr/^ok$/ } 1..20),
+ qr/log_zmq main sent=[5-9] .* rate_limited=1[1-5]\b/]
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: without a limit every message is sent
+--- http_config eval: $::HttpConfig
+--- config
+    location = /status {
+        log_zmq_off all;
+        log_zmq_status;
+    }
+    location / {
+        return 200 "ok\n";
+    }
+--- request eval
+[(map { "GET /r$_" } 1..20), "GET /status"]
+--- response_body_like eval
+[(map { qr/^ok$/ } 1..20), qr/log_zmq main sent=20 .* rate_limited=0\b/]
+--- no_error_log
+[error]
@@ -0,0 +1,112 @@
+# vi:filetype=perl
+#
+# Samples of ngx_http_log_zmq_module, checked with the counters of
+# log_zmq_status. Nothing listens on the endpoint, and a one byte
+# log_zmq_max_queue_bytes refuses every message, which is backpressure
+# for log_zmq_adaptive_sample. /sleep.txt is sent at 1k/s, so the requests
+# after it come a second later, after the interval of the adaptive rate.
+
+use Test::Nginx::Socket 'no_plan';
+
+repeat_each(1);
+workers(1);
+master_on();
+no_shuffle();
+
+our $HttpConfig = q{
+    log_zmq_server main 127.0.0.1:5597 tcp 1 1000;
+    log_zmq_endpoint main "/t/";
+    log_zmq_format main '$request_uri';
+};
+
+our $Config = q{
+    location = /control {
+        log_zmq_off all;
+        log_zmq_control;
+    }
+    location = /status {
+        log_zmq_off all;
+        log_zmq_status;
+    }
+    location = /sleep.txt {
+        log_zmq_off all;
+        limit_rate 1k;
+    }
+    location / {
+        return 200 "ok\n";
+    }
+};
+
+our $UserFiles = ">>> sleep.txt\n" . ("x" x 3072) . "\n";
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: a runtime sample of 0 drops every message
+--- http_config eval: $::HttpConfig
+--- config eval: $::Config
+--- request eval
+["POST /control?definition=main&sample=0", (map { "GET /r$_" } 1..20), "GET /status"]
+--- response_body_like eval
+[qr/log_zmq_control main enabled=on sample=0.0000 /, (map { qr/^ok$/ } 1..20),
+ qr/log_zmq main sent=0 .* sampled_out=20\b/]
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: the adaptive sample lowers the rate after the refused messages
+--- http_config eval
+$::HttpConfig . q{
+    log_zmq_max_queue_bytes main 1;
+    log_zmq_adaptive_sample main min=0.0001 interval=100ms;
+}
+--- config eval: $::Config
+--- user_files eval: $::UserFiles
+--- request eval
+["GET /r0", "GET /sleep.txt", (map { "GET /r$_" } 1..40), "GET /status"]
+--- response_body_like eval
+[qr/^ok$/, qr/^x+$/, (map { qr/^ok$/ } 1..40),
+ qr/log_zmq main sent=0 .* sampled_out=[1-9]\d* queue_full=\d+ /]
+--- timeout: 10
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: the adaptive sample spares the high priority messages
+--- http_config eval
+$::HttpConfig . q{
+    map $arg_p $log_zmq_high {
+        default 0;
+        1       1;
+    }
+
+    log_zmq_max_queue_bytes main 1;
+    log_zmq_adaptive_sample main min=0.0001 interval=100ms;
+    log_zmq_priority main $log_zmq_high;
+}
+--- config eval: $::Config
+--- user_files eval: $::UserFiles
+--- request eval
+["GET /r0", "GET /sleep.txt", (map { "GET /r$_?p=1" } 1..20), "GET /status",
+ (map { "GET /r$_" } 21..40), "GET /status"]
+--- response_body_like eval
+[qr/^ok$/, qr/^x+$/, (map { qr/^ok$/ } 1..20), qr/log_zmq main sent=0 .* sampled_out=0 queue_full=21 /,
+ (map { qr/^ok$/ } 21..40), qr/log_zmq main sent=0 .* sampled_out=[1-9]\d* /]
+--- timeout: 10
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: log_zmq_priority needs a byte limit
+--- http_config eval
+$::HttpConfig . q{
+    log_zmq_priority main $arg_p;
+}
+--- config eval: $::Config
+--- must_die
+--- error_log
+"log_zmq_priority" needs "log_zmq_max_queue_bytes" for "main"
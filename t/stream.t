@@ -0,0 +1,58 @@
+# vi:filetype=perl
+#
+# ngx_stream_log_zmq_module. Nothing listens on the endpoint, a PUB socket
+# takes the messages anyway, so the sessions must go on as without the
+# module. Needs nginx 1.11.4 or later built with --with-stream.
+
+use Test::Nginx::Socket 'no_plan';
+
+repeat_each(1);
+workers(1);
+master_on();
+no_shuffle();
+
+our $StreamConfig = q{
+    log_zmq_server main 127.0.0.1:5597 tcp 1 1000;
+    log_zmq_endpoint main "/stream/$protocol/";
+    log_zmq_format main '{"remote_addr":"$remote_addr","status":$status,"bytes_sent":$bytes_sent}';
+};
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: a session is logged
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    return "ok\n";
+--- stream_response
+ok
+--- no_error_log
+[error]
+[alert]
+
+
+
+=== TEST 2: log_zmq_off in the server
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    log_zmq_off main;
+    return "ok\n";
+--- stream_response
+ok
+--- no_error_log
+[error]
+[alert]
+
+
+
+=== TEST 3: log_zmq_server comes before the format of the definition
+--- stream_config
+    log_zmq_format main '$remote_addr';
+    log_zmq_server main 127.0.0.1:5597 tcp 1 1000;
+    log_zmq_endpoint main "/stream/";
+--- stream_server_config
+    return "ok\n";
+--- must_die
+--- error_log
+"log_zmq_format": "log_zmq_server" must be set before "main"
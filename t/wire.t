@@ -0,0 +1,137 @@
+# vi:filetype=perl
+#
+# Wire formats of ngx_http_log_zmq_module. Each test starts
+# tools/log_zmq_check.py on its endpoint before the requests, and the
+# checker must decode the messages nginx sends there. /sleep.txt is sent at
+# 1k/s, so the subscription of the checker is known by the socket created
+# by the first message before the next ones. Needs nginx built with threads
+# and libzstd, and python3 with pyzmq and pyarrow.
+
+use Test::Nginx::Socket;
+use Cwd qw(abs_path);
+use File::Basename qw(dirname);
+
+our $Check = abs_path(dirname(__FILE__) . "/../tools/log_zmq_check.py");
+our @Checks;
+
+if (system("python3 -c 'import zmq, pyarrow' 2>/dev/null") != 0) {
+    plan(skip_all => "python3 with pyzmq and pyarrow is needed");
+} else {
+    plan('no_plan');
+}
+
+# run by the init section of a test, returns once the checker listens
+sub start_check {
+    my ($port, @args) = @_;
+
+    open(my $fh, "-|", "python3", $Check, "-e", "tcp://127.0.0.1:$port", "-t", "10", @args)
+        or die "can't run $Check: $!";
+
+    my $bound = <$fh>;
+    die "$Check did not bind" unless defined $bound && $bound =~ /^bound /;
+
+    push @Checks, [join(" ", @args), $fh];
+}
+
+repeat_each(1);
+workers(1);
+master_on();
+no_shuffle();
+
+our $Config = q{
+    location = /sleep.txt {
+        log_zmq_off all;
+        limit_rate 1k;
+    }
+    location / {
+        return 200 "ok\n";
+    }
+};
+
+our $UserFiles = ">>> sleep.txt\n" . ("x" x 3072) . "\n";
+
+our $Requests = ["GET /r0", "GET /sleep.txt", map { "GET /r$_" } 1..5];
+our $Responses = [qr/^ok$/, qr/^x+$/, map { qr/^ok$/ } 1..5];
+
+run_tests();
+
+# the checkers exit once they decoded their messages, or after their timeout
+for my $c (@Checks) {
+    my ($name, $fh) = @$c;
+    my @out = <$fh>;
+    close($fh);
+    is($? >> 8, 0, "log_zmq_check.py $name") or diag(@out);
+}
+
+__DATA__
+
+=== TEST 1: dictionary batches
+--- http_config
+    log_zmq_server main 127.0.0.1:5591 tcp 1 1000;
+    log_zmq_thread_pool main default batch=100;
+    log_zmq_dictionary main $uri $request_method;
+    log_zmq_endpoint main "/t/";
+    log_zmq_format main '{"status":$status}';
+--- config eval: $::Config
+--- user_files eval: $::UserFiles
+--- init
+main::start_check(5591, "--fields", "uri,request_method", "--topic", "/t/",
+                  "--match", '^\{"status":200\}$', "dict");
+--- request eval: $::Requests
+--- response_body_like eval: $::Responses
+--- timeout: 10
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: zstd messages
+--- http_config
+    log_zmq_server main 127.0.0.1:5592 tcp 1 1000;
+    log_zmq_compress main zstd;
+    log_zmq_endpoint main "/t/";
+    log_zmq_format main '$request_uri';
+--- config eval: $::Config
+--- user_files eval: $::UserFiles
+--- init
+main::start_check(5592, "-n", "5", "--topic", "/t/", "--match", '^/r\d$', "zstd");
+--- request eval: $::Requests
+--- response_body_like eval: $::Responses
+--- timeout: 10
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: topic ids and their tables
+--- http_config
+    log_zmq_server main 127.0.0.1:5593 tcp 1 1000;
+    log_zmq_topic_ids main interval=100ms;
+    log_zmq_endpoint main "/t/";
+    log_zmq_format main '$request_uri';
+--- config eval: $::Config
+--- user_files eval: $::UserFiles
+--- init
+main::start_check(5593, "-n", "8", "--topic", "/t/", "--match", '^/r\d$', "topics");
+--- request eval: $::Requests
+--- response_body_like eval: $::Responses
+--- timeout: 10
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: Arrow batches
+--- http_config
+    log_zmq_server main 127.0.0.1:5594 tcp 1 1000;
+    log_zmq_thread_pool main default batch=100;
+    log_zmq_arrow main $uri $status:int $request_time:float;
+--- config eval: $::Config
+--- user_files eval: $::UserFiles
+--- init
+main::start_check(5594, "--schema", "uri:string,status:int,request_time:float", "arrow");
+--- request eval: $::Requests
+--- response_body_like eval: $::Responses
+--- timeout: 10
+--- no_error_log
+[error]
@@ -0,0 +1,69 @@
+# vi:filetype=perl
+#
+# The log_zmq_writable socket watch of ngx_http_log_zmq_module, checked
+# with the counters of log_zmq_status. Nothing listens on the endpoint:
+# the first message creates the socket and its monitor, which sees the
+# connect retries, and the messages after /sleep.txt (sent at 1k/s, so a
+# second later) are skipped. Needs libzmq 4.0 or later.
+
+use Test::Nginx::Socket 'no_plan';
+
+repeat_each(1);
+workers(1);
+master_on();
+no_shuffle();
+
+our $HttpConfig = q{
+    log_zmq_server main 127.0.0.1:5596 tcp 1 1000;
+    log_zmq_endpoint main "/t/";
+    log_zmq_format main '$request_uri';
+};
+
+our $Config = q{
+    location = /status {
+        log_zmq_off all;
+        log_zmq_status;
+    }
+    location = /sleep.txt {
+        log_zmq_off all;
+        limit_rate 1k;
+    }
+    location / {
+        return 200 "ok\n";
+    }
+};
+
+our $UserFiles = ">>> sleep.txt\n" . ("x" x 3072) . "\n";
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: the messages are skipped while no collector is connected
+--- http_config eval
+$::HttpConfig . q{
+    log_zmq_writable main;
+}
+--- config eval: $::Config
+--- user_files eval: $::UserFiles
+--- request eval
+["GET /r0", "GET /sleep.txt", (map { "GET /r$_" } 1..10), "GET /status"]
+--- response_body_like eval
+[qr/^ok$/, qr/^x+$/, (map { qr/^ok$/ } 1..10), qr/log_zmq main sent=1 .* not_writable=10\n/]
+--- timeout: 10
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: without the watch the messages go to the socket
+--- http_config eval: $::HttpConfig
+--- config eval: $::Config
+--- user_files eval: $::UserFiles
+--- request eval
+["GET /r0", "GET /sleep.txt", (map { "GET /r$_" } 1..10), "GET /status"]
+--- response_body_like eval
+[qr/^ok$/, qr/^x+$/, (map { qr/^ok$/ } 1..10), qr/log_zmq main sent=11 .* not_writable=0\n/]
+--- timeout: 10
+--- no_error_log
+[error]
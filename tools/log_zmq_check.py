@@ -0,0 +1,333 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2016 by Altice Labs
+#
+# Checks the wire format of ngx_http_log_zmq_module messages. Reads
+# captured messages (one file per message, the first frame only) or binds
+# a SUB socket and captures them, decodes each one and exits with 1 at the
+# first one that does not decode.
+#
+#   arrow    log_zmq_arrow batches: the topic, the NUL padding to 8 bytes
+#            and an Arrow IPC stream with one record batch
+#   dict     log_zmq_dictionary batches: the string table and the
+#            references of each message
+#   zstd     log_zmq_compress messages: the topic, a NUL byte, the
+#            dictionary id and a zstd frame
+#   topics   log_zmq_topic_ids messages and tables: each id is the hash of
+#            its topic and is found in a table
+#
+# usage: log_zmq_check.py [-e endpoint] [-n count] [-t timeout] [-o dir] [options] <format> [file...]
+
+import argparse
+import json
+import os
+import re
+import struct
+import subprocess
+import sys
+import zlib
+
+ARROW_TOPIC = b"/log_zmq/arrow/"
+ARROW_TYPES = {"string": "string", "int": "int64", "float": "double"}
+DICT_TOPIC = b"/log_zmq/batch/"
+DICT_VERSION = 1
+TOPICS_TOPIC = b"/log_zmq/topics/"
+
+
+def check_data(data, args):
+    if args.match is not None and not re.search(args.match, data.decode(errors="replace")):
+        raise ValueError("message %r does not match %r" % (data, args.match))
+
+
+def check_arrow(message, args, state):
+    import pyarrow
+    import pyarrow.ipc
+
+    end = message.find(b"\0")
+    if not message.startswith(ARROW_TOPIC) or end < 0:
+        raise ValueError("no %s topic" % ARROW_TOPIC.decode())
+
+    topic = message[:end]
+    off = (len(topic) + 1 + 7) // 8 * 8
+    if message[end:off].strip(b"\0"):
+        raise ValueError("topic padding is not NUL")
+
+    reader = pyarrow.ipc.open_stream(pyarrow.py_buffer(message[off:]))
+    batches = list(reader)
+    if len(batches) != 1:
+        raise ValueError("%d record batches, expected 1" % len(batches))
+
+    batch = batches[0]
+    schema = ",".join("%s:%s" % (f.name, f.type) for f in batch.schema)
+
+    for f in batch.schema:
+        if str(f.type) not in ARROW_TYPES.values():
+            raise ValueError("column %s has type %s" % (f.name, f.type))
+
+    if args.schema is not None:
+        expected = ",".join("%s:%s" % (n, ARROW_TYPES.get(t, t))
+                            for n, t in (c.split(":", 1) for c in args.schema.split(",")))
+        if schema != expected:
+            raise ValueError("schema %s, expected %s" % (schema, expected))
+
+    if args.rows is not None and batch.num_rows != args.rows:
+        raise ValueError("%d rows, expected %d" % (batch.num_rows, args.rows))
+
+    return "%s rows=%d columns=%s" % (topic.decode(errors="replace"), batch.num_rows, schema)
+
+
+def read_varint(message, off):
+    v = 0
+    shift = 0
+    while True:
+        if off >= len(message):
+            raise ValueError("truncated varint at %d" % off)
+        b = message[off]
+        off += 1
+        v |= (b & 0x7f) << shift
+        shift += 7
+        if not b & 0x80:
+            return v, off
+        if shift > 63:
+            raise ValueError("varint too long at %d" % off)
+
+
+def read_bytes(message, off, n):
+    if off + n > len(message):
+        raise ValueError("truncated at %d, %d bytes missing" % (off, off + n - len(message)))
+    return message[off:off + n], off + n
+
+
+def check_dict(message, args, state):
+    if not message.startswith(DICT_TOPIC):
+        raise ValueError("no %s topic" % DICT_TOPIC.decode())
+
+    # the definition name is followed by the version byte
+    off = len(DICT_TOPIC)
+    while off < len(message) and message[off] >= 0x20:
+        off += 1
+    topic = message[:off]
+
+    version, off = read_bytes(message, off, 1)
+    if version[0] != DICT_VERSION:
+        raise ValueError("version %d, expected %d" % (version[0], DICT_VERSION))
+
+    nf, off = read_bytes(message, off, 1)
+    names = []
+    for _ in range(nf[0]):
+        n, off = read_bytes(message, off, 1)
+        name, off = read_bytes(message, off, n[0])
+        names.append(name.decode(errors="replace"))
+
+    if args.fields is not None and names != args.fields.split(","):
+        raise ValueError("fields %s, expected %s" % (",".join(names), args.fields))
+
+    nstrings, off = read_varint(message, off)
+    strings = []
+    for _ in range(nstrings):
+        n, off = read_varint(message, off)
+        s, off = read_bytes(message, off, n)
+        strings.append(s)
+
+    if len(set(strings)) != len(strings):
+        raise ValueError("the string table has duplicates")
+
+    rows, off = read_varint(message, off)
+    for _ in range(rows):
+        refs = []
+        for _ in range(len(names) + 1):
+            ref, off = read_varint(message, off)
+            if ref >= nstrings:
+                raise ValueError("reference %d out of the %d strings" % (ref, nstrings))
+            refs.append(ref)
+
+        if args.topic is not None and strings[refs[0]] != args.topic.encode():
+            raise ValueError("endpoint %r, expected %r" % (strings[refs[0]], args.topic))
+
+        n, off = read_varint(message, off)
+        data, off = read_bytes(message, off, n)
+        check_data(data, args)
+
+    if off != len(message):
+        raise ValueError("%d bytes after the last message" % (len(message) - off))
+
+    if args.rows is not None and rows != args.rows:
+        raise ValueError("%d rows, expected %d" % (rows, args.rows))
+
+    return "%s rows=%d fields=%s strings=%d" % (topic.decode(errors="replace"), rows, ",".join(names), nstrings)
+
+
+def zstd_decompress(frame, dictionary):
+    try:
+        import zstandard
+    except ImportError:
+        cmd = ["zstd", "-q", "-d", "-c"] + (["-D", dictionary] if dictionary else [])
+        return subprocess.run(cmd, input=frame, stdout=subprocess.PIPE, check=True).stdout
+
+    d = zstandard.ZstdCompressionDict(open(dictionary, "rb").read()) if dictionary else None
+    return zstandard.ZstdDecompressor(dict_data=d).decompressobj().decompress(frame)
+
+
+def check_zstd(message, args, state):
+    end = message.find(b"\0")
+    if end < 0:
+        raise ValueError("no NUL after the topic")
+
+    topic = message[:end]
+    if args.topic is not None and topic != args.topic.encode():
+        raise ValueError("topic %r, expected %r" % (topic, args.topic))
+
+    dict_id, = struct.unpack_from("!I", message, end + 1)
+    frame = message[end + 5:]
+    if frame[:4] != b"\x28\xb5\x2f\xfd":
+        raise ValueError("no zstd frame after the dictionary id")
+
+    data = zstd_decompress(frame, args.dict)
+    check_data(data, args)
+
+    return "%s dict_id=%d size=%d/%d" % (topic.decode(errors="replace"), dict_id, len(frame), len(data))
+
+
+def topic_id(topic, size):
+    if size == 4:
+        return struct.pack("!I", zlib.crc32(topic))
+
+    h = 14695981039346656037
+    for b in topic:
+        h = ((h ^ b) * 1099511628211) & 0xffffffffffffffff
+    return struct.pack("!Q", h)
+
+
+def check_topics(message, args, state):
+    size = args.id_size
+    ids = state.setdefault("ids", {})
+    pending = state.setdefault("pending", [])
+
+    if message.startswith(TOPICS_TOPIC):
+        start = message.index(b"{")
+        table = json.loads(message[start:])
+
+        if table["id_size"] != size:
+            raise ValueError("id_size %d, expected %d" % (table["id_size"], size))
+
+        for t in table["topics"]:
+            topic = t["topic"].encode()
+            if bytes.fromhex(t["id"]) != topic_id(topic, size):
+                raise ValueError("id %s is not the hash of %r" % (t["id"], topic))
+            ids[t["id"]] = topic
+
+        state["tables"] = state.get("tables", 0) + 1
+        return "%s topics=%d" % (message[:start].decode(errors="replace"), len(table["topics"]))
+
+    tid, data = message[:size], message[size:]
+
+    # a topic without an id: the reserved id 0, its length and the topic
+    if tid == b"\0" * size:
+        n, = struct.unpack_from("!H", data)
+        topic, data = data[2:2 + n], data[2 + n:]
+        if len(topic) != n:
+            raise ValueError("plain topic truncated")
+        if args.topic is not None and topic != args.topic.encode():
+            raise ValueError("plain topic %r, expected %r" % (topic, args.topic))
+        check_data(data, args)
+        return "plain topic=%s" % topic.decode(errors="replace")
+
+    if args.topic is not None and tid != topic_id(args.topic.encode(), size):
+        raise ValueError("id %s is not the id of %r" % (tid.hex(), args.topic))
+
+    check_data(data, args)
+
+    # the table may have been sent before the capture started, it is sent again
+    pending.append(tid.hex())
+    return "id=%s" % tid.hex()
+
+
+def finish_topics(args, state):
+    if not state.get("tables"):
+        raise ValueError("no topics table")
+
+    for tid in state.get("pending", []):
+        if tid not in state["ids"]:
+            raise ValueError("id %s is in no table" % tid)
+
+
+CHECKS = {
+    "arrow": check_arrow,
+    "dict": check_dict,
+    "zstd": check_zstd,
+    "topics": check_topics,
+}
+
+FINISH = {
+    "topics": finish_topics,
+}
+
+
+def messages(args):
+    for path in args.files:
+        with open(path, "rb") as f:
+            yield path, f.read()
+
+    if args.endpoint is None:
+        return
+
+    import zmq
+
+    sock = zmq.Context().socket(zmq.SUB)
+    sock.bind(args.endpoint)
+    sock.setsockopt(zmq.SUBSCRIBE, b"")
+    sock.setsockopt(zmq.RCVTIMEO, int(args.timeout * 1000))
+
+    # the tests wait for this line before sending their requests
+    print("bound %s" % args.endpoint, flush=True)
+
+    for i in range(args.count):
+        try:
+            message = sock.recv_multipart()[0]
+        except zmq.Again:
+            raise ValueError("%d messages in %gs, expected %d" % (i, args.timeout, args.count))
+
+        name = "%s#%d" % (args.endpoint, i)
+        if args.output:
+            name = os.path.join(args.output, "%s-%d.bin" % (args.format, i))
+            with open(name, "wb") as f:
+                f.write(message)
+        yield name, message
+
+
+def main():
+    parser = argparse.ArgumentParser(description="check the wire format of log_zmq messages")
+    parser.add_argument("-e", "--endpoint", help="address to bind and capture from, like tcp://*:5555")
+    parser.add_argument("-n", "--count", type=int, default=1, help="messages to capture (default: 1)")
+    parser.add_argument("-t", "--timeout", type=float, default=10, help="seconds to wait for a message (default: 10)")
+    parser.add_argument("-o", "--output", help="directory to keep the captured messages in")
+    parser.add_argument("--rows", type=int, help="rows expected in each arrow or dict batch")
+    parser.add_argument("--schema", help="arrow columns expected, like host:string,status:int")
+    parser.add_argument("--fields", help="dict fields expected, like host,http_user_agent")
+    parser.add_argument("--topic", help="endpoint expected in each message")
+    parser.add_argument("--match", help="regular expression each message data must match")
+    parser.add_argument("--dict", help="zstd dictionary of log_zmq_compress")
+    parser.add_argument("--id-size", type=int, default=4, choices=(4, 8), help="size of the topic ids (default: 4)")
+    parser.add_argument("format", choices=sorted(CHECKS), help="wire format of the messages")
+    parser.add_argument("files", nargs="*", help="captured messages, one per file")
+    args = parser.parse_args()
+
+    if not args.files and args.endpoint is None:
+        parser.error("no files and no endpoint")
+
+    state = {}
+    name = args.endpoint
+
+    try:
+        for name, message in messages(args):
+            print("%s: %s" % (name, CHECKS[args.format](message, args, state)))
+
+        if args.format in FINISH:
+            FINISH[args.format](args, state)
+
+    except Exception as e:
+        sys.exit("%s: %s" % (name, e))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2016 by Altice Labs
+#
+# Reference collector for ngx_http_log_zmq_module messages sent with
+# log_zmq_envelope. Binds a SUB socket, prints the messages and reports
+# the sequence gaps of each host, pid and definition.
+#
+# usage: log_zmq_collector.py <endpoint> [topic]
+
+import struct
+import sys
+
+import zmq
+
+ENVELOPE = struct.Struct("!BBHIIQQ")
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit("usage: %s <endpoint> [topic]" % sys.argv[0])
+
+    sock = zmq.Context().socket(zmq.SUB)
+    sock.bind(sys.argv[1])
+    sock.setsockopt(zmq.SUBSCRIBE, sys.argv[2].encode() if len(sys.argv) > 2 else b"")
+
+    last = {}
+    lost = 0
+
+    while True:
+        frames = sock.recv_multipart()
+        if len(frames) < 2:
+            print(frames[0].decode(errors="replace"))
+            continue
+
+        version, hlen, slot, pid, definition, seq, usec = ENVELOPE.unpack_from(frames[1])
+        if version != 1:
+            continue
+
+        host = frames[1][ENVELOPE.size:ENVELOPE.size + hlen].decode(errors="replace")
+        key = (host, pid, definition)
+
+        prev = last.get(key)
+        if prev is not None and seq > prev + 1:
+            lost += seq - prev - 1
+            sys.stderr.write("gap: host=%s pid=%d slot=%d definition=%08x missing=%d..%d lost=%d\n"
+                             % (host, pid, slot, definition, prev + 1, seq - 1, lost))
+        last[key] = seq
+
+        print("%s %d %d %d %s" % (host, pid, seq, usec, frames[0].decode(errors="replace")))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2016 by Altice Labs
+#
+# Trains a zstd dictionary for log_zmq_compress from captured messages.
+# Subscribes to the messages of a definition (sent without compression),
+# removes the topic and gives the rest to "zstd --train".
+#
+# usage: log_zmq_train_dict.py [-n count] [-s size] <endpoint> <topic> <output>
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+import zmq
+
+
+def main():
+    parser = argparse.ArgumentParser(description="train a zstd dictionary for log_zmq_compress")
+    parser.add_argument("-n", "--count", type=int, default=10000, help="messages to capture (default: 10000)")
+    parser.add_argument("-s", "--size", type=int, default=112640, help="dictionary size in bytes (default: 110KB)")
+    parser.add_argument("endpoint", help="address to bind, like tcp://*:5555")
+    parser.add_argument("topic", help="log_zmq_endpoint of the definition, removed from each message")
+    parser.add_argument("output", help="dictionary file to write")
+    args = parser.parse_args()
+
+    topic = args.topic.encode()
+
+    sock = zmq.Context().socket(zmq.SUB)
+    sock.bind(args.endpoint)
+    sock.setsockopt(zmq.SUBSCRIBE, topic)
+
+    with tempfile.TemporaryDirectory() as samples:
+        for i in range(args.count):
+            # the envelope frame, if any, is not part of the sample
+            data = sock.recv_multipart()[0][len(topic):]
+            with open(os.path.join(samples, "%08d" % i), "wb") as f:
+                f.write(data)
+
+        rc = subprocess.call(["zstd", "--train", "-r", samples, "--maxdict=%d" % args.size, "-o", args.output])
+
+    sys.exit(rc)
+
+
+if __name__ == "__main__":
+    main()